@@ -14,18 +14,20 @@ public:
 	vec3 min() const { return _min; }
 	vec3 max() const { return _max; }
 	inline bool hit(const ray& r, float tmin, float tmax) const {
-		for (int a = 0; a < 3; a++) {
-			float invD = 1.0f / r.direction()[a];
-			float t0 = (min()[a] - r.origin()[a]) * invD;
-			float t1 = (max()[a] - r.origin()[a]) * invD;
-			if (invD < 0.0f)
-				std::swap(t0, t1);
-			tmin = t0 > tmin ? t0 : tmin;
-			tmax = t1 < tmax ? t1 : tmax;
-			if (tmax <= tmin)
-				return false;
-		}
-		return true;
+		return hit(r.origin(), vec3(1, 1, 1) / r.direction(), tmin, tmax);
+	}
+
+	// same test with the reciprocal direction worked out once per ray by the caller,
+	// all three slabs at once
+	inline bool hit(const vec3& origin, const vec3& inv_dir, float tmin, float tmax) const {
+		vec3 t0 = (_min - origin) * inv_dir;
+		vec3 t1 = (_max - origin) * inv_dir;
+		// clamp before taking min/max so a nan (origin on a slab, direction
+		// parallel to it) is dropped the same way the scalar test drops it
+		vec3 vtmin(tmin, tmin, tmin), vtmax(tmax, tmax, tmax);
+		float t_near = max_component(vmin(vmax(t0, vtmin), vmax(t1, vtmin)));
+		float t_far = min_component(vmax(vmin(t0, vtmax), vmin(t1, vtmax)));
+		return t_near < t_far;
 	}
 
 	//bool hit(const ray& r, float tmin, float tmax) const {
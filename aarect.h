@@ -6,92 +6,110 @@
 class xy_rect : public hitable {
 public:
 	xy_rect() {}
-	xy_rect(float _x0, float _x1, float _y0, float _y1, float _k, material *mat) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
+	xy_rect(float _x0, float _x1, float _y0, float _y1, float _k, material_id m) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mat(m) {};
 	virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const;
 	virtual bool bounding_box(float t0, float t1, aabb& box) const {
 		box = aabb(vec3(x0, y0, k - 0.0001), vec3(x1, y1, k + 0.0001));
 		return true;
 	}
-	material *mp;
+	material_id mat;
 	float x0, x1, y0, y1, k;
 };
 
 bool xy_rect::hit(const ray& r, float t0, float t1, hit_record& rec) const {
 	float t = (k - r.origin().z()) / r.direction().z();
-	if (t < t0 || t > t1)
+	// written so a NaN t (a ray in the rect's plane) is a miss
+	if (!(t >= t0 && t <= t1))
 		return false;
 	float x = r.origin().x() + t*r.direction().x();
 	float y = r.origin().y() + t*r.direction().y();
 	if (x < x0 || x > x1 || y < y0 || y > y1)
 		return false;
-	rec.u = (x - x0) / (x1 - x0);
-	rec.v = (y - y0) / (y1 - y0);
-	rec.t = t;
-	rec.mat_ptr = mp;
-	rec.p = r.point_at_parameter(t);
-	rec.normal = vec3(0, 0, 1);
+	rec.set_hit(t, this);
 	return true;
 }
 
+void xy_rect::surface_interaction(const ray& r, hit_record& rec) const {
+	rec.p = r.point_at_parameter(rec.t);
+	rec.u = (rec.p.x() - x0) / (x1 - x0);
+	rec.v = (rec.p.y() - y0) / (y1 - y0);
+	rec.uv_density = 1.0f / ffmin(x1 - x0, y1 - y0);
+	rec.mat = mat;
+	rec.normal = vec3(0, 0, 1);
+}
+
 class xz_rect : public hitable {
 public:
 	xz_rect() {}
-	xz_rect(float _x0, float _x1, float _z0, float _z1, float _k, material *mat) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+	xz_rect(float _x0, float _x1, float _z0, float _z1, float _k, material_id m) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mat(m) {};
 	virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const;
 	virtual bool bounding_box(float t0, float t1, aabb& box) const {
 		box = aabb(vec3(x0, k - 0.0001, z0), vec3(x1, k + 0.0001, z1));
 		return true;
 	}
-	material *mp;
+	material_id mat;
 	float x0, x1, z0, z1, k;
 };
 
 bool xz_rect::hit(const ray& r, float t0, float t1, hit_record& rec) const {
 	float t = (k - r.origin().y()) / r.direction().y();
-	if (t < t0 || t > t1)
+	// written so a NaN t (a ray in the rect's plane) is a miss
+	if (!(t >= t0 && t <= t1))
 		return false;
 	float x = r.origin().x() + t*r.direction().x();
 	float z = r.origin().z() + t*r.direction().z();
 	if (x < x0 || x > x1 || z < z0 || z > z1)
 		return false;
-	rec.u = (x - x0) / (x1 - x0);
-	rec.v = (z - z0) / (z1 - z0);
-	rec.t = t;
-	rec.mat_ptr = mp;
-	rec.p = r.point_at_parameter(t);
-	rec.normal = vec3(0, 1, 0);
+	rec.set_hit(t, this);
 	return true;
 }
 
+void xz_rect::surface_interaction(const ray& r, hit_record& rec) const {
+	rec.p = r.point_at_parameter(rec.t);
+	rec.u = (rec.p.x() - x0) / (x1 - x0);
+	rec.v = (rec.p.z() - z0) / (z1 - z0);
+	rec.uv_density = 1.0f / ffmin(x1 - x0, z1 - z0);
+	rec.mat = mat;
+	rec.normal = vec3(0, 1, 0);
+}
+
 class yz_rect : public hitable {
 public:
 	yz_rect() {}
-	yz_rect(float _y0, float _y1, float _z0, float _z1, float _k, material *mat) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+	yz_rect(float _y0, float _y1, float _z0, float _z1, float _k, material_id m) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mat(m) {};
 	virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const;
 	virtual bool bounding_box(float t0, float t1, aabb& box) const {
 		box = aabb(vec3(k - 0.0001, y0, z0), vec3(k + 0.0001, y1, z1));
 		return true;
 	}
-	material *mp;
+	material_id mat;
 	float y0, y1, z0, z1, k;
 };
 
 bool yz_rect::hit(const ray& r, float t0, float t1, hit_record& rec) const {
 	float t = (k - r.origin().x()) / r.direction().x();
-	if (t < t0 || t > t1)
+	// written so a NaN t (a ray in the rect's plane) is a miss
+	if (!(t >= t0 && t <= t1))
 		return false;
 	float y = r.origin().y() + t*r.direction().y();
 	float z = r.origin().z() + t*r.direction().z();
 	if (y < y0 || y > y1 || z < z0 || z > z1)
 		return false;
-	rec.u = (y - y0) / (y1 - y0);
-	rec.v = (z - z0) / (z1 - z0);
-	rec.t = t;
-	rec.mat_ptr = mp;
-	rec.p = r.point_at_parameter(t);
-	rec.normal = vec3(1, 0, 0);
+	rec.set_hit(t, this);
 	return true;
 }
 
+void yz_rect::surface_interaction(const ray& r, hit_record& rec) const {
+	rec.p = r.point_at_parameter(rec.t);
+	rec.u = (rec.p.y() - y0) / (y1 - y0);
+	rec.v = (rec.p.z() - z0) / (z1 - z0);
+	rec.uv_density = 1.0f / ffmin(y1 - y0, z1 - z0);
+	rec.mat = mat;
+	rec.normal = vec3(1, 0, 0);
+}
+
 #endif // !AARECTH
 
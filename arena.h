@@ -0,0 +1,212 @@
+#ifndef ARENAH
+#define ARENAH
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+#include <utility>
+#include <type_traits>
+#include "memory_stats.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Bump allocator that a whole scene is built out of. Nothing is freed on its
+// own; release() (or the destructor) drops every block at once and reset()
+// keeps the blocks around for the next scene. Objects with non-trivial
+// destructors made through make() get their destructors run first.
+// Every allocation is booked in mem_stats under a category, the unused rest
+// of the blocks shows up as MEM_ARENA_SLACK.
+// One arena per scene means scenes built on different threads never touch a
+// shared allocator lock.
+class arena {
+public:
+	arena(size_t block = 1 << 20, bool huge = false) : block_size(block), huge_pages(huge), cur(nullptr), cur_end(nullptr), cur_block(0), used(0), reserved(0) {
+		for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+			used_by[i] = 0;
+	}
+	~arena() { release(); }
+
+	inline void *alloc(size_t size, size_t align = 16, mem_category cat = MEM_GEOMETRY) {
+		uintptr_t p = (uintptr_t(cur) + align - 1) & ~uintptr_t(align - 1);
+		if (!cur || p + size > uintptr_t(cur_end)) {
+			new_block(size + align);
+			p = (uintptr_t(cur) + align - 1) & ~uintptr_t(align - 1);
+		}
+		// alignment padding goes to the allocation that needed it
+		size_t taken = p + size - uintptr_t(cur);
+		mem_stats.claim(MEM_ARENA_SLACK, cat, taken);
+		used_by[cat] += taken;
+		cur = (char *)(p + size);
+		used += size;
+		return (void *)p;
+	}
+
+	template <class T, class... Args>
+	T *make(Args&&... args) {
+		T *obj = new (alloc(sizeof(T), alignof(T) < 16 ? 16 : alignof(T), mem_category_of<T>::value)) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value)
+			dtors.push_back(dtor_entry{ obj, [](void *p) { static_cast<T *>(p)->~T(); } });
+		return obj;
+	}
+
+	// uninitialised storage for n plain objects (pointer lists and the like)
+	template <class T>
+	T *make_array(size_t n, mem_category cat = MEM_GEOMETRY) {
+		static_assert(std::is_trivially_destructible<T>::value, "make_array is for plain data");
+		return static_cast<T *>(alloc(n * sizeof(T), alignof(T) < 16 ? 16 : alignof(T), cat));
+	}
+
+	void reset();
+	void release();
+	size_t bytes_used() const { return used; }
+	size_t bytes_reserved() const { return reserved; }
+
+private:
+	struct block {
+		char *mem;
+		size_t size;
+		bool mapped;
+	};
+	struct dtor_entry {
+		void *obj;
+		void(*fn)(void *);
+	};
+	arena(const arena&) = delete;
+	arena& operator=(const arena&) = delete;
+	void new_block(size_t min_size);
+
+	size_t block_size;
+	bool huge_pages;
+	char *cur;
+	char *cur_end;
+	size_t cur_block;
+	size_t used;
+	size_t reserved;
+	size_t used_by[MEM_CATEGORY_COUNT];	// bytes claimed from the blocks per category
+	std::vector<block> blocks;
+	std::vector<dtor_entry> dtors;
+};
+
+void arena::new_block(size_t min_size) {
+	// after a reset() the blocks we already have are handed out again first
+	for (size_t i = cur ? cur_block + 1 : 0; i < blocks.size(); i++) {
+		if (blocks[i].size >= min_size) {
+			cur_block = i;
+			cur = blocks[i].mem;
+			cur_end = blocks[i].mem + blocks[i].size;
+			return;
+		}
+	}
+	size_t size = min_size > block_size ? min_size : block_size;
+	block b = { nullptr, size, false };
+	if (huge_pages) {
+#ifdef _WIN32
+		// needs SeLockMemoryPrivilege, we fall back to normal pages without it
+		size_t large = GetLargePageMinimum();
+		if (large) {
+			size_t rounded = (size + large - 1) & ~(large - 1);
+			b.mem = (char *)VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (b.mem) {
+				b.size = rounded;
+				b.mapped = true;
+			}
+		}
+#else
+		const size_t huge_page = 2 << 20;
+		size_t rounded = (size + huge_page - 1) & ~(huge_page - 1);
+		void *p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+			madvise(p, rounded, MADV_HUGEPAGE);
+#endif
+			b.mem = (char *)p;
+			b.size = rounded;
+			b.mapped = true;
+		}
+#endif
+	}
+	if (!b.mem)
+		b.mem = (char *)::operator new(size);
+	blocks.push_back(b);
+	cur_block = blocks.size() - 1;
+	reserved += b.size;
+	mem_stats.add(MEM_ARENA_SLACK, b.size);
+	cur = b.mem;
+	cur_end = b.mem + b.size;
+}
+
+void arena::reset() {
+	for (size_t i = dtors.size(); i-- > 0;)
+		dtors[i].fn(dtors[i].obj);
+	dtors.clear();
+	for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+		if (used_by[i])
+			mem_stats.unclaim(mem_category(i), MEM_ARENA_SLACK, used_by[i]);
+		used_by[i] = 0;
+	}
+	cur = cur_end = nullptr;
+	cur_block = 0;
+	used = 0;
+}
+
+void arena::release() {
+	reset();
+	for (size_t i = 0; i < blocks.size(); i++) {
+		mem_stats.sub(MEM_ARENA_SLACK, blocks[i].size);
+		if (!blocks[i].mapped)
+			::operator delete(blocks[i].mem);
+#ifdef _WIN32
+		else
+			VirtualFree(blocks[i].mem, 0, MEM_RELEASE);
+#else
+		else
+			munmap(blocks[i].mem, blocks[i].size);
+#endif
+	}
+	blocks.clear();
+	reserved = 0;
+}
+
+// lets std containers live in an arena, deallocate is a no-op there
+template <class T>
+struct arena_allocator {
+	typedef T value_type;
+	arena_allocator(arena *a = nullptr, mem_category c = MEM_GEOMETRY) : mem(a), cat(c) {}
+	template <class U> arena_allocator(const arena_allocator<U>& other) : mem(other.mem), cat(other.cat) {}
+	T *allocate(size_t n) {
+		if (mem)
+			return static_cast<T *>(mem->alloc(n * sizeof(T), alignof(T) < 16 ? 16 : alignof(T), cat));
+		mem_stats.add(cat, n * sizeof(T));
+		return static_cast<T *>(::operator new(n * sizeof(T)));
+	}
+	void deallocate(T *p, size_t n) {
+		if (!mem) {
+			mem_stats.sub(cat, n * sizeof(T));
+			::operator delete(p);
+		}
+	}
+	arena *mem;
+	mem_category cat;
+};
+
+template <class T, class U>
+bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) { return a.mem == b.mem; }
+template <class T, class U>
+bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) { return a.mem != b.mem; }
+
+// allocates from the arena when there is one, plain new otherwise
+template <class T, class... Args>
+T *arena_new(arena *a, Args&&... args) {
+	if (a)
+		return a->make<T>(std::forward<Args>(args)...);
+	return new T(std::forward<Args>(args)...);
+}
+
+#endif // !ARENAH
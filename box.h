@@ -2,34 +2,76 @@
 #define BOXH
 #include "hitable.h"
 
+// Axis aligned box. Hit with a slab test instead of six rects under a bvh_node;
+// the faces, normals and uvs match what the rect version produced.
 class box : public hitable {
 public:
 	box() {}
-	box(const vec3& p0, const vec3& p1, material *ptr);
+	box(const vec3& p0, const vec3& p1, material_id m) : pmin(p0), pmax(p1), mat(m) {}
 	virtual bool hit(const ray& r, float t0, float r1, hit_record& rec) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const;
+	virtual bool interval(const ray& r, float& t_in, float& t_out) const;
 	virtual bool bounding_box(float t0, float t1, aabb& box) const {
 		box = aabb(pmin, pmax);
 		return true;
 	}
 	vec3 pmin, pmax;
-	hitable *list_ptr;
+	material_id mat;
 };
 
-box::box(const vec3& p0, const vec3& p1, material *ptr) {
-	pmin = p0;
-	pmax = p1;
-	hitable **list = new hitable*[6];
-	list[0] = new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
-	list[1] = new flip_normals(new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
-	list[2] = new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
-	list[3] = new flip_normals(new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
-	list[4] = new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
-	list[5] = new flip_normals(new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
-	list_ptr = new bvh_node(list, 6, 0.0f, 1.0f);
+// the slab test, entry and exit over the whole line
+bool box::interval(const ray& r, float& t_near, float& t_far) const {
+	t_near = -FLT_MAX;
+	t_far = FLT_MAX;
+	for (int a = 0; a < 3; a++) {
+		float invD = 1.0f / r.direction()[a];
+		float ta = (pmin[a] - r.origin()[a]) * invD;
+		float tb = (pmax[a] - r.origin()[a]) * invD;
+		if (invD < 0.0f)
+			std::swap(ta, tb);
+		t_near = ta > t_near ? ta : t_near;
+		t_far = tb < t_far ? tb : t_far;
+		if (t_far < t_near)
+			return false;
+	}
+	return true;
 }
 
 bool box::hit(const ray& r, float t0, float t1, hit_record& rec) const {
-	return list_ptr->hit(r, t0, t1, rec);
+	float t_near, t_far;
+	if (!interval(r, t_near, t_far))
+		return false;
+	// the faces are two sided, so from inside the box we hit the exit face
+	float t = t_near;
+	if (!(t > t0 && t < t1))
+		t = t_far;
+	if (!(t > t0 && t < t1))
+		return false;
+	rec.set_hit(t, this);
+	return true;
+}
+
+void box::surface_interaction(const ray& r, hit_record& rec) const {
+	rec.p = r.point_at_parameter(rec.t);
+	// the face we are on is the one the hit point is closest to
+	int axis = 0;
+	bool max_side = false;
+	float best = FLT_MAX;
+	for (int a = 0; a < 3; a++) {
+		float dmin = fabs(rec.p[a] - pmin[a]);
+		float dmax = fabs(rec.p[a] - pmax[a]);
+		if (dmin < best) { best = dmin; axis = a; max_side = false; }
+		if (dmax < best) { best = dmax; axis = a; max_side = true; }
+	}
+	// same parameterisation as xy_rect, xz_rect and yz_rect
+	int ua = axis == 0 ? 1 : 0;
+	int va = axis == 2 ? 1 : 2;
+	rec.u = (rec.p[ua] - pmin[ua]) / (pmax[ua] - pmin[ua]);
+	rec.v = (rec.p[va] - pmin[va]) / (pmax[va] - pmin[va]);
+	rec.uv_density = 1.0f / ffmin(pmax[ua] - pmin[ua], pmax[va] - pmin[va]);
+	rec.normal = vec3(0, 0, 0);
+	rec.normal[axis] = max_side ? 1.0f : -1.0f;
+	rec.mat = mat;
 }
 
 #endif // !BOXH
@@ -2,11 +2,12 @@
 #define BVHH
 
 #include "hitable.h"
+#include "arena.h"
 
 class bvh_node : public hitable {
 public:
 	bvh_node() {}
-	bvh_node(hitable **l, int n, float time0, float time1);
+	bvh_node(hitable **l, int n, float time0, float time1, arena *a = nullptr);
 	virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
 	virtual bool bounding_box(float t0, float t1, aabb& box) const;
 	hitable *left;
@@ -14,6 +15,11 @@ public:
 	aabb box;
 };
 
+template <>
+struct mem_category_of<bvh_node> {
+	static const mem_category value = MEM_BVH;
+};
+
 int box_x_compare(const void * a, const void * b) {
 	aabb box_left, box_right;
 	hitable *ah = *(hitable**)a;
@@ -50,7 +56,8 @@ int box_z_compare(const void * a, const void * b) {
 		return 1;
 }
 
-bvh_node::bvh_node(hitable **l, int n, float time0, float time1) {
+// child nodes come out of a when given, otherwise from the heap
+bvh_node::bvh_node(hitable **l, int n, float time0, float time1, arena *a) {
 	int axis = int(3 * get_rand());
 	if (axis == 0)
 		qsort(l, n, sizeof(hitable *), box_x_compare);
@@ -66,8 +73,8 @@ bvh_node::bvh_node(hitable **l, int n, float time0, float time1) {
 		right = l[1];
 	}
 	else {
-		left = new bvh_node(l, n / 2, time0, time1);
-		right = new bvh_node(l + n / 2, n - n / 2, time0, time1);
+		left = arena_new<bvh_node>(a, l, n / 2, time0, time1, a);
+		right = arena_new<bvh_node>(a, l + n / 2, n - n / 2, time0, time1, a);
 	}
 	aabb box_left, box_right;
 	if (!left->bounding_box(time0, time1, box_left) || !right->bounding_box(time0, time1, box_right))
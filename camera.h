@@ -2,17 +2,10 @@
 #define CAMERAH
 
 #include "ray.h"
+#include "simd.h"
+#include "sampling.h"
 
 const extern float _pi;
-float get_rand();
-
-vec3 random_in_unit_disk() {
-	vec3 p;	
-	do {
-		p = 2.0*vec3(get_rand(), get_rand(), 0) - vec3(1, 1, 0);
-	} while (dot(p, p) >= 1.0);
-	return p;
-}
 
 class camera {
 public:
@@ -30,12 +23,26 @@ public:
 		lower_left_corner = origin - half_width*focus_dist*u - half_height*focus_dist*v - focus_dist*w;
 		horizontal = 2 * half_width*focus_dist*u;
 		vertical = 2 * half_height*focus_dist*v;
+		pixel_spread = 0.0f;
 	}
-	ray get_ray(float s, float t) { 
-		vec3 rd = lens_radius*random_in_unit_disk();
+	// Rays are as wide as a pixel on the focus plane, where t = 1. Until this
+	// is called they have no width and textures are read at full resolution.
+	void set_resolution(int ny) { pixel_spread = vertical.length() / ny; }
+	// lens is where on the aperture the ray starts, shutter when in [time0, time1] it leaves
+	ray get_ray(float s, float t, const sample2& lens, float shutter) {
+		vec3 rd = lens_radius*sample_disk(lens);
 		vec3 offset = u * rd.x() + v * rd.y();
-		float time = time0 + get_rand()*(time1 - time0);
-		return ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset, time);
+		float time = time0 + shutter*(time1 - time0);
+		return ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset, time, 0.0f, pixel_spread);
+	}
+	// one ray per lane of s and t
+	template <int N>
+	rayx<N> get_ray(floatx<N> s, floatx<N> t, floatx<N> lens_x, floatx<N> lens_y, floatx<N> shutter) {
+		vec3x<N> rd = lens_radius*sample_disk<N>(lens_x, lens_y);
+		vec3x<N> offset = vec3x<N>(u)*rd.x + vec3x<N>(v)*rd.y;
+		floatx<N> time = time0 + shutter*(time1 - time0);
+		vec3x<N> o = vec3x<N>(origin) + offset;
+		return rayx<N>(o, vec3x<N>(lower_left_corner) + s*vec3x<N>(horizontal) + t*vec3x<N>(vertical) - o, time);
 	}
 
 	vec3 origin;
@@ -45,6 +52,7 @@ public:
 	vec3 u, v, w;
 	float time0, time1;		// shutter open close times
 	float lens_radius;
+	float pixel_spread;
 };
 
 #endif
\ No newline at end of file
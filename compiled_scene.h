@@ -0,0 +1,445 @@
+#ifndef COMPILEDSCENEH
+#define COMPILEDSCENEH
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include "hitable.h"
+#include "arena.h"
+#include "hitable_list.h"
+#include "sphere.h"
+#include "aarect.h"
+#include "box.h"
+#include "triangle.h"
+#include "constant_medium.h"
+#include "transform.h"
+
+// The hitable classes are how scenes get written. compile_scene() flattens the
+// tree into one array per primitive type and builds a flat bvh whose leaves
+// point at them by (type, index), so traversal can switch on the type and call
+// the non-virtual hit directly.
+enum prim_type {
+	PRIM_SPHERE,
+	PRIM_MOVING_SPHERE,
+	PRIM_TRIANGLE,
+	PRIM_XY_RECT,
+	PRIM_XZ_RECT,
+	PRIM_YZ_RECT,
+	PRIM_BOX,
+	PRIM_MEDIUM,
+	PRIM_INSTANCE,
+	PRIM_OTHER		// anything we don't know about, hit through the vtable
+};
+
+// type in the top 4 bits, flip_normals in bit 27, index below that
+typedef uint32_t prim_ref;
+const uint32_t PRIM_FLIP_BIT = 1u << 27;
+const uint32_t PRIM_INDEX_MASK = PRIM_FLIP_BIT - 1;
+
+inline prim_ref make_prim_ref(prim_type type, size_t index, bool flip) {
+	return (uint32_t(type) << 28) | (flip ? PRIM_FLIP_BIT : 0) | uint32_t(index);
+}
+inline prim_type ref_type(prim_ref ref) { return prim_type(ref >> 28); }
+inline uint32_t ref_index(prim_ref ref) { return ref & PRIM_INDEX_MASK; }
+inline bool ref_flip(prim_ref ref) { return (ref & PRIM_FLIP_BIT) != 0; }
+
+// interior nodes keep the left child right after them and the right child at
+// offset, leaves keep count refs starting at offset
+struct flat_node {
+	aabb box;
+	int offset;
+	int count;
+	int axis;	// split axis, picks which child to visit first
+};
+
+const int MAX_LEAF_PRIMS = 4;
+const int PRIM_TYPE_COUNT = PRIM_OTHER + 1;
+
+template <class T> using scene_vector = std::vector<T, arena_allocator<T> >;
+
+class compiled_scene final : public hitable {
+public:
+	// the arrays and bvh live in mem when it's given, they are only copied
+	// in once the primitive counts are known
+	compiled_scene(arena *a = nullptr) : mem(a), spheres(a), moving_spheres(a), triangles(a), xy_rects(a), xz_rects(a),
+		yz_rects(a), boxes(a), media(a), instances(a), others(a), refs(arena_allocator<prim_ref>(a, MEM_BVH)),
+		nodes(arena_allocator<flat_node>(a, MEM_BVH)) {}
+	~compiled_scene();
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+	virtual bool occluded(const ray& r, float t_min, float t_max) const;
+	virtual float transmittance(const ray& r, float t_min, float t_max) const;
+	virtual bool bounding_box(float t0, float t1, aabb& box) const {
+		if (nodes.empty())
+			return false;
+		box = nodes[0].box;
+		return true;
+	}
+	void add(hitable *h, bool flip);
+	void build();
+
+	arena *mem;
+	scene_vector<sphere> spheres;
+	scene_vector<moving_sphere> moving_spheres;
+	scene_vector<triangle> triangles;
+	scene_vector<xy_rect> xy_rects;
+	scene_vector<xz_rect> xz_rects;
+	scene_vector<yz_rect> yz_rects;
+	scene_vector<box> boxes;
+	scene_vector<constant_medium> media;
+	scene_vector<transform> instances;	// ptr points at a compiled_scene of our own
+	scene_vector<hitable *> others;
+
+	scene_vector<prim_ref> refs;
+	scene_vector<flat_node> nodes;
+
+private:
+	inline bool hit_prim(prim_ref ref, const ray& r, float t_min, float t_max, hit_record& rec) const;
+	void push(prim_type type, hitable *h, bool flip) {
+		pending_refs.push_back(make_prim_ref(type, type_counts[type]++, flip));
+		pending.push_back(h);
+	}
+
+	// filled by add(), turned into the arrays above by build()
+	std::vector<prim_ref> pending_refs;
+	std::vector<hitable *> pending;
+	size_t type_counts[PRIM_TYPE_COUNT] = { 0 };
+};
+
+template <>
+struct mem_category_of<compiled_scene> {
+	static const mem_category value = MEM_BVH;
+};
+
+hitable *compile_scene(hitable *root, arena *a = nullptr);
+
+compiled_scene::~compiled_scene() {
+	// sub-scenes in an arena go away with it; the others came from
+	// compile_scene() and are deleted as the compiled_scene they are, hitable
+	// has no virtual destructor
+	if (!mem) {
+		for (size_t i = 0; i < instances.size(); i++)
+			delete static_cast<compiled_scene *>(instances[i].ptr);
+	}
+}
+
+void compiled_scene::add(hitable *h, bool flip) {
+	if (bvh_node *node = dynamic_cast<bvh_node *>(h)) {
+		add(node->left, flip);
+		if (node->right != node->left)
+			add(node->right, flip);
+	}
+	else if (hitable_list *list = dynamic_cast<hitable_list *>(h)) {
+		for (int i = 0; i < list->list_size; i++)
+			add(list->list[i], flip);
+	}
+	else if (flip_normals *f = dynamic_cast<flip_normals *>(h))
+		add(f->ptr, !flip);
+	else if (dynamic_cast<moving_sphere *>(h))
+		push(PRIM_MOVING_SPHERE, h, flip);
+	else if (dynamic_cast<sphere *>(h))
+		push(PRIM_SPHERE, h, flip);
+	else if (dynamic_cast<triangle *>(h))
+		push(PRIM_TRIANGLE, h, flip);
+	else if (dynamic_cast<xy_rect *>(h))
+		push(PRIM_XY_RECT, h, flip);
+	else if (dynamic_cast<xz_rect *>(h))
+		push(PRIM_XZ_RECT, h, flip);
+	else if (dynamic_cast<yz_rect *>(h))
+		push(PRIM_YZ_RECT, h, flip);
+	else if (dynamic_cast<box *>(h))
+		push(PRIM_BOX, h, flip);
+	else if (dynamic_cast<constant_medium *>(h))
+		push(PRIM_MEDIUM, h, flip);
+	else if (dynamic_cast<transform *>(h) || dynamic_cast<translate *>(h) || dynamic_cast<rotate_y *>(h)) {
+		transform *t = dynamic_cast<transform *>(h);
+		transform *inst;
+		if (t)
+			inst = arena_new<transform>(mem, *t);
+		else
+			inst = static_cast<transform *>(collapse_transforms(h, mem));
+		inst->ptr = compile_scene(inst->ptr, mem);
+		push(PRIM_INSTANCE, inst, flip);
+	}
+	else
+		push(PRIM_OTHER, h, flip);
+}
+
+inline bool compiled_scene::hit_prim(prim_ref ref, const ray& r, float t_min, float t_max, hit_record& rec) const {
+	uint32_t i = ref_index(ref);
+	// qualified calls so the compiler doesn't go through the vtable
+	switch (ref_type(ref)) {
+	case PRIM_SPHERE:			return spheres[i].sphere::hit(r, t_min, t_max, rec);
+	case PRIM_MOVING_SPHERE:	return moving_spheres[i].moving_sphere::hit(r, t_min, t_max, rec);
+	case PRIM_TRIANGLE:			return triangles[i].triangle::hit(r, t_min, t_max, rec);
+	case PRIM_XY_RECT:			return xy_rects[i].xy_rect::hit(r, t_min, t_max, rec);
+	case PRIM_XZ_RECT:			return xz_rects[i].xz_rect::hit(r, t_min, t_max, rec);
+	case PRIM_YZ_RECT:			return yz_rects[i].yz_rect::hit(r, t_min, t_max, rec);
+	case PRIM_BOX:				return boxes[i].box::hit(r, t_min, t_max, rec);
+	case PRIM_MEDIUM:			return media[i].constant_medium::hit(r, t_min, t_max, rec);
+	case PRIM_INSTANCE:			return instances[i].transform::hit(r, t_min, t_max, rec);
+	default:					return others[i]->hit(r, t_min, t_max, rec);
+	}
+}
+
+bool compiled_scene::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	if (nodes.empty())
+		return false;
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	bool hit_anything = false;
+	float closest_so_far = t_max;
+	vec3 origin = r.origin();
+	vec3 inv_dir(1.0f / r.direction().x(), 1.0f / r.direction().y(), 1.0f / r.direction().z());
+	while (sp > 0) {
+		const flat_node& node = nodes[stack[--sp]];
+		if (!node.box.hit(origin, inv_dir, t_min, closest_so_far))
+			continue;
+		if (node.count > 0) {
+			for (int i = node.offset; i < node.offset + node.count; i++) {
+				prim_ref ref = refs[i];
+				if (hit_prim(ref, r, t_min, closest_so_far, rec)) {
+					hit_anything = true;
+					closest_so_far = rec.t;
+					if (ref_flip(ref)) {
+						if (rec.resolved)
+							rec.normal = -rec.normal;
+						else
+							rec.flip = !rec.flip;
+					}
+				}
+			}
+		}
+		else {
+			// push the far child first so the near one is popped next
+			int left = int(&node - &nodes[0]) + 1;
+			if (inv_dir[node.axis] < 0) {
+				stack[sp++] = left;
+				stack[sp++] = node.offset;
+			}
+			else {
+				stack[sp++] = node.offset;
+				stack[sp++] = left;
+			}
+		}
+	}
+	return hit_anything;
+}
+
+bool compiled_scene::occluded(const ray& r, float t_min, float t_max) const {
+	if (nodes.empty())
+		return false;
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	hit_record rec;
+	vec3 origin = r.origin();
+	vec3 inv_dir(1.0f / r.direction().x(), 1.0f / r.direction().y(), 1.0f / r.direction().z());
+	while (sp > 0) {
+		const flat_node& node = nodes[stack[--sp]];
+		if (!node.box.hit(origin, inv_dir, t_min, t_max))
+			continue;
+		if (node.count > 0) {
+			for (int i = node.offset; i < node.offset + node.count; i++)
+				if (hit_prim(refs[i], r, t_min, t_max, rec))
+					return true;
+		}
+		else {
+			stack[sp++] = node.offset;
+			stack[sp++] = int(&node - &nodes[0]) + 1;
+		}
+	}
+	return false;
+}
+
+// Like occluded(), but media along the way let part of the light through
+// instead of stopping it where they happen to sample a scattering event.
+float compiled_scene::transmittance(const ray& r, float t_min, float t_max) const {
+	if (nodes.empty())
+		return 1.0f;
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	hit_record rec;
+	float through = 1.0f;
+	vec3 origin = r.origin();
+	vec3 inv_dir(1.0f / r.direction().x(), 1.0f / r.direction().y(), 1.0f / r.direction().z());
+	while (sp > 0) {
+		const flat_node& node = nodes[stack[--sp]];
+		if (!node.box.hit(origin, inv_dir, t_min, t_max))
+			continue;
+		if (node.count > 0) {
+			for (int i = node.offset; i < node.offset + node.count; i++) {
+				prim_ref ref = refs[i];
+				uint32_t k = ref_index(ref);
+				switch (ref_type(ref)) {
+				case PRIM_MEDIUM:	through *= media[k].constant_medium::transmittance(r, t_min, t_max); break;
+				case PRIM_INSTANCE:	through *= instances[k].transform::transmittance(r, t_min, t_max); break;
+				case PRIM_OTHER:	through *= others[k]->transmittance(r, t_min, t_max); break;
+				default:			through *= hit_prim(ref, r, t_min, t_max, rec) ? 0.0f : 1.0f; break;
+				}
+				if (through <= 0.0f)
+					return 0.0f;
+			}
+		}
+		else {
+			stack[sp++] = node.offset;
+			stack[sp++] = int(&node - &nodes[0]) + 1;
+		}
+	}
+	return through;
+}
+
+inline float surface_area(const aabb& b) {
+	vec3 d = b.max() - b.min();
+	return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+const int SAH_BINS = 12;
+
+// Appends a binned SAH bvh over order[begin, end) to nodes and returns its root.
+// order holds indices into prim_boxes/centroids and gets partitioned in place,
+// leaves end up referring to ranges of it. Leaves stop splitting at max_leaf
+// primitives once a split no longer pays for itself.
+template <class Nodes>
+int build_sah_node(Nodes& nodes, std::vector<int>& order, const std::vector<aabb>& prim_boxes, const std::vector<vec3>& centroids, int begin, int end, int max_leaf = MAX_LEAF_PRIMS) {
+	int index = int(nodes.size());
+	nodes.push_back(flat_node());
+	aabb bounds = prim_boxes[order[begin]];
+	vec3 cmin = centroids[order[begin]], cmax = cmin;
+	for (int i = begin + 1; i < end; i++) {
+		bounds = surrounding_box(bounds, prim_boxes[order[i]]);
+		for (int a = 0; a < 3; a++) {
+			cmin[a] = ffmin(cmin[a], centroids[order[i]][a]);
+			cmax[a] = ffmax(cmax[a], centroids[order[i]][a]);
+		}
+	}
+	nodes[index].box = bounds;
+	nodes[index].offset = begin;
+	nodes[index].count = end - begin;
+	nodes[index].axis = 0;
+	int n = end - begin;
+	if (n == 1)
+		return index;
+
+	// binned surface area heuristic, cost of a leaf is one hit per primitive
+	// and a box test costs about the same as a hit
+	float best_cost = FLT_MAX;
+	int best_axis = -1, best_split = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		float extent = cmax[axis] - cmin[axis];
+		if (extent <= 0.0f)
+			continue;
+		int counts[SAH_BINS] = { 0 };
+		aabb bin_boxes[SAH_BINS];
+		for (int i = begin; i < end; i++) {
+			int bin = int(SAH_BINS * (centroids[order[i]][axis] - cmin[axis]) / extent);
+			if (bin == SAH_BINS) bin = SAH_BINS - 1;
+			bin_boxes[bin] = counts[bin]++ ? surrounding_box(bin_boxes[bin], prim_boxes[order[i]]) : prim_boxes[order[i]];
+		}
+		float right_area[SAH_BINS];
+		int right_count[SAH_BINS];
+		aabb acc;
+		int count = 0;
+		for (int i = SAH_BINS - 1; i > 0; i--) {
+			if (counts[i])
+				acc = count ? surrounding_box(acc, bin_boxes[i]) : bin_boxes[i];
+			count += counts[i];
+			right_count[i] = count;
+			right_area[i] = count ? surface_area(acc) : 0.0f;
+		}
+		count = 0;
+		for (int i = 0; i < SAH_BINS - 1; i++) {
+			if (counts[i])
+				acc = count ? surrounding_box(acc, bin_boxes[i]) : bin_boxes[i];
+			count += counts[i];
+			if (count == 0 || right_count[i + 1] == 0)
+				continue;
+			float cost = 1.0f + (count * surface_area(acc) + right_count[i + 1] * right_area[i + 1]) / surface_area(bounds);
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i;
+			}
+		}
+	}
+	if (best_axis < 0 || (n <= max_leaf && best_cost >= n))
+		return index;
+
+	float extent = cmax[best_axis] - cmin[best_axis];
+	int *mid = std::partition(&order[0] + begin, &order[0] + end, [&](int i) {
+		int bin = int(SAH_BINS * (centroids[i][best_axis] - cmin[best_axis]) / extent);
+		if (bin == SAH_BINS) bin = SAH_BINS - 1;
+		return bin <= best_split;
+	});
+	int split = int(mid - &order[0]);
+	build_sah_node(nodes, order, prim_boxes, centroids, begin, split, max_leaf);
+	int right = build_sah_node(nodes, order, prim_boxes, centroids, split, end, max_leaf);
+	nodes[index].offset = right;
+	nodes[index].count = 0;
+	nodes[index].axis = best_axis;
+	return index;
+}
+
+void compiled_scene::build() {
+	spheres.reserve(type_counts[PRIM_SPHERE]);
+	moving_spheres.reserve(type_counts[PRIM_MOVING_SPHERE]);
+	triangles.reserve(type_counts[PRIM_TRIANGLE]);
+	xy_rects.reserve(type_counts[PRIM_XY_RECT]);
+	xz_rects.reserve(type_counts[PRIM_XZ_RECT]);
+	yz_rects.reserve(type_counts[PRIM_YZ_RECT]);
+	boxes.reserve(type_counts[PRIM_BOX]);
+	media.reserve(type_counts[PRIM_MEDIUM]);
+	instances.reserve(type_counts[PRIM_INSTANCE]);
+	others.reserve(type_counts[PRIM_OTHER]);
+	std::vector<aabb> prim_boxes(pending.size());
+	std::vector<vec3> centroids(pending.size());
+	for (size_t i = 0; i < pending.size(); i++) {
+		hitable *h = pending[i];
+		if (!h->bounding_box(0.0f, 1.0f, prim_boxes[i]))
+			std::cerr << "no bounding box in compile_scene\n";
+		centroids[i] = 0.5f * (prim_boxes[i].min() + prim_boxes[i].max());
+		switch (ref_type(pending_refs[i])) {
+		case PRIM_SPHERE:			spheres.push_back(*static_cast<sphere *>(h)); break;
+		case PRIM_MOVING_SPHERE:	moving_spheres.push_back(*static_cast<moving_sphere *>(h)); break;
+		case PRIM_TRIANGLE:			triangles.push_back(*static_cast<triangle *>(h)); break;
+		case PRIM_XY_RECT:			xy_rects.push_back(*static_cast<xy_rect *>(h)); break;
+		case PRIM_XZ_RECT:			xz_rects.push_back(*static_cast<xz_rect *>(h)); break;
+		case PRIM_YZ_RECT:			yz_rects.push_back(*static_cast<yz_rect *>(h)); break;
+		case PRIM_BOX:				boxes.push_back(*static_cast<box *>(h)); break;
+		case PRIM_MEDIUM:			media.push_back(*static_cast<constant_medium *>(h)); break;
+		case PRIM_INSTANCE:
+			instances.push_back(*static_cast<transform *>(h));
+			// the staging copy made in add() is ours unless the arena owns it, and
+			// a transform exactly, so it can be deleted as one
+			if (!mem)
+				delete static_cast<transform *>(h);
+			break;
+		default:					others.push_back(h); break;
+		}
+	}
+	nodes.clear();
+	refs.clear();
+	if (pending.empty())
+		return;
+	std::vector<int> order(pending.size());
+	for (size_t i = 0; i < pending.size(); i++)
+		order[i] = int(i);
+	// a bvh over n primitives never has more than 2n - 1 nodes
+	nodes.reserve(2 * pending.size() - 1);
+	build_sah_node(nodes, order, prim_boxes, centroids, 0, int(pending.size()));
+	refs.reserve(pending.size());
+	for (size_t i = 0; i < pending.size(); i++)
+		refs.push_back(pending_refs[order[i]]);
+	std::vector<prim_ref>().swap(pending_refs);
+	std::vector<hitable *>().swap(pending);
+}
+
+hitable *compile_scene(hitable *root, arena *a) {
+	compiled_scene *scene = arena_new<compiled_scene>(a, a);
+	scene->add(root, false);
+	scene->build();
+	return scene;
+}
+
+#endif // !COMPILEDSCENEH
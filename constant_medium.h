@@ -2,6 +2,7 @@
 #define CONSTANTMEDIUMH
 
 #include "hitable.h"
+#include "material.h"
 #include <float.h>
 
 //const extern float _pi;
@@ -9,49 +10,58 @@ float get_rand();
 
 class constant_medium : public hitable {
 public:
-	constant_medium(hitable *b, float d, texture *a) : boundary(b), density(d) {
-		phase_function = new isotropic(a);
+	constant_medium(hitable *b, float d, texture_id a, material_pool& mats) : boundary(b), density(d) {
+		phase_function = mats.add(isotropic(a));
 	}
 	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const {
+		rec.p = r.point_at_parameter(rec.t);
+		rec.normal = vec3(1, 0, 0); //arbitrary
+		rec.mat = phase_function;
+	}
 	virtual bool bounding_box(float t0, float t1, aabb& box) const {
 		return boundary->bounding_box(t0, t1, box);
 	}
+	// exp(-density * distance inside), no need to sample it
+	virtual float transmittance(const ray& r, float t_min, float t_max) const;
 	hitable *boundary;
 	float density;
-	material *phase_function;
+	material_id phase_function;
 };
 
+// One interval() query gives where the ray is inside the boundary; spheres
+// and boxes answer it analytically, anything else with two hit() calls.
 bool constant_medium::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-	bool db = (get_rand() < 0.00001);
-	db = false;
-	hit_record rec1, rec2;
-	if (boundary->hit(r, -FLT_MAX, FLT_MAX, rec1)) {
-		if (boundary->hit(r, rec1.t + 0.0001, FLT_MAX, rec2)) {
-			if (db) std::cerr << "\nt0 t1 " << rec1.t << " " << rec2.t << "\n";
-			if (rec1.t < t_min)
-				rec1.t = t_min;
-			if (rec2.t > t_max)
-				rec2.t = t_max;
-			if (rec1.t >= rec2.t)
-				return false;
-			if (rec1.t < 0)
-				rec1.t = 0;
-
-			float distance_inside_boundary = (rec2.t - rec1.t)*r.direction().length();
-			float hit_distance = -(1 / density)*log(get_rand());
-			if (hit_distance < distance_inside_boundary) {
-				if (db) std::cerr << "hit_distance = " << hit_distance << "\n";
-				rec.t = rec1.t + hit_distance / r.direction().length();
-				if (db) std::cerr << "rec.t = " << rec.t << "\n";
-				rec.p = r.point_at_parameter(rec.t);
-				if (db) std::cerr << "rec.p = " << rec.p << "\n";
-				rec.normal = vec3(1, 0, 0); //arbitrary
-				rec.mat_ptr = phase_function;
-				return true;
-			}
-		}
+	float t_in, t_out;
+	if (!boundary->interval(r, t_in, t_out))
+		return false;
+	if (t_in < t_min)
+		t_in = t_min;
+	if (t_out > t_max)
+		t_out = t_max;
+	if (t_in >= t_out)
+		return false;
+	if (t_in < 0)
+		t_in = 0;
+	float length = r.direction().length();
+	float distance_inside_boundary = (t_out - t_in)*length;
+	float hit_distance = -(1 / density)*log(get_rand());
+	if (hit_distance < distance_inside_boundary) {
+		rec.set_hit(t_in + hit_distance / length, this);
+		return true;
 	}
 	return false;
 }
 
+float constant_medium::transmittance(const ray& r, float t_min, float t_max) const {
+	float t_in, t_out;
+	if (!boundary->interval(r, t_in, t_out))
+		return 1.0f;
+	t_in = t_in > t_min ? t_in : t_min;
+	t_out = t_out < t_max ? t_out : t_max;
+	if (t_in >= t_out)
+		return 1.0f;
+	return exp(-density * (t_out - t_in) * r.direction().length());
+}
+
 #endif
@@ -0,0 +1,172 @@
+#ifndef DENOISEH
+#define DENOISEH
+
+#include <string.h>
+#include "simd.h"
+#include "memory_stats.h"
+#include "threads.h"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering"), with
+// the variance-guided luminance weight of SVGF (Schied et al.). Each pass
+// blurs with a 5x5 B3-spline kernel whose taps are spread 1, 2, 4, ... pixels
+// apart, so five passes cover 64 pixels at 25 taps a pixel each. A tap counts
+// less the more its normal and albedo differ from the pixel's own, and the
+// more its luminance does compared to how noisy the pixel still is. Colour
+// is divided by the albedo before filtering and multiplied back after, so
+// only lighting is blurred and textures stay sharp.
+//
+// Images are kept one plane per channel, rows padded on both sides, so a row
+// is filtered floatx<SIMD_WIDTH> pixels at a time; rows are split between
+// threads.
+class denoiser {
+public:
+	denoiser() : sigma_luminance(4.0f), sigma_normal(0.125f), sigma_albedo(0.1f), nx(0), ny(0), stride(0) {}
+	void resize(int width, int height);
+	// a pixel's averages over its samples, and the variance of its colour's
+	// luminance mean (of the samples' luminance over their count)
+	void set(int i, int j, const vec3& color, const vec3& albedo, const vec3& normal, float variance);
+	void run(int passes = MAX_PASSES);
+	// after run(), the filtered colour of pixel (i, j)
+	vec3 get(int i, int j) const;
+
+	static const int MAX_PASSES = 5;
+	float sigma_luminance;	// in standard deviations of the pixel's noise
+	float sigma_normal;
+	float sigma_albedo;
+
+private:
+	// planes: colour (3) and its variance, twice for ping-ponging, then albedo and normal (3 each)
+	enum { COLOR = 0, VARIANCE = 3, OTHER = 4, ALBEDO = 8, NORMAL = 11, PLANES = 14 };
+	// far enough for the last pass's taps, whole vectors of the widest width
+	static const int PAD = 2 << (MAX_PASSES - 1);
+	size_t at(int i, int j) const { return size_t(j) * stride + PAD + i; }
+	float *plane(int p) { return data.data() + size_t(p) * stride * ny; }
+	const float *plane(int p) const { return data.data() + size_t(p) * stride * ny; }
+	template <int N>
+	void filter_rows(int begin, int end, int step, int from, int to);
+
+	int nx, ny, stride;
+	tracked_vector<float, MEM_FRAMEBUFFER> data;
+};
+
+void denoiser::resize(int width, int height) {
+	nx = width;
+	ny = height;
+	stride = PAD + (nx + 15) / 16 * 16 + PAD;
+	data.assign(size_t(PLANES) * stride * ny, 0.0f);
+}
+
+void denoiser::set(int i, int j, const vec3& color, const vec3& albedo, const vec3& normal, float variance) {
+	size_t o = at(i, j);
+	vec3 a(fmaxf(albedo.x(), 0.01f), fmaxf(albedo.y(), 0.01f), fmaxf(albedo.z(), 0.01f));
+	float l = 0.2126f * a.x() + 0.7152f * a.y() + 0.0722f * a.z();
+	for (int c = 0; c < 3; c++) {
+		plane(COLOR + c)[o] = color[c] / a[c];
+		plane(ALBEDO + c)[o] = albedo[c];
+		plane(NORMAL + c)[o] = normal[c];
+	}
+	plane(VARIANCE)[o] = variance / (l * l);
+}
+
+vec3 denoiser::get(int i, int j) const {
+	size_t o = at(i, j);
+	return vec3(plane(COLOR)[o] * plane(ALBEDO)[o], plane(COLOR + 1)[o] * plane(ALBEDO + 1)[o], plane(COLOR + 2)[o] * plane(ALBEDO + 2)[o]);
+}
+
+// exp(-x) for x >= 0 as (1 + x/8)^-8, a few percent off where weights matter
+// and without exp(), so it runs on floatx lanes
+template <int N>
+inline floatx<N> exp_neg(floatx<N> x) {
+	floatx<N> t = 1.0f / (1.0f + 0.125f * x);
+	t = t * t;
+	t = t * t;
+	return t * t;
+}
+
+template <int N>
+void denoiser::filter_rows(int begin, int end, int step, int from, int to) {
+	static const float h[3] = { 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+	static const float g[2] = { 1.0f / 2, 1.0f / 4 };
+	static const float lane[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+	const float *c_in[3] = { plane(from), plane(from + 1), plane(from + 2) };
+	const float *v_in = plane(from + VARIANCE);
+	const float *a_in[3] = { plane(ALBEDO), plane(ALBEDO + 1), plane(ALBEDO + 2) };
+	const float *n_in[3] = { plane(NORMAL), plane(NORMAL + 1), plane(NORMAL + 2) };
+	float *c_out[3] = { plane(to), plane(to + 1), plane(to + 2) };
+	float *v_out = plane(to + VARIANCE);
+	float inv_n = 1.0f / (sigma_normal * sigma_normal);
+	float inv_a = 1.0f / (sigma_albedo * sigma_albedo);
+	for (int j = begin; j < end; j++) {
+		for (int i = 0; i < nx; i += N) {
+			size_t p = at(i, j);
+			vec3x<N> c(floatx<N>::load(c_in[0] + p), floatx<N>::load(c_in[1] + p), floatx<N>::load(c_in[2] + p));
+			vec3x<N> a(floatx<N>::load(a_in[0] + p), floatx<N>::load(a_in[1] + p), floatx<N>::load(a_in[2] + p));
+			vec3x<N> n(floatx<N>::load(n_in[0] + p), floatx<N>::load(n_in[1] + p), floatx<N>::load(n_in[2] + p));
+			floatx<N> l = 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+			floatx<N> x = floatx<N>(float(i)) + floatx<N>::load(lane);
+			// A pixel's own variance is noisy too: one that happened to miss
+			// the bright paths its neighbours found looks clean and would keep
+			// them out. Weights go by a 3x3 Gaussian blur of it (as in SVGF).
+			floatx<N> var(0.0f), var_w(0.0f);
+			for (int dy = -1; dy <= 1; dy++) {
+				if (j + dy < 0 || j + dy >= ny)
+					continue;
+				for (int dx = -1; dx <= 1; dx++) {
+					maskx<N> inside = (x + float(dx) >= 0.0f) & (x + float(dx) < float(nx));
+					floatx<N> w = select(inside, floatx<N>(g[dx < 0 ? -dx : dx] * g[dy < 0 ? -dy : dy]), floatx<N>(0.0f));
+					var += w * floatx<N>::load(v_in + at(i + dx, j + dy));
+					var_w += w;
+				}
+			}
+			floatx<N> inv_l = 1.0f / (sigma_luminance * sqrt(max(var / max(var_w, floatx<N>(1e-20f)), floatx<N>(0.0f))) + 1e-4f);
+			vec3x<N> sum(floatx<N>(0.0f), floatx<N>(0.0f), floatx<N>(0.0f));
+			floatx<N> sum_w(0.0f), sum_v(0.0f);
+			for (int dy = -2; dy <= 2; dy++) {
+				int qj = j + dy * step;
+				if (qj < 0 || qj >= ny)
+					continue;
+				for (int dx = -2; dx <= 2; dx++) {
+					int off = dx * step;
+					maskx<N> inside = (x + float(off) >= 0.0f) & (x + float(off) < float(nx));
+					size_t q = at(i + off, qj);
+					vec3x<N> qc(floatx<N>::load(c_in[0] + q), floatx<N>::load(c_in[1] + q), floatx<N>::load(c_in[2] + q));
+					vec3x<N> da = a - vec3x<N>(floatx<N>::load(a_in[0] + q), floatx<N>::load(a_in[1] + q), floatx<N>::load(a_in[2] + q));
+					vec3x<N> dn = n - vec3x<N>(floatx<N>::load(n_in[0] + q), floatx<N>::load(n_in[1] + q), floatx<N>::load(n_in[2] + q));
+					floatx<N> dl = l - (0.2126f * qc.x + 0.7152f * qc.y + 0.0722f * qc.z);
+					floatx<N> e = max(dl, -dl) * inv_l + dot(dn, dn) * inv_n + dot(da, da) * inv_a;
+					floatx<N> w = select(inside, h[dx < 0 ? -dx : dx] * h[dy < 0 ? -dy : dy] * exp_neg(e), floatx<N>(0.0f));
+					sum += qc * w;
+					sum_w += w;
+					sum_v += w * w * floatx<N>::load(v_in + q);
+				}
+			}
+			// lanes past the row's end go to the padding, which no tap weighs
+			floatx<N> inv = 1.0f / max(sum_w, floatx<N>(1e-20f));
+			(sum.x * inv).store(c_out[0] + p);
+			(sum.y * inv).store(c_out[1] + p);
+			(sum.z * inv).store(c_out[2] + p);
+			(sum_v * inv * inv).store(v_out + p);
+		}
+	}
+}
+
+void denoiser::run(int passes) {
+	passes = passes < MAX_PASSES ? passes : MAX_PASSES;
+	size_t threads = thread_count(size_t(ny), 16);
+	int from = COLOR, to = OTHER;
+	for (int k = 0; k < passes; k++) {
+		run_threads(threads, [&](size_t t) {
+			filter_rows<SIMD_WIDTH>(int(ny * t / threads), int(ny * (t + 1) / threads), 1 << k, from, to);
+		});
+		int swap = from;
+		from = to;
+		to = swap;
+	}
+	// the result is read from the colour planes
+	if (from != COLOR)
+		for (int p = 0; p < 4; p++)
+			memcpy(plane(COLOR + p), plane(OTHER + p), sizeof(float) * stride * ny);
+}
+
+#endif // !DENOISEH
@@ -3,8 +3,10 @@
 
 #include "aabb.h"
 #include <float.h>
+#include <stdint.h>
 
-class material;
+// index into the scene's material_pool, see material.h
+typedef uint32_t material_id;
 
 const extern float _pi;
 
@@ -15,27 +17,105 @@ void get_sphere_uv(const vec3& p, float& u, float& v) {
 	v = (theta + _pi / 2) / _pi;
 }
 
+// the point on the unit sphere get_sphere_uv() gives (u, v) for
+vec3 sphere_uv_point(float u, float v) {
+	float phi = (1 - u) * 2 * _pi - _pi;
+	float theta = v * _pi - _pi / 2;
+	return vec3(cos(theta) * cos(phi), sin(theta), cos(theta) * sin(phi));
+}
+
+class hitable;
+class transform;
+
+const int MAX_INSTANCE_DEPTH = 4;
+
+// Counts primitive hits against surface evaluations so we can see how much work
+// deferring the surface attributes saves. Only touched when HIT_STATS is defined.
+struct hit_stats {
+	unsigned long long candidates = 0;
+	unsigned long long surfaces = 0;
+	unsigned long long sphere_candidates = 0;
+	unsigned long long sphere_surfaces = 0;
+};
+hit_stats stats;
+
+#ifdef HIT_STATS
+#define COUNT_HIT(counter) (stats.counter++)
+#else
+#define COUNT_HIT(counter)
+#endif
+
+// hit() only fills in t, the primitive and its local (u, v) (barycentrics for
+// triangles). p, normal, the final uv and mat are left alone until
+// surface_interaction() is called on the closest hit.
 struct hit_record {
+	inline void set_hit(float t_hit, const hitable *o) {
+		t = t_hit;
+		obj = o;
+		inst_count = 0;
+		flip = false;
+		resolved = false;
+		COUNT_HIT(candidates);
+	}
+
 	float t;
 	float u;
 	float v;
+	material_id mat;
+	const hitable *obj;
+	uint32_t prim;		// which part of obj was hit, for objects made of many (mapped meshes)
+	const transform *inst[MAX_INSTANCE_DEPTH]; // instances the hit came through, innermost first
+	float uv_density;	// uv units per world unit around p, 0 when there is no uv mapping
+	uint8_t inst_count;
+	bool flip;
+	bool resolved;
 	vec3 p;
 	vec3 normal;
-	material *mat_ptr;
 };
 
 class hitable {
 public:
 	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
 	virtual bool bounding_box(float t0, float t1, aabb& box) const = 0;
+	// fills p, normal, uv and mat for a hit on this primitive, r is in the primitive's space
+	virtual void surface_interaction(const ray& r, hit_record& rec) const {}
+	// whether anything is hit in (t_min, t_max), for shadow rays; scenes can
+	// stop at the first hit instead of looking for the closest
+	virtual bool occluded(const ray& r, float t_min, float t_max) const {
+		hit_record rec;
+		return hit(r, t_min, t_max, rec);
+	}
+	// How much light gets through along r in (t_min, t_max): 0 or 1 for
+	// surfaces, in between for media that can estimate it directly.
+	virtual float transmittance(const ray& r, float t_min, float t_max) const {
+		return occluded(r, t_min, t_max) ? 0.0f : 1.0f;
+	}
+	// Where r first enters and then leaves this object, over the whole line
+	// (t_in may be behind the origin), for closed objects bounding a medium.
+	// By default two hit() calls; shapes that get both crossings from one
+	// test give them at once.
+	virtual bool interval(const ray& r, float& t_in, float& t_out) const {
+		hit_record rec1, rec2;
+		if (!hit(r, -FLT_MAX, FLT_MAX, rec1) || !hit(r, rec1.t + 0.0001f, FLT_MAX, rec2))
+			return false;
+		t_in = rec1.t;
+		t_out = rec2.t;
+		return true;
+	}
 };
 
+// resolves the full surface for the closest hit, defined in transform.h
+void surface_interaction(const ray& r, hit_record& rec);
+
 class flip_normals : public hitable {
 public:
 	flip_normals(hitable *p) : ptr(p) {}
 	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
 		if (ptr->hit(r, t_min, t_max, rec)) {
-			rec.normal = -rec.normal;
+			if (rec.resolved)
+				rec.normal = -rec.normal;
+			else
+				rec.flip = !rec.flip;
 			return true;
 		}
 		else
@@ -44,6 +124,9 @@ public:
 	virtual bool bounding_box(float t0, float t1, aabb& box) const {
 		return ptr->bounding_box(t0, t1, box);
 	}
+	virtual bool interval(const ray& r, float& t_in, float& t_out) const {
+		return ptr->interval(r, t_in, t_out);
+	}
 	hitable *ptr;
 };
 
@@ -52,6 +135,9 @@ public:
 	translate(hitable *p, const vec3& displacement) : ptr(p), offset(displacement) {}
 	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
 	virtual bool bounding_box(float t0, float t1, aabb& box) const;
+	virtual bool interval(const ray& r, float& t_in, float& t_out) const {
+		return ptr->interval(ray(r.origin() - offset, r.direction(), r.time()), t_in, t_out);
+	}
 	hitable *ptr;
 	vec3 offset;
 };
@@ -59,6 +145,8 @@ public:
 bool translate::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
 	ray moved_r(r.origin() - offset, r.direction(), r.time());
 	if (ptr->hit(moved_r, t_min, t_max, rec)) {
+		// the old wrappers evaluate the surface straight away, transform defers it
+		::surface_interaction(moved_r, rec);
 		rec.p += offset;
 		return true;
 	}
@@ -83,6 +171,10 @@ public:
 		box = bbox;
 		return hasbox;
 	}
+	virtual bool interval(const ray& r, float& t_in, float& t_out) const {
+		return ptr->interval(rotated(r), t_in, t_out);
+	}
+	ray rotated(const ray& r) const;
 	hitable *ptr;
 	float sin_theta;
 	float cos_theta;
@@ -118,15 +210,21 @@ rotate_y::rotate_y(hitable *p, float angle) : ptr(p) {
 	bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+// r in the unrotated object's space
+ray rotate_y::rotated(const ray& r) const {
 	vec3 origin = r.origin();
 	vec3 direction = r.direction();
 	origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
 	origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
 	direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
 	direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
-	ray rotated_r(origin, direction, r.time());
+	return ray(origin, direction, r.time());
+}
+
+bool rotate_y::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	ray rotated_r = rotated(r);
 	if (ptr->hit(rotated_r, t_min, t_max, rec)) {
+		::surface_interaction(rotated_r, rec);
 		vec3 p = rec.p;
 		vec3 normal = rec.normal;
 		p[0] = cos_theta*rec.p[0] + sin_theta*rec.p[2];
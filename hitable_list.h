@@ -8,6 +8,7 @@ public:
 	hitable_list() {}
 	hitable_list(hitable **l, int n) { list = l; list_size = n; }
 	virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+	virtual bool bounding_box(float t0, float t1, aabb& box) const;
 	hitable **list;
 	int list_size;
 };
@@ -26,4 +27,19 @@ bool hitable_list::hit(const ray& r, float t_min, float t_max, hit_record& rec)
 	return hit_anything;
 }
 
+bool hitable_list::bounding_box(float t0, float t1, aabb& box) const {
+	if (list_size < 1)
+		return false;
+	aabb temp_box;
+	if (!list[0]->bounding_box(t0, t1, temp_box))
+		return false;
+	box = temp_box;
+	for (int i = 1; i < list_size; i++) {
+		if (!list[i]->bounding_box(t0, t1, temp_box))
+			return false;
+		box = surrounding_box(box, temp_box);
+	}
+	return true;
+}
+
 #endif
\ No newline at end of file
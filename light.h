@@ -0,0 +1,474 @@
+#ifndef LIGHTH
+#define LIGHTH
+
+#include <vector>
+#include <algorithm>
+#include "material.h"
+#include "compiled_scene.h"
+
+float get_rand();
+
+// A point picked on one of the scene's lights, as seen from the point being shaded.
+struct light_sample {
+	vec3 p;
+	vec3 normal;
+	vec3 emitted;
+	float pdf;		// per unit solid angle around the shaded point
+};
+
+// How a light is picked for a shading point.
+enum light_selection {
+	LIGHTS_UNIFORM,	// all equally likely
+	LIGHTS_POWER,	// in proportion to power, the same everywhere
+	LIGHTS_BVH		// down a bvh over the lights, by estimated contribution at the point
+};
+
+// Where a group of lights is, how much they emit and which way: every light
+// in it faces within the cone of half angle acos(cos_o) around axis, either
+// way round since lights emit from both sides. cos_o is -1 for spheres.
+struct light_bounds {
+	aabb box;
+	vec3 axis;
+	float cos_o;
+	float power;
+};
+
+inline float luminance(const vec3& c) { return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z(); }
+
+inline float safe_sqrt(float x) { return sqrt(ffmax(0.0f, x)); }
+
+// the smallest cone holding both cones
+inline void merge_cones(const vec3& a, float cos_a, const vec3& b, float cos_b, vec3& axis, float& cos_o) {
+	axis = a;
+	cos_o = -1.0f;
+	if (cos_a <= -1.0f || cos_b <= -1.0f)
+		return;
+	float theta_a = acos(ffmin(1.0f, cos_a)), theta_b = acos(ffmin(1.0f, cos_b));
+	float theta_d = acos(ffmax(-1.0f, ffmin(1.0f, dot(a, b))));
+	if (ffmin(theta_d + theta_b, _pi) <= theta_a) {
+		cos_o = cos_a;
+		return;
+	}
+	if (ffmin(theta_d + theta_a, _pi) <= theta_b) {
+		axis = b;
+		cos_o = cos_b;
+		return;
+	}
+	float theta_o = 0.5f * (theta_a + theta_d + theta_b);
+	vec3 towards = b - dot(a, b) * a;
+	if (theta_o >= _pi || towards.squared_length() < 1e-12f)
+		return;
+	// turn a towards b until the new cone just covers both
+	float theta_r = theta_o - theta_a;
+	axis = cos(theta_r) * a + sin(theta_r) * unit_vector(towards);
+	cos_o = cos(theta_o);
+}
+
+inline light_bounds merge(const light_bounds& a, const light_bounds& b) {
+	if (a.power <= 0.0f)
+		return b;
+	if (b.power <= 0.0f)
+		return a;
+	light_bounds m;
+	m.box = surrounding_box(a.box, b.box);
+	merge_cones(a.axis, a.cos_o, b.axis, b.cos_o, m.axis, m.cos_o);
+	m.power = a.power + b.power;
+	return m;
+}
+
+// Roughly how much light from b reaches p, a conservative cosine falloff
+// from the box's extent and the normal cone over the squared distance. n is
+// the surface normal at p, zero inside media where there's no cosine.
+inline float importance(const light_bounds& b, const vec3& p, const vec3& n) {
+	vec3 centre = 0.5f * (b.box.min() + b.box.max());
+	vec3 to_p = p - centre;
+	float dist2 = to_p.squared_length();
+	float radius2 = 0.25f * (b.box.max() - b.box.min()).squared_length();
+	// inside or near the box the distance says nothing, don't let it blow up
+	dist2 = ffmax(dist2, sqrt(radius2));
+	vec3 wi = to_p / sqrt(ffmax(dist2, 1e-12f));
+	// angle the box takes up as seen from p
+	float cos_b = dist2 > radius2 ? safe_sqrt(1 - radius2 / dist2) : -1.0f;
+	float sin_b = safe_sqrt(1 - cos_b * cos_b);
+	// angle between the cone and p, less the cone's own and the box's spread
+	float cos_w = fabs(dot(b.axis, wi)), sin_w = safe_sqrt(1 - cos_w * cos_w);
+	float sin_o = safe_sqrt(1 - b.cos_o * b.cos_o);
+	float cos_x = cos_w > b.cos_o ? 1.0f : cos_w * b.cos_o + sin_w * sin_o;
+	float sin_x = cos_w > b.cos_o ? 0.0f : sin_w * b.cos_o - cos_w * sin_o;
+	float cos_p = cos_x > cos_b ? 1.0f : cos_x * cos_b + sin_x * sin_b;
+	if (cos_p <= 0.0f)
+		return 0.0f;
+	float result = b.power * cos_p / dist2;
+	if (n.squared_length() > 0.0f) {
+		float cos_i = fabs(dot(wi, n)), sin_i = safe_sqrt(1 - cos_i * cos_i);
+		result *= cos_i > cos_b ? 1.0f : cos_i * cos_b + sin_i * sin_b;
+	}
+	return ffmax(result, 0.0f);
+}
+
+// The emissive primitives the integrator samples directly from diffuse
+// surfaces (next-event estimation): spheres, rects and triangles with a
+// diffuse_light material at the top level of a compiled scene. Lights of other
+// shapes or inside instances are still only found by bounced rays.
+// With LIGHTS_BVH a shading point walks down a bvh over the lights, taking
+// each child with probability in proportion to its importance() there, so a
+// light is picked in O(log n) with odds close to its real contribution.
+// pdf() gives the density sample() would have had for a point a bounced ray
+// found, so the two can be weighed (MIS); for the bvh it walks back up from
+// the light's leaf.
+class light_list {
+public:
+	light_list() : selection(LIGHTS_BVH), candidates(0) {}
+	void build(const compiled_scene& scene, const material_pool& mats);
+	void clear();
+	bool empty() const { return lights.empty(); }
+	size_t size() const { return lights.size(); }
+	// whether obj is sampled here
+	bool contains(const hitable *obj) const { return find(obj) >= 0; }
+	// n is the surface normal at o, zero in media; pick chooses the light
+	// and u the point on it
+	bool sample(const vec3& o, const vec3& n, const material_pool& mats, float pick, const sample2& u, light_sample& s) const;
+	// per unit solid angle at o, for the point rec on obj; 0 if obj isn't a light here
+	float pdf(const hitable *obj, const vec3& o, const vec3& n, const hit_record& rec) const;
+
+	light_selection selection;
+	// when > 0, direct light is picked by resampling this many light samples
+	// instead of taking one (see reservoir.h)
+	int candidates;
+
+private:
+	struct light {
+		const hitable *obj;
+		prim_type type;
+		float area;
+		light_bounds bounds;
+	};
+	template <class T>
+	void add(const T& prim, prim_type type, float area, const vec3& centre, const vec3& facing, const material_pool& mats);
+	int find(const hitable *obj) const {
+		auto it = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(obj, 0));
+		return it != sorted.end() && it->first == obj ? it->second : -1;
+	}
+	float pick_pmf(int i, const vec3& o, const vec3& n) const;
+	float leaf_pmf(const flat_node& leaf, int i, const vec3& o, const vec3& n) const;
+	bool sample_shape(const light& l, const vec3& o, float pmf, const sample2& u, light_sample& s) const;
+
+	std::vector<light> lights;
+	std::vector<float> cdf;		// running power, the last entry is the total
+	std::vector<std::pair<const hitable *, int> > sorted;	// by obj, for find()
+	// the light bvh: leaves refer to ranges of order, which holds light indices
+	std::vector<flat_node> nodes;
+	std::vector<light_bounds> node_bounds;
+	std::vector<int> parent;
+	std::vector<int> order;
+	std::vector<int> leaf_of;	// per light
+};
+
+template <class T>
+void light_list::add(const T& prim, prim_type type, float area, const vec3& centre, const vec3& facing, const material_pool& mats) {
+	if (pool_type(prim.mat) != MAT_DIFFUSE_LIGHT || area <= 0.0f)
+		return;
+	vec3 e = mats.emitted(prim.mat, 0.5f, 0.5f, centre);
+	float power = luminance(e) * area;
+	if (power <= 0.0f)
+		return;
+	light l;
+	l.obj = &prim;
+	l.type = type;
+	l.area = area;
+	prim.bounding_box(0.0f, 1.0f, l.bounds.box);
+	l.bounds.axis = facing;
+	l.bounds.cos_o = type == PRIM_SPHERE ? -1.0f : 1.0f;
+	l.bounds.power = power;
+	lights.push_back(l);
+	cdf.push_back((cdf.empty() ? 0.0f : cdf.back()) + power);
+}
+
+void light_list::build(const compiled_scene& scene, const material_pool& mats) {
+	clear();
+	for (size_t i = 0; i < scene.spheres.size(); i++) {
+		const sphere& s = scene.spheres[i];
+		add(s, PRIM_SPHERE, 4 * _pi * s.radius * s.radius, s.center, vec3(0, 0, 1), mats);
+	}
+	for (size_t i = 0; i < scene.xy_rects.size(); i++) {
+		const xy_rect& r = scene.xy_rects[i];
+		add(r, PRIM_XY_RECT, (r.x1 - r.x0) * (r.y1 - r.y0), vec3(0.5f * (r.x0 + r.x1), 0.5f * (r.y0 + r.y1), r.k), vec3(0, 0, 1), mats);
+	}
+	for (size_t i = 0; i < scene.xz_rects.size(); i++) {
+		const xz_rect& r = scene.xz_rects[i];
+		add(r, PRIM_XZ_RECT, (r.x1 - r.x0) * (r.z1 - r.z0), vec3(0.5f * (r.x0 + r.x1), r.k, 0.5f * (r.z0 + r.z1)), vec3(0, 1, 0), mats);
+	}
+	for (size_t i = 0; i < scene.yz_rects.size(); i++) {
+		const yz_rect& r = scene.yz_rects[i];
+		add(r, PRIM_YZ_RECT, (r.y1 - r.y0) * (r.z1 - r.z0), vec3(r.k, 0.5f * (r.y0 + r.y1), 0.5f * (r.z0 + r.z1)), vec3(1, 0, 0), mats);
+	}
+	for (size_t i = 0; i < scene.triangles.size(); i++) {
+		const triangle& t = scene.triangles[i];
+		vec3 n = cross(t.b - t.a, t.c - t.a);
+		add(t, PRIM_TRIANGLE, 0.5f * n.length(), (t.a + t.b + t.c) / 3.0f, unit_vector(n), mats);
+	}
+	for (size_t i = 0; i < lights.size(); i++)
+		sorted.push_back(std::make_pair(lights[i].obj, int(i)));
+	std::sort(sorted.begin(), sorted.end());
+	if (lights.empty())
+		return;
+
+	// same builder as the scene's, one light per leaf where they can be split
+	std::vector<aabb> boxes(lights.size());
+	std::vector<vec3> centroids(lights.size());
+	order.resize(lights.size());
+	for (size_t i = 0; i < lights.size(); i++) {
+		boxes[i] = lights[i].bounds.box;
+		centroids[i] = 0.5f * (boxes[i].min() + boxes[i].max());
+		order[i] = int(i);
+	}
+	nodes.reserve(2 * lights.size() - 1);
+	build_sah_node(nodes, order, boxes, centroids, 0, int(lights.size()), 1);
+	node_bounds.resize(nodes.size());
+	parent.assign(nodes.size(), -1);
+	leaf_of.resize(lights.size());
+	// children come after their parents, so going backwards fills them in first
+	for (int i = int(nodes.size()) - 1; i >= 0; i--) {
+		const flat_node& node = nodes[i];
+		if (node.count > 0) {
+			light_bounds b = lights[order[node.offset]].bounds;
+			leaf_of[order[node.offset]] = i;
+			for (int k = node.offset + 1; k < node.offset + node.count; k++) {
+				b = merge(b, lights[order[k]].bounds);
+				leaf_of[order[k]] = i;
+			}
+			node_bounds[i] = b;
+		}
+		else {
+			node_bounds[i] = merge(node_bounds[i + 1], node_bounds[node.offset]);
+			parent[i + 1] = i;
+			parent[node.offset] = i;
+		}
+	}
+}
+
+void light_list::clear() {
+	lights.clear();
+	cdf.clear();
+	sorted.clear();
+	nodes.clear();
+	node_bounds.clear();
+	parent.clear();
+	order.clear();
+	leaf_of.clear();
+}
+
+// chance of picking light i out of the leaf it shares with others
+float light_list::leaf_pmf(const flat_node& leaf, int i, const vec3& o, const vec3& n) const {
+	if (leaf.count == 1)
+		return 1.0f;
+	float total = 0.0f;
+	for (int k = leaf.offset; k < leaf.offset + leaf.count; k++)
+		total += importance(lights[order[k]].bounds, o, n);
+	return total > 0.0f ? importance(lights[i].bounds, o, n) / total : 0.0f;
+}
+
+float light_list::pick_pmf(int i, const vec3& o, const vec3& n) const {
+	switch (selection) {
+	case LIGHTS_UNIFORM:
+		return 1.0f / lights.size();
+	case LIGHTS_POWER:
+		return (cdf[i] - (i ? cdf[i - 1] : 0.0f)) / cdf.back();
+	default: {
+		int node = leaf_of[i];
+		float pmf = leaf_pmf(nodes[node], i, o, n);
+		for (int up = parent[node]; up >= 0 && pmf > 0.0f; node = up, up = parent[up]) {
+			float left = importance(node_bounds[up + 1], o, n);
+			float right = importance(node_bounds[nodes[up].offset], o, n);
+			float mine = node == up + 1 ? left : right;
+			pmf *= left + right > 0.0f ? mine / (left + right) : 0.0f;
+		}
+		return pmf;
+	}
+	}
+}
+
+bool light_list::sample(const vec3& o, const vec3& n, const material_pool& mats, float pick, const sample2& point, light_sample& s) const {
+	if (lights.empty())
+		return false;
+	float u = pick;
+	int i;
+	float pmf;
+	if (selection == LIGHTS_UNIFORM) {
+		i = int(u * lights.size());
+		i = i < int(lights.size()) ? i : int(lights.size()) - 1;
+		pmf = 1.0f / lights.size();
+	}
+	else if (selection == LIGHTS_POWER) {
+		i = int(std::upper_bound(cdf.begin(), cdf.end(), u * cdf.back()) - cdf.begin());
+		i = i < int(lights.size()) ? i : int(lights.size()) - 1;
+		pmf = pick_pmf(i, o, n);
+	}
+	else {
+		// one random number all the way down, rescaled after each choice
+		int node = 0;
+		pmf = 1.0f;
+		while (nodes[node].count == 0) {
+			float left = importance(node_bounds[node + 1], o, n);
+			float right = importance(node_bounds[nodes[node].offset], o, n);
+			if (left + right <= 0.0f)
+				return false;
+			float p_left = left / (left + right);
+			if (u < p_left) {
+				u = ffmin(u / p_left, 0.99999994f);
+				pmf *= p_left;
+				node = node + 1;
+			}
+			else {
+				u = ffmin((u - p_left) / (1 - p_left), 0.99999994f);
+				pmf *= 1 - p_left;
+				node = nodes[node].offset;
+			}
+		}
+		const flat_node& leaf = nodes[node];
+		i = order[leaf.offset];
+		if (leaf.count > 1) {
+			float total = 0.0f;
+			for (int k = leaf.offset; k < leaf.offset + leaf.count; k++)
+				total += importance(lights[order[k]].bounds, o, n);
+			if (total <= 0.0f)
+				return false;
+			float pick = u * total;
+			for (int k = leaf.offset; k < leaf.offset + leaf.count; k++) {
+				i = order[k];
+				pick -= importance(lights[i].bounds, o, n);
+				if (pick < 0.0f)
+					break;
+			}
+			pmf *= importance(lights[i].bounds, o, n) / total;
+		}
+	}
+	if (pmf <= 0.0f || !sample_shape(lights[i], o, pmf, point, s))
+		return false;
+	// the light's own surface code gives the uv its emission texture wants
+	hit_record rec;
+	rec.set_hit(1.0f, lights[i].obj);
+	lights[i].obj->surface_interaction(ray(o, s.p - o), rec);
+	s.emitted = mats.emitted(rec.mat, rec.u, rec.v, rec.p);
+	return true;
+}
+
+bool light_list::sample_shape(const light& l, const vec3& o, float pmf, const sample2& u, light_sample& s) const {
+	switch (l.type) {
+	case PRIM_SPHERE: {
+		const sphere& sp = *static_cast<const sphere *>(l.obj);
+		vec3 d = sp.center - o;
+		float dist2 = d.squared_length(), r2 = sp.radius * sp.radius;
+		if (dist2 > 1.0001f * r2) {
+			// uniform over the cone the sphere subtends, that's all that can be seen
+			float cos_max = sqrt(1 - r2 / dist2);
+			vec3 dir = from_local(sample_cone(u, cos_max), d / sqrt(dist2));
+			float proj = dot(dir, d);
+			float t = proj - safe_sqrt(proj * proj - (dist2 - r2));
+			s.p = o + t * dir;
+			s.normal = (s.p - sp.center) / sp.radius;
+			s.pdf = pmf / (2 * _pi * (1 - cos_max));
+			return t > 0.0f;
+		}
+		s.normal = sample_sphere(u);
+		s.p = sp.center + fabs(sp.radius) * s.normal;
+		break;
+	}
+	case PRIM_XY_RECT: {
+		const xy_rect& r = *static_cast<const xy_rect *>(l.obj);
+		s.p = vec3(r.x0 + u.x * (r.x1 - r.x0), r.y0 + u.y * (r.y1 - r.y0), r.k);
+		s.normal = vec3(0, 0, 1);
+		break;
+	}
+	case PRIM_XZ_RECT: {
+		const xz_rect& r = *static_cast<const xz_rect *>(l.obj);
+		s.p = vec3(r.x0 + u.x * (r.x1 - r.x0), r.k, r.z0 + u.y * (r.z1 - r.z0));
+		s.normal = vec3(0, 1, 0);
+		break;
+	}
+	case PRIM_YZ_RECT: {
+		const yz_rect& r = *static_cast<const yz_rect *>(l.obj);
+		s.p = vec3(r.k, r.y0 + u.x * (r.y1 - r.y0), r.z0 + u.y * (r.z1 - r.z0));
+		s.normal = vec3(1, 0, 0);
+		break;
+	}
+	default: {
+		const triangle& t = *static_cast<const triangle *>(l.obj);
+		float su = sqrt(u.x);
+		s.p = (1 - su) * t.a + (u.y * su) * t.b + ((1 - u.y) * su) * t.c;
+		s.normal = unit_vector(cross(t.b - t.a, t.c - t.a));
+		break;
+	}
+	}
+	// uniform by area, turned into solid angle; lights emit from both sides
+	vec3 to = s.p - o;
+	float dist2 = to.squared_length();
+	float cosine = dist2 > 0.0f ? fabs(dot(s.normal, to)) / sqrt(dist2) : 0.0f;
+	if (cosine < 1e-6f)
+		return false;
+	s.pdf = pmf * dist2 / (cosine * l.area);
+	return true;
+}
+
+float light_list::pdf(const hitable *obj, const vec3& o, const vec3& n, const hit_record& rec) const {
+	int i = find(obj);
+	if (i < 0)
+		return 0.0f;
+	const light& l = lights[i];
+	float pmf = pick_pmf(i, o, n);
+	if (l.type == PRIM_SPHERE) {
+		const sphere& sp = *static_cast<const sphere *>(l.obj);
+		float dist2 = (sp.center - o).squared_length(), r2 = sp.radius * sp.radius;
+		if (dist2 > 1.0001f * r2)
+			return pmf / (2 * _pi * (1 - sqrt(1 - r2 / dist2)));
+	}
+	vec3 to = rec.p - o;
+	float dist2 = to.squared_length();
+	float cosine = fabs(dot(unit_vector(rec.normal), to)) / sqrt(dist2);
+	if (cosine < 1e-6f)
+		return 0.0f;
+	return pmf * dist2 / (cosine * l.area);
+}
+
+// The normal light selection may bound the cosine with at a hit, none in media.
+inline vec3 selection_normal(const hit_record& rec) {
+	return pool_type(rec.mat) == MAT_ISOTROPIC ? vec3(0, 0, 0) : unit_vector(rec.normal);
+}
+
+// weight for a sample from the strategy with density a, against one with density b
+inline float power_heuristic(float a, float b) {
+	return a * a / (a * a + b * b);
+}
+
+// How much of what leaves q reaches p past what is in the way, 0 when
+// something opaque is. The shadow ray is traced along the unit direction so
+// the 0.001 it keeps clear of each end is a distance, however far q is.
+inline float visibility(const hitable *world, const vec3& p, const vec3& q, float time) {
+	vec3 wi = q - p;
+	float dist = wi.length();
+	if (dist <= 0.002f)
+		return 1.0f;
+	return world->transmittance(ray(p, wi / dist, time), 0.001f, dist - 0.001f);
+}
+
+// Light reaching the shaded point straight from a point sampled on a light,
+// weighted by the material's response, by how much better the light sample
+// is than scatter() would have done and by how much gets past what is in
+// the way.
+// pick and u go to light_list::sample().
+vec3 sample_direct(const hitable *world, const material_pool& mats, const light_list& lights, const ray& r_in, const hit_record& rec, float pick, const sample2& u) {
+	light_sample s;
+	if (!lights.sample(rec.p, selection_normal(rec), mats, pick, u, s))
+		return vec3(0, 0, 0);
+	vec3 dir = unit_vector(s.p - rec.p);
+	vec3 f = mats.eval(rec.mat, r_in, rec, dir);
+	if (f.x() <= 0.0f && f.y() <= 0.0f && f.z() <= 0.0f)
+		return vec3(0, 0, 0);
+	float through = visibility(world, rec.p, s.p, r_in.time());
+	if (through <= 0.0f)
+		return vec3(0, 0, 0);
+	float weight = power_heuristic(s.pdf, mats.pdf(rec.mat, r_in, rec, dir));
+	return f * s.emitted * (weight * through / s.pdf);
+}
+
+#endif // !LIGHTH
@@ -9,15 +9,28 @@
 #include "aarect.h"
 #include "box.h"
 #include "triangle.h"
-
-// lib for .PLY
-#include "tinyply\source\tinyply.h"
+#include "transform.h"
+#include "compiled_scene.h"
+#include "arena.h"
+#include "scene.h"
+#include "mesh_file.h"
+#include "ply_file.h"
+#include "reservoir.h"
+#include "sampler.h"
+#include "denoise.h"
 
 //needed for rng
 #include "perlin.h"
 #include "constant_medium.h"
-
-// needed for image textures
+#include "volume.h"
+
+// needed for image textures, its buffers are booked as image io
+#define STBI_MALLOC(sz) tracked_malloc(sz, MEM_IMAGE_IO)
+#define STBI_REALLOC(p, newsz) tracked_realloc(p, newsz, MEM_IMAGE_IO)
+#define STBI_FREE(p) tracked_free(p, MEM_IMAGE_IO)
+#define STBIW_MALLOC(sz) tracked_malloc(sz, MEM_IMAGE_IO)
+#define STBIW_REALLOC(p, newsz) tracked_realloc(p, newsz, MEM_IMAGE_IO)
+#define STBIW_FREE(p) tracked_free(p, MEM_IMAGE_IO)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -36,16 +49,55 @@ float get_rand() {
 	return drand(generator);
 }
 
-vec3 color(const ray& r, hitable *world, int depth) {
+vec3 color(const ray& r, hitable *world, const material_pool& mats, const light_list& lights, sampler& smp, int depth, float scatter_pdf = 0.0f, const vec3& scatter_normal = vec3(0, 0, 0));
+
+// Hits on materials with a scatter density add light sampled straight from
+// the scene's lights. Light found by the bounce that follows is then weighed
+// against the chance the light sample had of finding the same point
+// (multiple importance sampling, power heuristic), so each strategy counts
+// most where it does well. scatter_pdf is the density the ray was scattered
+// with, 0 when nothing sampled the lights (the camera, mirrors, glass), and
+// scatter_normal the normal light selection used where it was scattered.
+// When lights are resampled (lights.candidates), which is only done at the
+// camera hit, the light sample stands alone there and the bounce from it no
+// longer counts the lights it covers. direct, when given, is the reservoir to
+// use at the camera hit instead of making one. Every bounce takes the same
+// dimensions from smp, whether it uses them or not.
+vec3 shade(const ray& r, hit_record& rec, hitable *world, const material_pool& mats, const light_list& lights, sampler& smp, int depth, float scatter_pdf, const vec3& scatter_normal, const reservoir *direct = nullptr) {
+	ray scattered;
+	vec3 attenuation;
+	vec3 emitted = mats.emitted(rec.mat, rec.u, rec.v, rec.p);
+	if (scatter_pdf > 0.0f && lights.contains(rec.obj))
+		emitted *= lights.candidates > 0 && depth == 1 ? 0.0f : power_heuristic(scatter_pdf, lights.pdf(rec.obj, r.origin(), scatter_normal, rec));
+	scatter_sample u = smp.get_scatter();
+	float light_pick = smp.get_1d();
+	sample2 light_point = smp.get_2d();
+	if (depth < 50 && mats.scatter(rec.mat, r, rec, u, attenuation, scattered)) {
+		vec3 light(0, 0, 0);
+		float pdf = 0.0f;
+		if (!lights.empty() && mats.samples_lights(rec.mat)) {
+			if (direct)
+				light = shade_reservoir(world, mats, r, rec, *direct);
+			else if (lights.candidates > 0 && depth == 0) {
+				reservoir res;
+				resample_lights(mats, lights, r, rec, lights.candidates, res);
+				light = shade_reservoir(world, mats, r, rec, res);
+			}
+			else
+				light = sample_direct(world, mats, lights, r, rec, light_pick, light_point);
+			pdf = mats.pdf(rec.mat, r, rec, unit_vector(scattered.direction()));
+		}
+		return emitted + light + attenuation*color(scattered, world, mats, lights, smp, depth + 1, pdf, selection_normal(rec));
+	}
+	else
+		return emitted;
+}
+
+vec3 color(const ray& r, hitable *world, const material_pool& mats, const light_list& lights, sampler& smp, int depth, float scatter_pdf, const vec3& scatter_normal) {
 	hit_record rec;
 	if (world->hit(r, 0.001f, FLT_MAX, rec)) {
-		ray scattered;
-		vec3 attenuation;
-		vec3 emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-		if (depth < 50 && rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-			return emitted + attenuation*color(scattered, world, depth + 1);
-		else
-			return emitted;
+		surface_interaction(r, rec);
+		return shade(r, rec, world, mats, lights, smp, depth, scatter_pdf, scatter_normal);
 	}
 	else
 	{
@@ -56,11 +108,11 @@ vec3 color(const ray& r, hitable *world, int depth) {
 	}
 }
 
-hitable *random_scene() {
-	int n = 50000;
-	hitable **list = new hitable*[n + 1];
-	texture *checker = new checker_texture(new constant_texture(vec3(0.2f, 0.3f, 0.1f)), new constant_texture(vec3(0.9f, 0.9f, 0.9f)));
-	list[0] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(checker));
+hitable *random_scene(arena& mem, material_pool& mats) {
+	int n = 1 + 20 * 20 + 3; // ground, at most one sphere per grid cell, the three big ones
+	hitable **list = mem.make_array<hitable *>(n);
+	texture_id checker = mats.add_texture(checker_texture(mats.add_texture(constant_texture(vec3(0.2f, 0.3f, 0.1f))), mats.add_texture(constant_texture(vec3(0.9f, 0.9f, 0.9f)))));
+	list[0] = mem.make<sphere>(vec3(0, -1000, 0), 1000, mats.add(lambertian(checker)));
 	int i = 1;
 	for (int a = -10; a < 10; a++) {
 		for (int b = -10; b < 10; b++) {
@@ -68,125 +120,185 @@ hitable *random_scene() {
 			vec3 center(a + 0.9f + get_rand(), 0.2f, b + 0.9f*get_rand());
 			if ((center - vec3(4, 0.2f, 0)).length() > 0.9f) {
 				if (choose_mat < 0.8f) { // diffuse
-					list[i++] = new moving_sphere(center, center + vec3(0, 0.5f*get_rand(), 0),
-						0.0f, 1.0f, 0.2f, new lambertian(new constant_texture(
+					list[i++] = mem.make<moving_sphere>(center, center + vec3(0, 0.5f*get_rand(), 0),
+						0.0f, 1.0f, 0.2f, mats.add(lambertian(mats.add_texture(constant_texture(
 							vec3(get_rand()*get_rand(),
 								get_rand()*get_rand(),
-								get_rand()*get_rand()))));
+								get_rand()*get_rand()))))));
 				}
 				else if (choose_mat < 0.95f) { // metal
-					list[i++] = new sphere(center, 0.2f, new metal(
+					list[i++] = mem.make<sphere>(center, 0.2f, mats.add(metal(
 						vec3(0.5f*(1 + get_rand()),
 							0.5f*(1 + get_rand()),
 							0.5f*(1 + get_rand())),
-						0.5f*get_rand()));
+						0.5f*get_rand())));
 				}
 				else { // glass
-					list[i++] = new sphere(center, 0.2f, new dielectric(1.5f));
+					list[i++] = mem.make<sphere>(center, 0.2f, mats.add(dielectric(1.5f)));
 				}
 			}
 		}
 	}
 
-	list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5f));
-	//list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new lambertian(new constant_texture(vec3(0.4f, 0.2f, 0.1f))));
-	list[i++] = new sphere(vec3(-4, 1, 0), 1.0, new diffuse_light(new constant_texture(vec3(4, 4, 4))));
-	list[i++] = new sphere(vec3(4, 1, 0), 1.0, new metal(vec3(0.7f, 0.6f, 0.5f), 0.0f));
+	list[i++] = mem.make<sphere>(vec3(0, 1, 0), 1.0, mats.add(dielectric(1.5f)));
+	//list[i++] = mem.make<sphere>(vec3(-4, 1, 0), 1.0, mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.4f, 0.2f, 0.1f))))));
+	list[i++] = mem.make<sphere>(vec3(-4, 1, 0), 1.0, mats.add(diffuse_light(mats.add_texture(constant_texture(vec3(4, 4, 4))))));
+	list[i++] = mem.make<sphere>(vec3(4, 1, 0), 1.0, mats.add(metal(vec3(0.7f, 0.6f, 0.5f), 0.0f)));
 
-	//return new hitable_list(list, i);
-	return new bvh_node(list, i, 0.0, 1.0);
+	//return mem.make<hitable_list>(list, i);
+	return mem.make<bvh_node>(list, i, 0.0, 1.0, &mem);
 }
 
-hitable *two_spheres() {
-	texture *checker = new checker_texture(new constant_texture(vec3(0.2f, 0.3f, 0.1f)), new constant_texture(vec3(0.9f, 0.9f, 0.9f)));
-	hitable **list = new hitable*[2];
-	list[0] = new sphere(vec3(0, -10, 0), 10, new lambertian(checker));
-	list[1] = new sphere(vec3(0, 10, 0), 10, new lambertian(checker));
+hitable *two_spheres(arena& mem, material_pool& mats) {
+	texture_id checker = mats.add_texture(checker_texture(mats.add_texture(constant_texture(vec3(0.2f, 0.3f, 0.1f))), mats.add_texture(constant_texture(vec3(0.9f, 0.9f, 0.9f)))));
+	hitable **list = mem.make_array<hitable *>(2);
+	list[0] = mem.make<sphere>(vec3(0, -10, 0), 10, mats.add(lambertian(checker)));
+	list[1] = mem.make<sphere>(vec3(0, 10, 0), 10, mats.add(lambertian(checker)));
 
-	return new bvh_node(list, 2, 0.0, 1.0);
+	return mem.make<bvh_node>(list, 2, 0.0, 1.0, &mem);
 }
 
-hitable *two_perlin_spheres() {
-	texture *pertext = new noise_texture(4);
-	hitable **list = new hitable*[2];
-	list[0] = new sphere(vec3(0, -1000, 0), 1000, new lambertian(pertext));
-	list[1] = new sphere(vec3(0, 2, 0), 2, new lambertian(pertext));
-	return new bvh_node(list, 2, 0.0, 1.0);
+// how two_perlin_spheres() gives the small sphere its marble
+enum marble_bake {
+	MARBLE_PROCEDURAL,
+	MARBLE_GRID,	// baked over the sphere's bounds
+	MARBLE_UV		// baked over its uv square
+};
+
+hitable *two_perlin_spheres(arena& mem, material_pool& mats, marble_bake bake = MARBLE_PROCEDURAL) {
+	texture_id pertext = mats.add_texture(noise_texture(4));
+	// the ground is too big to bake either way
+	texture_id small = pertext;
+	if (bake == MARBLE_GRID)
+		small = mats.bake_texture(pertext, aabb(vec3(-2, 0, -2), vec3(2, 4, 2)));
+	else if (bake == MARBLE_UV) {
+		// the sphere's 4 pi around takes more texels than a grid's cells over its 4 across
+		bake_options o;
+		o.min_res = 256;
+		o.max_res = 1024;
+		small = mats.bake_uv_texture(pertext, "sphere (0, 2, 0) r 2", [](float u, float v) { return vec3(0, 2, 0) + 2 * sphere_uv_point(u, v); }, o);
+	}
+	hitable **list = mem.make_array<hitable *>(2);
+	list[0] = mem.make<sphere>(vec3(0, -1000, 0), 1000, mats.add(lambertian(pertext)));
+	list[1] = mem.make<sphere>(vec3(0, 2, 0), 2, mats.add(lambertian(small)));
+	return mem.make<bvh_node>(list, 2, 0.0, 1.0, &mem);
 }
 
-hitable *earth() {
-	int nx, ny, nn;
-	unsigned char *tex_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-	material *mat = new lambertian(new image_texture(tex_data, nx, ny));
+hitable *earth(arena& mem, material_pool& mats) {
+	material_id mat = mats.add(lambertian(mats.load_image("earthmap.jpg")));
+
+	return mem.make<sphere>(vec3(0, 0, 0), 2, mat);
+}
 
-	return new sphere(vec3(0, 0, 0), 2, mat);
+hitable *simple_light(arena& mem, material_pool& mats) {
+	material_id pertext = mats.add(lambertian(mats.add_texture(noise_texture(4))));
+	material_id red = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.65f, 0.05f, 0.05f)))));;
+	material_id green = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.12f, 0.45f, 0.15f)))));
+	material_id checker = mats.add(lambertian(mats.add_texture(checker_texture(mats.add_texture(constant_texture(vec3(0.2f, 0.3f, 0.1f))), mats.add_texture(constant_texture(vec3(0.9f, 0.9f, 0.9f)))))));
+	material_id blue = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.05f, 0.05f, 0.65f)))));
+	hitable **list = mem.make_array<hitable *>(4);
+	list[0] = mem.make<sphere>(vec3(0, -1000, 0), 1000, pertext);
+	list[1] = mem.make<sphere>(vec3(0, 2, 0), 2, pertext);
+	list[2] = mem.make<sphere>(vec3(0, 7, 0), 2, mats.add(diffuse_light(mats.add_texture(constant_texture(vec3(4, 4, 4))))));
+	list[3] = mem.make<xy_rect>(3, 5, 1, 3, -2, mats.add(diffuse_light(mats.add_texture(constant_texture(vec3(4, 4, 4))))));
+	return mem.make<bvh_node>(list, 4, 0.0, 1.0, &mem);
 }
 
-hitable *simple_light() {
-	material *pertext = new lambertian(new noise_texture(4));
-	material *red = new lambertian(new constant_texture(vec3(0.65f, 0.05f, 0.05f)));;
-	material *green = new lambertian(new constant_texture(vec3(0.12f, 0.45f, 0.15f)));
-	material *checker = new lambertian(new checker_texture(new constant_texture(vec3(0.2f, 0.3f, 0.1f)), new constant_texture(vec3(0.9f, 0.9f, 0.9f))));
-	material *blue = new lambertian(new constant_texture(vec3(0.05f, 0.05f, 0.65f)));
-	hitable **list = new hitable*[4];
-	list[0] = new sphere(vec3(0, -1000, 0), 1000, pertext);
-	list[1] = new sphere(vec3(0, 2, 0), 2, pertext);
-	list[2] = new sphere(vec3(0, 7, 0), 2, new diffuse_light(new constant_texture(vec3(4, 4, 4))));
-	list[3] = new xy_rect(3, 5, 1, 3, -2, new diffuse_light(new constant_texture(vec3(4, 4, 4))));
-	return new bvh_node(list, 4, 0.0, 1.0);
+// A field of small coloured lamps, for checking light selection: most of them
+// are far from any given point and should hardly ever be picked there.
+hitable *many_lights(arena& mem, material_pool& mats) {
+	const int side = 40;
+	hitable **list = mem.make_array<hitable *>(side * side + 4);
+	int i = 0;
+	material_id white = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.73f, 0.73f, 0.73f)))));
+	list[i++] = mem.make<sphere>(vec3(0, -1000, 0), 1000, white);
+	list[i++] = mem.make<sphere>(vec3(0, 1, 0), 1.0, white);
+	list[i++] = mem.make<sphere>(vec3(-4, 1, 0), 1.0, mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.4f, 0.2f, 0.1f))))));
+	list[i++] = mem.make<sphere>(vec3(4, 1, 0), 1.0, mats.add(metal(vec3(0.7f, 0.6f, 0.5f), 0.3f)));
+	for (int a = 0; a < side; a++) {
+		for (int b = 0; b < side; b++) {
+			vec3 center(-10 + 20.0f * (a + get_rand()) / side, 0.3f + 0.5f * get_rand(), -10 + 20.0f * (b + get_rand()) / side);
+			vec3 c(get_rand(), get_rand(), get_rand());
+			list[i++] = mem.make<sphere>(center, 0.05f, mats.add(diffuse_light(mats.add_texture(constant_texture(8.0f * c)))));
+		}
+	}
+	return mem.make<bvh_node>(list, i, 0.0, 1.0, &mem);
 }
 
-hitable *cornell_box() {
-	hitable **list = new hitable*[6];
+hitable *cornell_box(arena& mem, material_pool& mats) {
+	hitable **list = mem.make_array<hitable *>(9);
 	int i = 0;
-	material *red = new lambertian(new constant_texture(vec3(0.65f, 0.05f, 0.05f)));;
-	material *white = new lambertian(new constant_texture(vec3(0.73f, 0.73f, 0.73f)));
-	material *green = new lambertian(new constant_texture(vec3(0.12f, 0.45f, 0.15f)));
-	material *light = new diffuse_light(new constant_texture(vec3(4, 4, 4)));
-	list[i++] = new flip_normals(new yz_rect(0, 555, 0, 555, 555, green)); // Left wall
-	list[i++] = new yz_rect(0, 555, 0, 555, 0, red); // Right wall
-	//list[i++] = new xz_rect(213, 343, 227, 332, 554, light);
-	list[i++] = new xz_rect(113, 443, 127, 432, 554, light); // bigger light
-	list[i++] = new flip_normals(new xz_rect(0, 555, 0, 555, 555, white)); // Roof
-	list[i++] = new xz_rect(0, 555, 0, 555, 0, white); // Floor
-	list[i++] = new flip_normals(new xy_rect(0, 555, 0, 555, 555, white)); // Back
-	list[i++] = new box(vec3(130, 0, 65), vec3(295, 165, 230), white); // front box
-	list[i++] = new box(vec3(265, 0, 295), vec3(430, 330, 460), white); // rear box
-	list[i++] = new triangle(vec3(130, 130, 260), vec3(430, 130, 260), vec3(300, 330, 260), green);
-	//list[i++] = new translate(new rotate_y(new box(vec3(0, 0, 0), vec3(165, 165, 165), white), -18), vec3(130, 0, 65)); // front box
-	//list[i++] = new translate(new rotate_y(new box(vec3(0, 0, 0), vec3(165, 330, 165), white), 15), vec3(265, 0, 295)); // rear box
-	//list[i++] = new rotate_y(new box(vec3(130, 0, 65), vec3(295, 165, 230), white), -18); // front box
-	//list[i++] = new rotate_y(new box(vec3(265, 0, 295), vec3(430, 330, 460), white), 15); // rear box
-	return new bvh_node(list, i, 0.0, 1.0);
+	material_id red = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.65f, 0.05f, 0.05f)))));;
+	material_id white = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.73f, 0.73f, 0.73f)))));
+	material_id green = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.12f, 0.45f, 0.15f)))));
+	material_id light = mats.add(diffuse_light(mats.add_texture(constant_texture(vec3(4, 4, 4)))));
+	list[i++] = mem.make<flip_normals>(mem.make<yz_rect>(0, 555, 0, 555, 555, green)); // Left wall
+	list[i++] = mem.make<yz_rect>(0, 555, 0, 555, 0, red); // Right wall
+	//list[i++] = mem.make<xz_rect>(213, 343, 227, 332, 554, light);
+	list[i++] = mem.make<xz_rect>(113, 443, 127, 432, 554, light); // bigger light
+	list[i++] = mem.make<flip_normals>(mem.make<xz_rect>(0, 555, 0, 555, 555, white)); // Roof
+	list[i++] = mem.make<xz_rect>(0, 555, 0, 555, 0, white); // Floor
+	list[i++] = mem.make<flip_normals>(mem.make<xy_rect>(0, 555, 0, 555, 555, white)); // Back
+	list[i++] = mem.make<box>(vec3(130, 0, 65), vec3(295, 165, 230), white); // front box
+	list[i++] = mem.make<box>(vec3(265, 0, 295), vec3(430, 330, 460), white); // rear box
+	list[i++] = mem.make<triangle>(vec3(130, 130, 260), vec3(430, 130, 260), vec3(300, 330, 260), green);
+	//list[i++] = mem.make<translate>(mem.make<rotate_y>(mem.make<box>(vec3(0, 0, 0), vec3(165, 165, 165), white), -18), vec3(130, 0, 65)); // front box
+	//list[i++] = mem.make<translate>(mem.make<rotate_y>(mem.make<box>(vec3(0, 0, 0), vec3(165, 330, 165), white), 15), vec3(265, 0, 295)); // rear box
+	//list[i++] = mem.make<rotate_y>(mem.make<box>(vec3(130, 0, 65), vec3(295, 165, 230), white), -18); // front box
+	//list[i++] = mem.make<rotate_y>(mem.make<box>(vec3(265, 0, 295), vec3(430, 330, 460), white), 15); // rear box
+	return mem.make<bvh_node>(list, i, 0.0, 1.0, &mem);
 }
 
-hitable *cornell_smoke() {
-	hitable **list = new hitable*[8];
+hitable *cornell_smoke(arena& mem, material_pool& mats) {
+	hitable **list = mem.make_array<hitable *>(8);
 	int i = 0;
-	material *red = new lambertian(new constant_texture(vec3(0.65f, 0.05f, 0.05f)));;
-	material *white = new lambertian(new constant_texture(vec3(0.73f, 0.73f, 0.73f)));
-	material *green = new lambertian(new constant_texture(vec3(0.12f, 0.45f, 0.15f)));
-	material *light = new diffuse_light(new constant_texture(vec3(4, 4, 4)));
-	list[i++] = new flip_normals(new yz_rect(0, 555, 0, 555, 555, green)); // Left wall
-	list[i++] = new yz_rect(0, 555, 0, 555, 0, red); // Right wall
-	list[i++] = new xz_rect(113, 443, 127, 432, 554, light);
-	list[i++] = new flip_normals(new xz_rect(0, 555, 0, 555, 555, white)); // Roof
-	list[i++] = new xz_rect(0, 555, 0, 555, 0, white); // Floor
-	list[i++] = new flip_normals(new xy_rect(0, 555, 0, 555, 555, white)); // Back
-	hitable *b1 = new translate(new rotate_y(new box(vec3(0, 0, 0), vec3(165, 165, 165), white), -18), vec3(130, 0, 65)); // front box
-	hitable *b2 = new translate(new rotate_y(new box(vec3(0, 0, 0), vec3(165, 330, 165), white), 15), vec3(265, 0, 295)); // rear box
-	list[i++] = new constant_medium(b1, 0.01, new constant_texture(vec3(1.0, 1.0, 1.0)));
-	list[i++] = new constant_medium(b2, 0.01, new constant_texture(vec3(0.0, 0.0, 0.0)));
-	return new bvh_node(list, i, 0.0, 1.0);
+	material_id red = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.65f, 0.05f, 0.05f)))));;
+	material_id white = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.73f, 0.73f, 0.73f)))));
+	material_id green = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.12f, 0.45f, 0.15f)))));
+	material_id light = mats.add(diffuse_light(mats.add_texture(constant_texture(vec3(4, 4, 4)))));
+	list[i++] = mem.make<flip_normals>(mem.make<yz_rect>(0, 555, 0, 555, 555, green)); // Left wall
+	list[i++] = mem.make<yz_rect>(0, 555, 0, 555, 0, red); // Right wall
+	list[i++] = mem.make<xz_rect>(113, 443, 127, 432, 554, light);
+	list[i++] = mem.make<flip_normals>(mem.make<xz_rect>(0, 555, 0, 555, 555, white)); // Roof
+	list[i++] = mem.make<xz_rect>(0, 555, 0, 555, 0, white); // Floor
+	list[i++] = mem.make<flip_normals>(mem.make<xy_rect>(0, 555, 0, 555, 555, white)); // Back
+	hitable *b1 = mem.make<transform>(mem.make<box>(vec3(0, 0, 0), vec3(165, 165, 165), white), mat34::translation(vec3(130, 0, 65)) * mat34::rotation_y(-18)); // front box
+	hitable *b2 = mem.make<transform>(mem.make<box>(vec3(0, 0, 0), vec3(165, 330, 165), white), mat34::translation(vec3(265, 0, 295)) * mat34::rotation_y(15)); // rear box
+	list[i++] = mem.make<constant_medium>(b1, 0.01, mats.add_texture(constant_texture(vec3(1.0, 1.0, 1.0))), mats);
+	list[i++] = mem.make<constant_medium>(b2, 0.01, mats.add_texture(constant_texture(vec3(0.0, 0.0, 0.0))), mats);
+	return mem.make<bvh_node>(list, i, 0.0, 1.0, &mem);
 }
 
-hitable *final() {
+// a cloud of turbulence thinning out towards the edge of a ball, on a sparse grid
+hitable *cornell_cloud(arena& mem, material_pool& mats) {
+	hitable **list = mem.make_array<hitable *>(8);
+	int i = 0;
+	material_id red = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.65f, 0.05f, 0.05f)))));
+	material_id white = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.73f, 0.73f, 0.73f)))));
+	material_id green = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.12f, 0.45f, 0.15f)))));
+	material_id light = mats.add(diffuse_light(mats.add_texture(constant_texture(vec3(15, 15, 15)))));
+	list[i++] = mem.make<flip_normals>(mem.make<yz_rect>(0, 555, 0, 555, 555, green));
+	list[i++] = mem.make<yz_rect>(0, 555, 0, 555, 0, red);
+	list[i++] = mem.make<flip_normals>(mem.make<xz_rect>(213, 343, 227, 332, 554, light));
+	list[i++] = mem.make<flip_normals>(mem.make<xz_rect>(0, 555, 0, 555, 555, white));
+	list[i++] = mem.make<xz_rect>(0, 555, 0, 555, 0, white);
+	list[i++] = mem.make<flip_normals>(mem.make<xy_rect>(0, 555, 0, 555, 555, white));
+	density_grid *grid = mem.make<density_grid>();
+	perlin noise;
+	grid->build(64, 64, 64, [&](const vec3& p) {
+		float falloff = 1.0f - 2.0f * (p - vec3(0.5f, 0.5f, 0.5f)).length();
+		return 4.0f * (falloff + 3.0f * noise.turb(3.0f * p) - 0.3f);
+	});
+	list[i++] = mem.make<grid_medium>(grid, vec3(100, 80, 100), vec3(455, 435, 455), 0.02f, mats.add_texture(constant_texture(vec3(0.9f, 0.9f, 0.9f))), mats);
+	return mem.make<bvh_node>(list, i, 0.0, 1.0, &mem);
+}
+
+hitable *final(arena& mem, material_pool& mats) {
 	int nb = 20;
-	hitable **list = new hitable*[30];
-	hitable **boxlist = new hitable*[10000];
-	hitable **boxlist2 = new hitable*[10000];
-	material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
-	material *ground = new lambertian(new constant_texture(vec3(0.48, 0.83, 0.53)));
+	hitable **list = mem.make_array<hitable *>(30);
+	hitable **boxlist = mem.make_array<hitable *>(nb * nb);
+	material_id white = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.73, 0.73, 0.73)))));
+	material_id ground = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.48, 0.83, 0.53)))));
 	int b = 0;
 	for (int i = 0; i < nb; i++) {
 		for (int j = 0; j < nb; j++) {
@@ -197,166 +309,119 @@ hitable *final() {
 			float x1 = x0 + w;
 			float y1 = 100 * (get_rand() + 0.01);
 			float z1 = z0 + w;
-			boxlist[b++] = new box(vec3(x0, y0, z0), vec3(x1, y1, z1), ground);
+			boxlist[b++] = mem.make<box>(vec3(x0, y0, z0), vec3(x1, y1, z1), ground);
 		}
 	}
 	int l = 0;
-	list[l++] = new bvh_node(boxlist, b, 0, 1);
-	material *light = new diffuse_light(new constant_texture(vec3(7, 7, 7)));
-	list[l++] = new xz_rect(123, 423, 147, 412, 554, light);
+	list[l++] = mem.make<bvh_node>(boxlist, b, 0, 1, &mem);
+	material_id light = mats.add(diffuse_light(mats.add_texture(constant_texture(vec3(7, 7, 7)))));
+	list[l++] = mem.make<xz_rect>(123, 423, 147, 412, 554, light);
 	vec3 center(400, 400, 200);
-	list[l++] = new moving_sphere(center, center + vec3(30, 0, 0), 0, 1, 50, new lambertian(new constant_texture(vec3(0.7, 0.3, 0.1))));
-	list[l++] = new sphere(vec3(260, 150, 45), 50, new dielectric(1.5));
-	list[l++] = new sphere(vec3(0, 150, 145), 50, new metal(vec3(0.8, 0.8, 0.9), 10.0));
-	hitable *boundary = new sphere(vec3(360, 150, 145), 70, new dielectric(1.5));
+	list[l++] = mem.make<moving_sphere>(center, center + vec3(30, 0, 0), 0, 1, 50, mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.7, 0.3, 0.1))))));
+	list[l++] = mem.make<sphere>(vec3(260, 150, 45), 50, mats.add(dielectric(1.5)));
+	list[l++] = mem.make<sphere>(vec3(0, 150, 145), 50, mats.add(metal(vec3(0.8, 0.8, 0.9), 10.0)));
+	hitable *boundary = mem.make<sphere>(vec3(360, 150, 145), 70, mats.add(dielectric(1.5)));
 	list[l++] = boundary;
-	list[l++] = new constant_medium(boundary, 0.2, new constant_texture(vec3(0.2, 0.4, 0.9)));
-	boundary = new sphere(vec3(0, 0, 0), 5000, new dielectric(1.5));
-	list[l++] = new constant_medium(boundary, 0.0001, new constant_texture(vec3(1.0, 1.0, 1.0)));
-	int nx, ny, nn;
-	unsigned char *tex_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-	material *emat = new lambertian(new image_texture(tex_data, nx, ny));
-	list[l++] = new sphere(vec3(400, 200, 400), 100, emat);
-	texture *pertext = new noise_texture(0.1);
-	list[l++] = new sphere(vec3(220, 280, 300), 80, new lambertian(pertext));
+	list[l++] = mem.make<constant_medium>(boundary, 0.2, mats.add_texture(constant_texture(vec3(0.2, 0.4, 0.9))), mats);
+	boundary = mem.make<sphere>(vec3(0, 0, 0), 5000, mats.add(dielectric(1.5)));
+	list[l++] = mem.make<constant_medium>(boundary, 0.0001, mats.add_texture(constant_texture(vec3(1.0, 1.0, 1.0))), mats);
+	material_id emat = mats.add(lambertian(mats.load_image("earthmap.jpg")));
+	list[l++] = mem.make<sphere>(vec3(400, 200, 400), 100, emat);
+	texture_id pertext = mats.add_texture(noise_texture(0.1));
+	list[l++] = mem.make<sphere>(vec3(220, 280, 300), 80, mats.add(lambertian(pertext)));
 	int ns = 1000;
+	hitable **boxlist2 = mem.make_array<hitable *>(ns);
 	for (int j = 0; j < ns; j++) {
-		boxlist2[j] = new sphere(vec3(165 * get_rand(), 165 * get_rand(), 165 * get_rand()), 10, white);
+		boxlist2[j] = mem.make<sphere>(vec3(165 * get_rand(), 165 * get_rand(), 165 * get_rand()), 10, white);
 	}
-	list[l++] = new translate(new rotate_y(new bvh_node(boxlist2, ns, 0.0, 1.0), 15), vec3(-100, 270, 395));
-	return new bvh_node(list, l, 0, 1);
+	list[l++] = mem.make<transform>(mem.make<bvh_node>(boxlist2, ns, 0.0, 1.0, &mem), mat34::translation(vec3(-100, 270, 395)) * mat34::rotation_y(15));
+	return mem.make<bvh_node>(list, l, 0, 1, &mem);
 }
 
-hitable *triangles() {
+hitable *triangles(arena& mem, material_pool& mats) {
 	int i = 0;
-	material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
-	texture *pertext = new noise_texture(0.5);
-	int nx, ny, nn;
-	unsigned char *tex_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-	material *emat = new lambertian(new image_texture(tex_data, nx, ny));
-	hitable **list = new hitable*[3];
-	//list[i++] = new sphere(vec3(0, 0, -1), 0.5f, new lambertian(new constant_texture(vec3(0.1f, 0.2f, 0.5f)))); // Blue middle
+	material_id white = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.73, 0.73, 0.73)))));
+	texture_id pertext = mats.add_texture(noise_texture(0.5));
+	material_id emat = mats.add(lambertian(mats.load_image("earthmap.jpg")));
+	hitable **list = mem.make_array<hitable *>(3);
+	//list[i++] = mem.make<sphere>(vec3(0, 0, -1), 0.5f, mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.1f, 0.2f, 0.5f)))))); // Blue middle
 	vec3 a = vec3(-2, 0, -1);
 	vec3 b = vec3(2, 0, -1);
 	vec3 c = vec3(0, 2, -1);
-	hitable *tri = new triangle(a, b, c, new lambertian(new constant_texture(vec3(0.0, 0.0, 1.0))));
+	hitable *tri = mem.make<triangle>(a, b, c, mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.0, 0.0, 1.0))))));
 	// z axis seems backwards, more positive should be toward camera
 	a = vec3(0, 2, -1);
 	b = vec3(2, 0, -1);
 	c = vec3(2, 1, -2);
-	hitable *tri2 = new triangle(a, b, c, new lambertian(new constant_texture(vec3(0.3, 0.9, 0.7))));
-	hitable *marble = new sphere(vec3(0, 1.7, -3), 1.5f, new lambertian(pertext));
+	hitable *tri2 = mem.make<triangle>(a, b, c, mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.3, 0.9, 0.7))))));
+	hitable *marble = mem.make<sphere>(vec3(0, 1.7, -3), 1.5f, mats.add(lambertian(pertext)));
 	//b = c;
 	//c = vec3(1, 1, -3);
-	//hitable *tri2 = new triangle(a, b, c, new metal(vec3(0.2, 0.6, 0.6), 10));
+	//hitable *tri2 = mem.make<triangle>(a, b, c, mats.add(metal(vec3(0.2, 0.6, 0.6), 10)));
 	a = vec3(-2, 2, -3);
 	b = vec3(2, 2, -3);
 	c = vec3(0, 0, -3);
-	hitable *tri3 = new triangle(a, b, c, new lambertian(new constant_texture(vec3(1.0, 0.0, 0.0))));
+	hitable *tri3 = mem.make<triangle>(a, b, c, mats.add(lambertian(mats.add_texture(constant_texture(vec3(1.0, 0.0, 0.0))))));
 	aabb bbox;
 	tri->bounding_box(0, 1, bbox);
- 	hitable *bbox_test = new box(bbox.min(), bbox.max(), white);
+ 	hitable *bbox_test = mem.make<box>(bbox.min(), bbox.max(), white);
 	tri2->bounding_box(0, 1, bbox);
-	hitable *bbox_test2 = new box(bbox.min(), bbox.max(), new lambertian(pertext));
+	hitable *bbox_test2 = mem.make<box>(bbox.min(), bbox.max(), mats.add(lambertian(pertext)));
 	list[i++] = tri;
 	//list[i++] = marble;
 	list[i++] = tri2;
 	//list[i++] = tri3;
 	//list[i++] = bbox_test;
 	//list[i++] = bbox_test2;
-	//list[i++] = new constant_medium(bbox_test, 1.0, new constant_texture(vec3(1.0, 1.0, 1.0)));
-	list[i++] = new sphere(vec3(0, -100.5f, -1), 100, new lambertian(new constant_texture(vec3(0.8f, 0.8f, 0.0f)))); // Giant green that acts as ground
-	//list[i++] = new sphere(vec3(1, 0, -1), 0.5f, new metal(vec3(0.8f, 0.6f, 0.2f))); // Metal right
-	//hitable *boundary = new sphere(vec3(-1, 0, -1), 0.5f, new dielectric(1.5f));
-	//list[i++] = new constant_medium(boundary, 0.95f, new constant_texture(vec3(1.0, 1.0, 1.0)));
-	//list[i++] = new sphere(vec3(-1, 0, -1), 0.5f, new dielectric(1.5f)); // These two act as a sort of glass bubble
-	//list[i++] = new sphere(vec3(-1, 0, -1), -0.45f, new dielectric(1.5f)); // Only work together though?
+	//list[i++] = mem.make<constant_medium>(bbox_test, 1.0, mats.add_texture(constant_texture(vec3(1.0, 1.0, 1.0))), mats);
+	list[i++] = mem.make<sphere>(vec3(0, -100.5f, -1), 100, mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.8f, 0.8f, 0.0f)))))); // Giant green that acts as ground
+	//list[i++] = mem.make<sphere>(vec3(1, 0, -1), 0.5f, mats.add(metal(vec3(0.8f, 0.6f, 0.2f)))); // Metal right
+	//hitable *boundary = mem.make<sphere>(vec3(-1, 0, -1), 0.5f, mats.add(dielectric(1.5f)));
+	//list[i++] = mem.make<constant_medium>(boundary, 0.95f, mats.add_texture(constant_texture(vec3(1.0, 1.0, 1.0))), mats);
+	//list[i++] = mem.make<sphere>(vec3(-1, 0, -1), 0.5f, mats.add(dielectric(1.5f))); // These two act as a sort of glass bubble
+	//list[i++] = mem.make<sphere>(vec3(-1, 0, -1), -0.45f, mats.add(dielectric(1.5f))); // Only work together though?
 	
-	return new bvh_node(list, i, 0, 1);
+	return mem.make<bvh_node>(list, i, 0, 1, &mem);
 }
 
-hitable *ply_test() {
-	int count = 0;
-	hitable **list = new hitable*[0];
+hitable *ply_test(arena& mem, material_pool& mats) {
 	std::string filename = "tinyply\\assets\\icosahedron.ply";
 	//std::string filename = "tinyply\\assets\\sofa.ply";
 	//filename = "bunny.tar\\bunny\\bunny\\reconstruction\\bun_zipper_res2.ply";
 	//filename = "dragon_recon.tar\\dragon_recon\\dragon_recon\\dragon_vrip_res4.ply";
+	material_id mat = mats.add(metal(vec3(0.8, 0.5, 0.2), 0.5f));
+	//material_id mat = mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.5f, 0.1f, 0.5f)))));
+	//material_id mat = mats.add(diffuse_light(mats.add_texture(constant_texture(vec3(4.0f, 4.0f, 4.0f)))));
+	// the mesh is traced straight out of a memory mapped .rtmesh copy, which is
+	// made from the PLY the first time and again whenever the PLY is newer
+	std::string mesh_path = filename + ".rtmesh";
+	mapped_mesh *mesh = mem.make<mapped_mesh>(mat);
+	if (mesh_file_current(mesh_path.c_str(), filename.c_str()) && mesh->open(mesh_path.c_str()))
+		return mesh;
 	//import our PLY model
-	try
-	{
-		std::ifstream ss(filename, std::ios::binary);
-
-		// Parse the header
-		tinyply::PlyFile file(ss);
-
-		for (auto e : file.get_elements())
-		{
-			std::cout << "element - " << e.name << " (" << e.size << ")" << std::endl;
-			for (auto p : e.properties)
-			{
-				std::cout << "\tproperty - " << p.name << " (" << tinyply::PropertyTable[p.propertyType].str << ")" << std::endl;
-			}
-		}
-		std::cout << std::endl;
-
-		for (auto c : file.comments)
-		{
-			std::cout << "Comment: " << c << std::endl;
-		}
-
-		std::vector<float> verts;
-		std::vector<float> norms;
-		std::vector<uint8_t> colors;
-		std::vector<uint32_t> faces;
-		std::vector<float> uvCoords;
-
-		uint32_t vertexCount, normalCount, colorCount, faceCount, faceTexcoordCount, faceColorCount;
-		vertexCount = normalCount = colorCount = faceCount = faceTexcoordCount = faceColorCount = 0;
-
-		vertexCount = file.request_properties_from_element("vertex", { "x", "y", "z" }, verts);
-		normalCount = file.request_properties_from_element("vertex", { "nx", "ny", "nz" }, norms);
-		colorCount = file.request_properties_from_element("vertex", { "red", "green", "blue", "alpha" }, colors);
-
-		faceCount = file.request_properties_from_element("face", { "vertex_indices" }, faces, 3);
-		faceTexcoordCount = file.request_properties_from_element("face", { "texcoord" }, uvCoords, 6);
-
-		file.read(ss);
-
-		std::cout << "\tRead " << verts.size() << " total vertices (" << vertexCount << " properties)." << std::endl;
-		std::cout << "\tRead " << norms.size() << " total normals (" << normalCount << " properties)." << std::endl;
-		std::cout << "\tRead " << colors.size() << " total vertex colors (" << colorCount << " properties)." << std::endl;
-		std::cout << "\tRead " << faces.size() << " total faces (triangles) (" << faceCount << " properties)." << std::endl;
-		std::cout << "\tRead " << uvCoords.size() << " total texcoords (" << faceTexcoordCount << " properties)." << std::endl;
-		std::cout << "\n";
-
-		std::vector<vec3> points;
-		std::vector<triangle> tris;
-		hitable **list = new hitable*[faceCount]; // declare our array with the proper size from the ply, instead of guessing
-		
-		for (int i = 0; i < faces.size(); i++) {
-			int offset = faces[i] * 3;
-			vec3 temp = vec3(verts[offset], verts[offset + 1], verts[offset + 2]);
-
-			points.push_back(temp);
-		}
-		//list[count++] = new sphere(vec3(0, -100.5f, -1), 100, new diffuse_light(new constant_texture(vec3(4.0f, 4.0f, 4.0f)))); // Giant green that acts as ground
-		material *mat = new metal(vec3(0.8, 0.5, 0.2), 0.5f);
-		//material *mat = new lambertian(new constant_texture(vec3(0.5f, 0.1f, 0.5f)));
-		//material *mat = new diffuse_light(new constant_texture(vec3(4.0f, 4.0f, 4.0f)));
-		// now we've got our points out, we can make triangles out of them.
-		for (int i = 0; i < points.size(); i+=3) {
-			list[count++] = new triangle(points[i], points[i + 1], points[i + 2], mat);
-		}
-		// holy shit it fucking works!
+	auto t_load = std::chrono::high_resolution_clock::now();
+	ply_file ply;
+	mesh_source src;
+	if (ply.open(filename.c_str()) && ply.read_mesh(src)) {
+		auto t_read = std::chrono::high_resolution_clock::now();
+		if (!write_mesh_file(mesh_path.c_str(), src))
+			std::cerr << "couldn't write " << mesh_path << std::endl;
+		// read in place only maps the arrays, so the conversion is where most of the file gets touched
+		double read = std::chrono::duration<double>(t_read - t_load).count();
+		double total = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t_load).count();
+		std::cout << "Read " << filename << ": " << src.vertex_count << " vertices, " << src.triangle_count << " triangles, "
+			<< ply.size() / (1024.0 * 1024.0) << " MB" << (ply.read_in_place() ? " in place" : "") << " in " << read * 1000.0
+			<< " ms (" << ply.size() / read / 1e9 << " GB/s), with conversion " << total * 1000.0 << " ms ("
+			<< ply.size() / total / 1e9 << " GB/s)" << std::endl;
 	}
-	catch (const std::exception& e)
-	{
-		std::cerr << "Caught exception: " << e.what() << std::endl;
+	else {
+		std::cerr << "couldn't read " << filename << std::endl;
 	}
+	ply.close();
 
-
-	return new bvh_node(list, count, 0, 1);
+	if (!mesh->open(mesh_path.c_str()))
+		return mem.make<hitable_list>(nullptr, 0);
+	return mesh;
 }
 
 int main() {
@@ -369,26 +434,36 @@ int main() {
 	
 	//std::ofstream ost{ "scene.ppm" };
 	//ost << "P3\n" << nx << " " << ny << "\n255\n";
+	// owns everything the scene is built from, it all goes away with it
+	scene sc;
+	arena& mem = sc.mem;
+	// materials and textures are shared by id, identical ones are only stored once
+	material_pool& mats = sc.mats;
+	// keeps baked textures between runs
+	//sc.tiles.bake_dir = ".";
 	const int NUM_SPHERES = 5;
 	hitable *list[NUM_SPHERES];
-	list[0] = new sphere(vec3(0, 0, -1), 0.5f, new lambertian(new constant_texture(vec3(0.1f, 0.2f, 0.5f)))); // Blue middle
-	list[1] = new sphere(vec3(0, -100.5f, -1), 100, new lambertian(new constant_texture(vec3(0.8f, 0.8f, 0.0f)))); // Giant green that acts as ground
-	list[2] = new sphere(vec3(1, 0, -1), 0.5f, new metal(vec3(0.8f, 0.6f, 0.2f))); // Metal right
-	list[3] = new sphere(vec3(-1, 0, -1), 0.5f, new dielectric(1.5f)); // These two act as a sort of glass bubble
-	list[4] = new sphere(vec3(-1, 0, -1), -0.45f, new dielectric(1.5f)); // Only work together though?
-
-	//hitable *world = new hitable_list(list, NUM_SPHERES);
-	hitable *world = new bvh_node(list, NUM_SPHERES, 0.0, 1.0);
-	world = random_scene();
-	//world = two_spheres();
-	//world = two_perlin_spheres();
-	//world = earth();
-	//world = simple_light();
-	//world = cornell_box();
-	//world = cornell_smoke();
-	//world = final();
-	//world = triangles();
-	//world = ply_test();
+	list[0] = mem.make<sphere>(vec3(0, 0, -1), 0.5f, mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.1f, 0.2f, 0.5f)))))); // Blue middle
+	list[1] = mem.make<sphere>(vec3(0, -100.5f, -1), 100, mats.add(lambertian(mats.add_texture(constant_texture(vec3(0.8f, 0.8f, 0.0f)))))); // Giant green that acts as ground
+	list[2] = mem.make<sphere>(vec3(1, 0, -1), 0.5f, mats.add(metal(vec3(0.8f, 0.6f, 0.2f)))); // Metal right
+	list[3] = mem.make<sphere>(vec3(-1, 0, -1), 0.5f, mats.add(dielectric(1.5f))); // These two act as a sort of glass bubble
+	list[4] = mem.make<sphere>(vec3(-1, 0, -1), -0.45f, mats.add(dielectric(1.5f))); // Only work together though?
+
+	//sc.world = mem.make<hitable_list>(list, NUM_SPHERES);
+	sc.world = mem.make<bvh_node>(list, NUM_SPHERES, 0.0, 1.0, &mem);
+	sc.world = random_scene(mem, mats);
+	//sc.world = two_spheres(mem, mats);
+	//sc.world = two_perlin_spheres(mem, mats);
+	//sc.world = earth(mem, mats);
+	//sc.world = simple_light(mem, mats);
+	//sc.world = many_lights(mem, mats);
+	//sc.world = cornell_box(mem, mats);
+	//sc.world = cornell_smoke(mem, mats);
+	//sc.world = cornell_cloud(mem, mats);
+	//sc.world = final(mem, mats);
+	//sc.world = triangles(mem, mats);
+	//sc.world = ply_test(mem, mats);
+	sc.compile();
 	vec3 lookfrom(13, 3, 2);
 	//lookfrom = vec3(0, 0.05f, 0.1f);
 	//vec3 lookfrom(5, 0, 0.5f); // icosahedron
@@ -408,46 +483,180 @@ int main() {
 	//float vfov = 40.0f;
 
 	camera cam(lookfrom, lookat, vec3(0, 1, 0), vfov, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
-	char *data = new char[nx * ny * 3]; // buffer in bytes for our output image
-	int counter = 0;
+	cam.set_resolution(ny);
+	tracked_vector<char, MEM_FRAMEBUFFER> data(nx * ny * 3); // buffer in bytes for our output image
+
+	// candidates > 0 resamples that many light samples per hit for direct light
+	// instead of taking one; reuse_neighbours > 0 also shares the camera hits'
+	// reservoirs with nearby pixels, which renders the image in whole passes
+	sc.lights.candidates = 0;
+	int reuse_neighbours = 0;
+	float reuse_radius = 20.0f;
+	// scrambled Sobol points per pixel, SAMPLER_RANDOM for plain white noise
+	sampler smp(SAMPLER_SOBOL, uint32_t(generator()));
+	// starts sample s of pixel (i, j), its camera ray takes the first dimensions
+	auto camera_ray = [&](int i, int j, int s) {
+		smp.start(i, j, s);
+		sample2 jitter = smp.get_2d();
+		sample2 lens = smp.get_2d();
+		float shutter = smp.get_1d();
+		return cam.get_ray(float(i + jitter.x) / float(nx), float(j + jitter.y) / float(ny), lens, shutter);
+	};
+	// denoise filters the finished image, guided by the albedo and normal
+	// (facing the camera) of every sample's first hit; write_features also
+	// saves those as images
+	bool denoise = false;
+	bool write_features = false;
+	tracked_vector<vec3, MEM_FRAMEBUFFER> albedos, normals;
+	tracked_vector<float, MEM_FRAMEBUFFER> squares;	// of the samples' luminance, for their variance
+	if (denoise) {
+		albedos.assign(size_t(nx) * ny, vec3(0, 0, 0));
+		normals.assign(size_t(nx) * ny, vec3(0, 0, 0));
+		squares.assign(size_t(nx) * ny, 0.0f);
+	}
+	auto add_features = [&](size_t k, const ray& r, const hit_record *rec) {
+		if (!rec) {
+			albedos[k] += vec3(1, 1, 1);
+			return;
+		}
+		albedos[k] += mats.albedo(rec->mat, r, *rec);
+		normals[k] += dot(r.direction(), rec->normal) > 0 ? -rec->normal : rec->normal;
+	};
+	tracked_vector<vec3, MEM_FRAMEBUFFER> sums;
+	if (sc.lights.candidates > 0 && reuse_neighbours > 0) {
+		reservoir_buffer pass;
+		pass.resize(nx, ny);
+		sums.assign(size_t(nx) * ny, vec3(0, 0, 0));
+		for (int s = 0; s < ns; s++) {
+			for (int j = 0; j < ny; j++) {
+				for (int i = 0; i < nx; i++) {
+					reservoir_buffer::pixel& px = pass.at(i, j);
+					px.r = camera_ray(i, j, s);
+					px.hit = sc.world->hit(px.r, 0.001f, FLT_MAX, px.rec);
+					px.res = reservoir();
+					if (px.hit) {
+						surface_interaction(px.r, px.rec);
+						if (mats.samples_lights(px.rec.mat))
+							resample_lights(mats, sc.lights, px.r, px.rec, sc.lights.candidates, px.res);
+					}
+					if (denoise)
+						add_features(size_t(j) * nx + i, px.r, px.hit ? &px.rec : nullptr);
+				}
+			}
+			pass.reuse(mats, reuse_neighbours, reuse_radius);
+			for (int j = 0; j < ny; j++) {
+				for (int i = 0; i < nx; i++) {
+					reservoir_buffer::pixel& px = pass.at(i, j);
+					// back to the dimensions after the camera's, for the bounces
+					camera_ray(i, j, s);
+					if (px.hit) {
+						vec3 c = shade(px.r, px.rec, sc.world, mats, sc.lights, smp, 0, 0.0f, vec3(0, 0, 0), &pass.result(i, j));
+						sums[size_t(j) * nx + i] += c;
+						if (denoise)
+							squares[size_t(j) * nx + i] += luminance(c) * luminance(c);
+					}
+				}
+			}
+		}
+	}
 
+	tracked_vector<vec3, MEM_FRAMEBUFFER> image(size_t(nx) * ny);
 	for (int j = ny - 1; j >= 0; j--) {
 		for (int i = 0; i < nx; i++) {
+			size_t k = size_t(j) * nx + i;
 			vec3 col(0, 0, 0);
-			for (int s = 0; s < ns; s++) {
-				float u = float(i + get_rand()) / float(nx);
-				float v = float(j + get_rand()) / float(ny);
-				ray r = cam.get_ray(u, v);
-				vec3 p = r.point_at_parameter(2.0);
-				col += color(r, world, 0);
+			if (!sums.empty())
+				col = sums[k];
+			else for (int s = 0; s < ns; s++) {
+				ray r = camera_ray(i, j, s);
+				vec3 c;
+				if (denoise) {
+					// color() split up, to get at the first hit
+					hit_record rec;
+					bool hit = sc.world->hit(r, 0.001f, FLT_MAX, rec);
+					if (hit) {
+						surface_interaction(r, rec);
+						c = shade(r, rec, sc.world, mats, sc.lights, smp, 0, 0.0f, vec3(0, 0, 0));
+					}
+					else
+						c = color(r, sc.world, mats, sc.lights, smp, 0);	// the background
+					add_features(k, r, hit ? &rec : nullptr);
+					squares[k] += luminance(c) * luminance(c);
+				}
+				else
+					c = color(r, sc.world, mats, sc.lights, smp, 0);
+				col += c;
 			}
-
-			col /= float(ns);
-			col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
-			int ir = int(255.99*col[0]);
-			int ig = int(255.99*col[1]);
-			int ib = int(255.99*col[2]);
-
-			data[counter++] = ir;
-			data[counter++] = ig;
-			data[counter++] = ib;
+			image[k] = col / float(ns);
 
 			// predictably, makes slow as fuck
 			// todo: multithread?
 			//int percent = ((float)j / (float)ny) * 100;
 			//std::cout << "\r" << percent << "% remaining | Current Pos: (" << i << ", " << j << ")";
 			//std::cout.flush();
+		}
+	}
+
+	if (denoise) {
+		auto t_filter = std::chrono::high_resolution_clock::now();
+		denoiser filter;
+		filter.resize(nx, ny);
+		for (int j = 0; j < ny; j++) {
+			for (int i = 0; i < nx; i++) {
+				size_t k = size_t(j) * nx + i;
+				float mean = luminance(image[k]);
+				// of the mean, from the samples' spread
+				float variance = ns > 1 ? fmaxf(0.0f, squares[k] / ns - mean * mean) / (ns - 1) : 0.0f;
+				filter.set(i, j, image[k], albedos[k] / float(ns), normals[k] / float(ns), variance);
+			}
+		}
+		filter.run();
+		for (int j = 0; j < ny; j++)
+			for (int i = 0; i < nx; i++)
+				image[size_t(j) * nx + i] = filter.get(i, j);
+		float filter_time = std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::high_resolution_clock::now() - t_filter).count();
+		std::cout << "Denoised in " << filter_time << " seconds." << std::endl;
+	}
 
-			// ppm output
-			//ost << ir << " " << ig << " " << ib << "\n";
+	// pixels * scale + bias in bytes, top row first, square-rooted for gamma 2 if asked
+	auto write_image = [&](const char *file, const tracked_vector<vec3, MEM_FRAMEBUFFER>& pixels, float scale, float bias, bool gamma) {
+		int counter = 0;
+		for (int j = ny - 1; j >= 0; j--) {
+			for (int i = 0; i < nx; i++) {
+				vec3 col = pixels[size_t(j) * nx + i] * scale + vec3(bias, bias, bias);
+				if (gamma)
+					col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
+				data[counter++] = int(255.99*col[0]);
+				data[counter++] = int(255.99*col[1]);
+				data[counter++] = int(255.99*col[2]);
+			}
 		}
+		stbi_write_png(file, nx, ny, 3, data.data(), 0);
+	};
+	if (denoise && write_features) {
+		write_image("albedo.png", albedos, 1.0f / ns, 0.0f, false);
+		// -1..1 to 0..1
+		write_image("normal.png", normals, 0.5f / ns, 0.5f, false);
 	}
 
 	// Lets make an image instead
-	stbi_write_png("scene.png", nx, ny, 3, data, 0);
+	write_image("scene.png", image, 1.0f, 0.0f, true);
 
 	auto t_end = std::chrono::high_resolution_clock::now();
 	float time = std::chrono::duration_cast<std::chrono::duration<float>>(t_end - t_start).count();
 	std::cout << "\nTime elapsed: " << floor(time / 60) << " minutes and " << fmod(time, 60) << " seconds." << std::endl;
+	sc.tiles.print_stats(std::cout);
+	mem_stats.report(std::cout);
+#ifdef MEMORY_JSON
+	// e.g. -DMEMORY_JSON="\"memory.json\"" for a file CI can diff between builds
+	std::ofstream json(MEMORY_JSON);
+	mem_stats.report_json(json);
+#endif
+#ifdef HIT_STATS
+	// every sphere candidate used to pay for get_sphere_uv (atan2 + asin)
+	std::cout << "Primitive hits: " << stats.candidates << ", surfaces evaluated: " << stats.surfaces << std::endl;
+	std::cout << "Sphere uv evaluations: " << stats.sphere_surfaces << " of " << stats.sphere_candidates << " candidates ("
+		<< 100.0 * (stats.sphere_candidates - stats.sphere_surfaces) / std::max(stats.sphere_candidates, 1ULL) << "% of the trig skipped)" << std::endl;
+#endif
 	std::cin.get();
 }
\ No newline at end of file
@@ -0,0 +1,98 @@
+#ifndef MAPPEDFILEH
+#define MAPPEDFILEH
+
+#include <stdint.h>
+#include "memory_stats.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// A whole file mapped read-only. Random access files (traced meshes) turn
+// read-ahead off, files read front to back (loaders) ask for more of it.
+// The mapping is booked as MEM_MAPPED while it's open.
+class mapped_file {
+public:
+	mapped_file() : base(nullptr), length(0) {}
+	~mapped_file() { close(); }
+	bool open(const char *path, bool random_access);
+	void close();
+	bool is_open() const { return base != nullptr; }
+	const char *data() const { return base; }
+	uint64_t size() const { return length; }
+
+private:
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	const char *base;
+	uint64_t length;
+#ifdef _WIN32
+	HANDLE file_handle, mapping;
+#endif
+};
+
+bool mapped_file::open(const char *path, bool random_access) {
+	close();
+#ifdef _WIN32
+	file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		random_access ? FILE_FLAG_RANDOM_ACCESS : FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file_handle, &file_size);
+	length = uint64_t(file_size.QuadPart);
+	mapping = length ? CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+	base = mapping ? (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!base) {
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file_handle);
+		length = 0;
+		return false;
+	}
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	length = uint64_t(st.st_size);
+	void *p = mmap(nullptr, size_t(length), PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		length = 0;
+		return false;
+	}
+	madvise(p, size_t(length), random_access ? MADV_RANDOM : MADV_SEQUENTIAL);
+	base = (const char *)p;
+#endif
+	mem_stats.add(MEM_MAPPED, size_t(length));
+	return true;
+}
+
+void mapped_file::close() {
+	if (!base)
+		return;
+	mem_stats.sub(MEM_MAPPED, size_t(length));
+#ifdef _WIN32
+	UnmapViewOfFile(base);
+	CloseHandle(mapping);
+	CloseHandle(file_handle);
+#else
+	munmap((void *)base, size_t(length));
+#endif
+	base = nullptr;
+	length = 0;
+}
+
+#endif // !MAPPEDFILEH
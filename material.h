@@ -4,24 +4,24 @@
 #include "ray.h"
 #include "hitable.h"
 #include "texture.h"
+#include "simd.h"
+#include "sampling.h"
 
-vec3 random_in_unit_sphere()
+float schlick(float cosine, float ref_idx)
 {
-	vec3 p;
-	do {
-		//p = vec3(get_rand(), get_rand(), get_rand());
-		p = 2.0 * vec3(get_rand(), get_rand(), get_rand()) - vec3(1, 1, 1);
-	} while (dot(p, p) >= 1.0);
-	// these both give the same result
-	//} while (p.squared_length() >= 1.0);
-	return p;
+	float r0 = (1 - ref_idx) / (1 + ref_idx);
+	r0 = r0*r0;
+	return r0 + (1 - r0)*pow((1 - cosine), 5);
 }
 
-float schlick(float cosine, float ref_idx)
+template <int N>
+floatx<N> schlick(floatx<N> cosine, float ref_idx)
 {
 	float r0 = (1 - ref_idx) / (1 + ref_idx);
 	r0 = r0*r0;
-	return r0 + (1 - r0)*pow((1 - cosine), 5);
+	floatx<N> m = 1.0f - cosine;
+	floatx<N> m2 = m*m;
+	return r0 + (1 - r0)*(m2*m2*m);
 }
 
 bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted)
@@ -41,63 +41,108 @@ vec3 reflect(const vec3& v, const vec3& n) {
 	return v - 2 * dot(v, n)*n;
 }
 
-class material {
-public:
-	virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const = 0;
-	virtual vec3 emitted(float u, float v, const vec3& p) const {
-		return vec3(0, 0, 0);
-	}
-};
+// Width of the ray's footprint at the hit in uv units, for picking texture mip
+// levels. Dividing by the cosine widens it at grazing angles, where one pixel
+// covers a long strip of the surface.
+inline float uv_footprint(const ray& r_in, const hit_record& rec) {
+	if (rec.uv_density == 0.0f)
+		return 0.0f;
+	float width = r_in.footprint(rec.t) * rec.uv_density;
+	float cosine = fabs(dot(r_in.direction(), rec.normal)) / sqrt(r_in.direction().squared_length() * rec.normal.squared_length());
+	return width / (cosine > 0.05f ? cosine : 0.05f);
+}
 
-class diffuse_light : public material {
+// Materials are plain classes kept in a material_pool and looked up through the
+// material_id in the hit record. Textures come from the pool's texture_pool.
+class diffuse_light {
 public:
-	diffuse_light(texture *a) : emit(a) {}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const { return false;  }
-	virtual vec3 emitted(float u, float v, const vec3& p) const { return emit->value(u, v, p); }
-	texture *emit;
+	diffuse_light(texture_id a) : emit(a) {}
+	bool scatter(const texture_pool& tex, const ray& r_in, const hit_record& rec, const scatter_sample& u, vec3& attenuation, ray& scattered) const { return false;  }
+	vec3 emitted(const texture_pool& tex, float u, float v, const vec3& p) const { return tex.value(emit, u, v, p); }
+	texture_id emit;
 };
 
-class isotropic : public material {
+class isotropic {
 public:
-	isotropic(texture *a) : albedo(a) {}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
-		scattered = ray(rec.p, random_in_unit_sphere());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+	isotropic(texture_id a) : albedo(a) {}
+	bool scatter(const texture_pool& tex, const ray& r_in, const hit_record& rec, const scatter_sample& u, vec3& attenuation, ray& scattered) const {
+		scattered = ray(rec.p, sample_sphere(u.dir));
+		attenuation = tex.value(albedo, rec.u, rec.v, rec.p);
 		return true;
 	}
-	texture *albedo;
+	// scattered radiance per unit of light arriving from the unit direction wi
+	vec3 eval(const texture_pool& tex, const ray& r_in, const hit_record& rec, const vec3& wi) const {
+		return tex.value(albedo, rec.u, rec.v, rec.p) / (4 * _pi);
+	}
+	float pdf(const ray& r_in, const hit_record& rec, const vec3& wi) const { return 1 / (4 * _pi); }
+	texture_id albedo;
 };
 
-class lambertian : public material {
+class lambertian {
 public:
-	lambertian(texture *a) : albedo(a) {}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
-		vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-		scattered = ray(rec.p, target - rec.p, r_in.time());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+	lambertian(texture_id a) : albedo(a) {}
+	bool scatter(const texture_pool& tex, const ray& r_in, const hit_record& rec, const scatter_sample& u, vec3& attenuation, ray& scattered) const {
+		// cosine distributed around the normal, which is what eval() and light sampling assume
+		vec3 dir = from_local(sample_cosine_hemisphere(u.dir), unit_vector(rec.normal));
+		// bounced rays start out as wide as the footprint they arrived with
+		scattered = ray(rec.p, dir, r_in.time(), r_in.footprint(rec.t));
+		attenuation = tex.value(albedo, rec.u, rec.v, rec.p, uv_footprint(r_in, rec));
 		return true;
 	}
-	texture *albedo;
+	// albedo / pi times the cosine, scatter() only bounces to the normal's side
+	vec3 eval(const texture_pool& tex, const ray& r_in, const hit_record& rec, const vec3& wi) const {
+		float cosine = dot(unit_vector(rec.normal), wi);
+		if (cosine <= 0)
+			return vec3(0, 0, 0);
+		return tex.value(albedo, rec.u, rec.v, rec.p, uv_footprint(r_in, rec)) * (cosine / _pi);
+	}
+	float pdf(const ray& r_in, const hit_record& rec, const vec3& wi) const {
+		float cosine = dot(unit_vector(rec.normal), wi);
+		return cosine > 0 ? cosine / _pi : 0;
+	}
+	texture_id albedo;
 };
 
-class metal : public material {
+class metal {
 public:
 	metal(const vec3& a) : albedo(a) { fuzz = 0.25f; } // default fuzziness
 	metal(const vec3& a, float f) : albedo(a) { if (f < 1) fuzz = f; else fuzz = 1; }
-	virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
+	bool scatter(const texture_pool& tex, const ray& r_in, const hit_record& rec, const scatter_sample& u, vec3& attenuation, ray& scattered) const {
 		vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-		scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
+		scattered = ray(rec.p, reflected + fuzz*sample_ball(u.dir, u.pick), 0.0f, r_in.footprint(rec.t));
 		attenuation = albedo;
 		return (dot(scattered.direction(), rec.normal) > 0);
 	}
+	// Density of scatter() picking the unit direction wi. The directions come
+	// from a uniform ball of radius fuzz around the mirror direction, so the
+	// density along wi is the part of the ball on that line, weighted by the
+	// squared distance: the integral of t^2 over the chord, over the volume.
+	float pdf(const ray& r_in, const hit_record& rec, const vec3& wi) const {
+		if (fuzz <= 0)
+			return 0;
+		float cosine = dot(wi, reflect(unit_vector(r_in.direction()), rec.normal));
+		float half_chord2 = fuzz * fuzz - (1 - cosine * cosine);
+		if (half_chord2 <= 0)
+			return 0;
+		float t1 = cosine + sqrt(half_chord2), t0 = ffmax(0.0f, cosine - sqrt(half_chord2));
+		if (t1 <= 0)
+			return 0;
+		return (t1 * t1 * t1 - t0 * t0 * t0) / (4 * _pi * fuzz * fuzz * fuzz);
+	}
+	// directions below the surface are absorbed, the rest keep albedo
+	vec3 eval(const texture_pool& tex, const ray& r_in, const hit_record& rec, const vec3& wi) const {
+		if (dot(wi, rec.normal) <= 0)
+			return vec3(0, 0, 0);
+		return albedo * pdf(r_in, rec, wi);
+	}
 	vec3 albedo;
 	float fuzz;
 };
 
-class dielectric : public material {
+class dielectric {
 public:
 	dielectric(float ri) : ref_idx(ri) {}
-	virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const {
+	bool scatter(const texture_pool& tex, const ray& r_in, const hit_record& rec, const scatter_sample& u, vec3& attenuation, ray& scattered) const {
 		vec3 outward_normal;
 		vec3 reflected = reflect(r_in.direction(), rec.normal);
 		float ni_over_nt;
@@ -125,11 +170,11 @@ public:
 			// scattered = ray(rec.p, reflected);
 			reflect_prob = 1.0;
 		}
-		if (get_rand() < reflect_prob) {
-			scattered = ray(rec.p, reflected);
+		if (u.pick < reflect_prob) {
+			scattered = ray(rec.p, reflected, 0.0f, r_in.footprint(rec.t));
 		}
 		else {
-			scattered = ray(rec.p, refracted);
+			scattered = ray(rec.p, refracted, 0.0f, r_in.footprint(rec.t));
 		}
 		return true;
 	}
@@ -137,4 +182,127 @@ public:
 	float ref_idx;
 };
 
+enum material_type {
+	MAT_LAMBERTIAN,
+	MAT_METAL,
+	MAT_DIELECTRIC,
+	MAT_DIFFUSE_LIGHT,
+	MAT_ISOTROPIC
+};
+
+template <class T> using material_vector = tracked_vector<T, MEM_MATERIALS>;
+
+class material_pool {
+public:
+	material_id add(const lambertian& m) { return insert(MAT_LAMBERTIAN, lambertians, m, m.albedo); }
+	material_id add(const metal& m) {
+		float key[4] = { m.albedo.x(), m.albedo.y(), m.albedo.z(), m.fuzz };
+		return insert(MAT_METAL, metals, m, key);
+	}
+	material_id add(const dielectric& m) { return insert(MAT_DIELECTRIC, dielectrics, m, m.ref_idx); }
+	material_id add(const diffuse_light& m) { return insert(MAT_DIFFUSE_LIGHT, lights, m, m.emit); }
+	material_id add(const isotropic& m) { return insert(MAT_ISOTROPIC, isotropics, m, m.albedo); }
+	// textures go into the pool the materials read from
+	template <class T>
+	texture_id add_texture(const T& t) { return textures.add(t); }
+	texture_id load_image(const char *file, texel_format format = TEXEL_RGBA8) { return textures.load_image(file, format); }
+	texture_id bake_texture(texture_id t, const aabb& box, const bake_options& o = bake_options()) { return textures.bake(t, box, o); }
+	template <class F>
+	texture_id bake_uv_texture(texture_id t, const char *surface, F point, const bake_options& o = bake_options()) { return textures.bake_uv(t, surface, point, o); }
+
+	inline bool scatter(material_id id, const ray& r_in, const hit_record& rec, const scatter_sample& u, vec3& attenuation, ray& scattered) const {
+		uint32_t i = pool_index(id);
+		switch (pool_type(id)) {
+		case MAT_LAMBERTIAN:	return lambertians[i].scatter(textures, r_in, rec, u, attenuation, scattered);
+		case MAT_METAL:			return metals[i].scatter(textures, r_in, rec, u, attenuation, scattered);
+		case MAT_DIELECTRIC:	return dielectrics[i].scatter(textures, r_in, rec, u, attenuation, scattered);
+		case MAT_ISOTROPIC:		return isotropics[i].scatter(textures, r_in, rec, u, attenuation, scattered);
+		default:				return false;
+		}
+	}
+	// Materials whose scatter() has a density over directions (not mirrors
+	// or glass), so lights can be sampled from them and the two strategies
+	// weighed against each other. eval() is their response to light from the
+	// unit direction wi, cosine included, pdf() how likely scatter() is to
+	// pick wi, per unit solid angle.
+	inline bool samples_lights(material_id id) const {
+		switch (pool_type(id)) {
+		case MAT_LAMBERTIAN:
+		case MAT_ISOTROPIC:		return true;
+		case MAT_METAL:			return metals[pool_index(id)].fuzz > 0;
+		default:				return false;
+		}
+	}
+	inline vec3 eval(material_id id, const ray& r_in, const hit_record& rec, const vec3& wi) const {
+		uint32_t i = pool_index(id);
+		switch (pool_type(id)) {
+		case MAT_LAMBERTIAN:	return lambertians[i].eval(textures, r_in, rec, wi);
+		case MAT_METAL:			return metals[i].eval(textures, r_in, rec, wi);
+		case MAT_ISOTROPIC:		return isotropics[i].eval(textures, r_in, rec, wi);
+		default:				return vec3(0, 0, 0);
+		}
+	}
+	inline float pdf(material_id id, const ray& r_in, const hit_record& rec, const vec3& wi) const {
+		uint32_t i = pool_index(id);
+		switch (pool_type(id)) {
+		case MAT_LAMBERTIAN:	return lambertians[i].pdf(r_in, rec, wi);
+		case MAT_METAL:			return metals[i].pdf(r_in, rec, wi);
+		case MAT_ISOTROPIC:		return isotropics[i].pdf(r_in, rec, wi);
+		default:				return 0;
+		}
+	}
+	// The colour a surface reflects overall, for the denoiser's feature
+	// buffers: textures for diffuse surfaces, 1 for glass, and lights'
+	// emission capped at 1.
+	inline vec3 albedo(material_id id, const ray& r_in, const hit_record& rec) const {
+		uint32_t i = pool_index(id);
+		switch (pool_type(id)) {
+		case MAT_LAMBERTIAN:	return textures.value(lambertians[i].albedo, rec.u, rec.v, rec.p, uv_footprint(r_in, rec));
+		case MAT_METAL:			return metals[i].albedo;
+		case MAT_ISOTROPIC:		return textures.value(isotropics[i].albedo, rec.u, rec.v, rec.p);
+		case MAT_DIFFUSE_LIGHT: {
+			vec3 e = lights[i].emitted(textures, rec.u, rec.v, rec.p);
+			return vec3(fminf(e.x(), 1.0f), fminf(e.y(), 1.0f), fminf(e.z(), 1.0f));
+		}
+		default:				return vec3(1, 1, 1);
+		}
+	}
+	inline vec3 emitted(material_id id, float u, float v, const vec3& p) const {
+		if (pool_type(id) == MAT_DIFFUSE_LIGHT)
+			return lights[pool_index(id)].emitted(textures, u, v, p);
+		return vec3(0, 0, 0);
+	}
+	size_t size() const { return lambertians.size() + metals.size() + dielectrics.size() + lights.size() + isotropics.size(); }
+	void clear() {
+		lambertians.clear();
+		metals.clear();
+		dielectrics.clear();
+		lights.clear();
+		isotropics.clear();
+		textures.clear();
+		dedup.clear();
+	}
+
+	material_vector<lambertian> lambertians;
+	material_vector<metal> metals;
+	material_vector<dielectric> dielectrics;
+	material_vector<diffuse_light> lights;
+	material_vector<isotropic> isotropics;
+	texture_pool textures;
+
+private:
+	template <class T, class K>
+	material_id insert(material_type type, material_vector<T>& list, const T& m, const K& params) {
+		std::string k = dedup.key(type, params);
+		material_id id;
+		if (dedup.find(k, id))
+			return id;
+		id = make_pool_id(type, list.size());
+		list.push_back(m);
+		dedup.insert(k, id);
+		return id;
+	}
+	pool_dedup dedup;
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,108 @@
+#ifndef MATRIXH
+#define MATRIXH
+
+#include "vec3.h"
+
+const extern float _pi;
+
+// 3x4 affine matrix, the last column is the translation
+class mat34 {
+public:
+	mat34() {}
+	mat34(float m00, float m01, float m02, float m03,
+		float m10, float m11, float m12, float m13,
+		float m20, float m21, float m22, float m23) {
+		m[0][0] = m00; m[0][1] = m01; m[0][2] = m02; m[0][3] = m03;
+		m[1][0] = m10; m[1][1] = m11; m[1][2] = m12; m[1][3] = m13;
+		m[2][0] = m20; m[2][1] = m21; m[2][2] = m22; m[2][3] = m23;
+	}
+
+	static mat34 identity() {
+		return mat34(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0);
+	}
+	static mat34 translation(const vec3& offset) {
+		return mat34(1, 0, 0, offset.x(), 0, 1, 0, offset.y(), 0, 0, 1, offset.z());
+	}
+	static mat34 scaling(const vec3& s) {
+		return mat34(s.x(), 0, 0, 0, 0, s.y(), 0, 0, 0, 0, s.z(), 0);
+	}
+	// angles are in degrees, same as rotate_y
+	static mat34 rotation_x(float angle) {
+		float radians = (_pi / 180.0f) * angle;
+		float s = sin(radians), c = cos(radians);
+		return mat34(1, 0, 0, 0, 0, c, -s, 0, 0, s, c, 0);
+	}
+	static mat34 rotation_y(float angle) {
+		float radians = (_pi / 180.0f) * angle;
+		return rotation_y(sin(radians), cos(radians));
+	}
+	static mat34 rotation_y(float sin_theta, float cos_theta) {
+		return mat34(cos_theta, 0, sin_theta, 0, 0, 1, 0, 0, -sin_theta, 0, cos_theta, 0);
+	}
+	static mat34 rotation_z(float angle) {
+		float radians = (_pi / 180.0f) * angle;
+		float s = sin(radians), c = cos(radians);
+		return mat34(c, -s, 0, 0, s, c, 0, 0, 0, 0, 1, 0);
+	}
+
+	inline vec3 transform_point(const vec3& p) const {
+		return vec3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+			m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+			m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+	}
+	inline vec3 transform_vector(const vec3& v) const {
+		return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+			m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+			m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+	}
+
+	mat34 inverse() const;
+	// inverse transpose of the linear part, for carrying normals out of local space
+	mat34 normal_matrix() const;
+
+	float m[3][4];
+};
+
+// a*b applies b first, then a
+inline mat34 operator*(const mat34& a, const mat34& b) {
+	mat34 r;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 4; j++) {
+			r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+		}
+		r.m[i][3] += a.m[i][3];
+	}
+	return r;
+}
+
+mat34 mat34::inverse() const {
+	float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+	float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+	float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+	float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+	if (det == 0.0f)
+		std::cerr << "singular matrix in mat34::inverse\n";
+	float inv_det = 1.0f / det;
+	mat34 r;
+	r.m[0][0] = c00 * inv_det;
+	r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+	r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+	r.m[1][0] = c01 * inv_det;
+	r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+	r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+	r.m[2][0] = c02 * inv_det;
+	r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+	r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+	for (int i = 0; i < 3; i++)
+		r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+	return r;
+}
+
+mat34 mat34::normal_matrix() const {
+	mat34 inv = inverse();
+	return mat34(inv.m[0][0], inv.m[1][0], inv.m[2][0], 0,
+		inv.m[0][1], inv.m[1][1], inv.m[2][1], 0,
+		inv.m[0][2], inv.m[1][2], inv.m[2][2], 0);
+}
+
+#endif // !MATRIXH
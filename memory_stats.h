@@ -0,0 +1,177 @@
+#ifndef MEMORYSTATSH
+#define MEMORYSTATSH
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <new>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+// What an allocation is for. Arena memory handed out to nobody yet (the tail
+// of each block) counts as MEM_ARENA_SLACK, so the categories add up to what
+// was really taken from the system. MEM_MAPPED is file-backed address space
+// the OS pages in and out, not heap.
+enum mem_category {
+	MEM_GEOMETRY,
+	MEM_BVH,
+	MEM_TEXTURES,
+	MEM_VOLUMES,
+	MEM_MATERIALS,
+	MEM_FRAMEBUFFER,
+	MEM_IMAGE_IO,
+	MEM_MAPPED,
+	MEM_ARENA_SLACK,
+	MEM_CATEGORY_COUNT
+};
+
+inline const char *mem_category_name(int c) {
+	static const char *names[MEM_CATEGORY_COUNT] = {
+		"geometry", "bvh", "textures", "volumes", "materials", "framebuffer", "image_io", "mapped", "arena_slack"
+	};
+	return names[c];
+}
+
+// Current and peak bytes plus allocation counts per category. Counters are
+// atomic so any thread may allocate; nothing here is on the tracing path.
+class memory_stats {
+public:
+	struct counter {
+		std::atomic<int64_t> current{ 0 };
+		std::atomic<int64_t> peak{ 0 };
+		std::atomic<uint64_t> allocs{ 0 };
+		std::atomic<uint64_t> frees{ 0 };
+	};
+
+	void add(mem_category c, size_t bytes) {
+		counter& k = counters[c];
+		k.allocs++;
+		raise(k.peak, k.current += int64_t(bytes));
+		if (c != MEM_MAPPED)
+			raise(total_peak, total += int64_t(bytes));
+	}
+	void sub(mem_category c, size_t bytes) {
+		counters[c].frees++;
+		counters[c].current -= int64_t(bytes);
+		if (c != MEM_MAPPED)
+			total -= int64_t(bytes);
+	}
+	// an allocation carved out of memory already counted under from (arena
+	// blocks), and handing it back; the heap total doesn't change
+	void claim(mem_category from, mem_category to, size_t bytes) {
+		counters[to].allocs++;
+		counters[from].current -= int64_t(bytes);
+		raise(counters[to].peak, counters[to].current += int64_t(bytes));
+	}
+	void unclaim(mem_category from, mem_category to, size_t bytes) {
+		counters[from].frees++;
+		counters[from].current -= int64_t(bytes);
+		counters[to].current += int64_t(bytes);
+	}
+	void report(std::ostream& out) const;
+	void report_json(std::ostream& out) const;
+
+	counter counters[MEM_CATEGORY_COUNT];
+	std::atomic<int64_t> total{ 0 };
+	std::atomic<int64_t> total_peak{ 0 };
+
+private:
+	static void raise(std::atomic<int64_t>& peak, int64_t value) {
+		int64_t p = peak.load();
+		while (value > p && !peak.compare_exchange_weak(p, value)) {}
+	}
+};
+memory_stats mem_stats;
+
+// What arena::make<T>() books T under. Classes that are acceleration
+// structure rather than scene content specialise this next to their definition.
+template <class T>
+struct mem_category_of {
+	static const mem_category value = MEM_GEOMETRY;
+};
+
+void memory_stats::report(std::ostream& out) const {
+	out << "Memory          current MB     peak MB     allocs      frees" << std::endl;
+	for (int c = 0; c < MEM_CATEGORY_COUNT; c++) {
+		const counter& k = counters[c];
+		out << std::left << std::setw(12) << mem_category_name(c) << std::right << std::fixed << std::setprecision(2)
+			<< std::setw(14) << k.current / (1024.0 * 1024.0) << std::setw(12) << k.peak / (1024.0 * 1024.0)
+			<< std::setw(11) << k.allocs << std::setw(11) << k.frees << std::endl;
+	}
+	out << std::left << std::setw(12) << "heap total" << std::right << std::setw(14) << total / (1024.0 * 1024.0)
+		<< std::setw(12) << total_peak / (1024.0 * 1024.0) << std::endl;
+	out.unsetf(std::ios::floatfield);
+}
+
+void memory_stats::report_json(std::ostream& out) const {
+	out << "{\n";
+	for (int c = 0; c < MEM_CATEGORY_COUNT; c++) {
+		const counter& k = counters[c];
+		out << "  \"" << mem_category_name(c) << "\": { \"current\": " << k.current << ", \"peak\": " << k.peak
+			<< ", \"allocs\": " << k.allocs << ", \"frees\": " << k.frees << " },\n";
+	}
+	out << "  \"heap_total\": { \"current\": " << total << ", \"peak\": " << total_peak << " }\n}" << std::endl;
+}
+
+// std allocator that books its memory under C, for the pools and buffers
+// that live outside the arena
+template <class T, mem_category C>
+struct tracked_allocator {
+	typedef T value_type;
+	template <class U> struct rebind { typedef tracked_allocator<U, C> other; };
+	tracked_allocator() {}
+	template <class U> tracked_allocator(const tracked_allocator<U, C>&) {}
+	T *allocate(size_t n) {
+		T *p = static_cast<T *>(::operator new(n * sizeof(T)));
+		mem_stats.add(C, n * sizeof(T));
+		return p;
+	}
+	void deallocate(T *p, size_t n) {
+		mem_stats.sub(C, n * sizeof(T));
+		::operator delete(p);
+	}
+};
+
+template <class T, class U, mem_category C>
+bool operator==(const tracked_allocator<T, C>&, const tracked_allocator<U, C>&) { return true; }
+template <class T, class U, mem_category C>
+bool operator!=(const tracked_allocator<T, C>&, const tracked_allocator<U, C>&) { return false; }
+
+template <class T, mem_category C>
+using tracked_vector = std::vector<T, tracked_allocator<T, C> >;
+
+// malloc-style hooks for C libraries (stb_image), the size sits in front of
+// the block so free doesn't need it
+inline void *tracked_malloc(size_t size, mem_category c) {
+	char *p = (char *)malloc(size + 16);
+	if (!p)
+		return nullptr;
+	*(size_t *)p = size;
+	mem_stats.add(c, size);
+	return p + 16;
+}
+
+inline void tracked_free(void *ptr, mem_category c) {
+	if (!ptr)
+		return;
+	char *p = (char *)ptr - 16;
+	mem_stats.sub(c, *(size_t *)p);
+	free(p);
+}
+
+inline void *tracked_realloc(void *ptr, size_t size, mem_category c) {
+	if (!ptr)
+		return tracked_malloc(size, c);
+	char *p = (char *)ptr - 16;
+	size_t old = *(size_t *)p;
+	char *q = (char *)realloc(p, size + 16);
+	if (!q)
+		return nullptr;
+	*(size_t *)q = size;
+	mem_stats.sub(c, old);
+	mem_stats.add(c, size);
+	return q + 16;
+}
+
+#endif // !MEMORYSTATSH
@@ -0,0 +1,396 @@
+#ifndef MESHFILEH
+#define MESHFILEH
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <sys/stat.h>
+#include "hitable.h"
+#include "triangle.h"
+#include "compiled_scene.h"
+#include "mapped_file.h"
+
+// Binary triangle mesh laid out to be traced straight from a memory map.
+// Triangles are grouped into spatially compact clusters of at most
+// MESH_CLUSTER_TRIS; each cluster carries its own bvh, vertices and 16-bit
+// indices in one page-aligned run, so tracing a ray only touches the pages of
+// the clusters it gets near and the OS pages them in (and out) on demand.
+//   mesh_header
+//   top-level bvh over the clusters, mesh_node[top_node_count]
+//   mesh_cluster[cluster_count], in top-level leaf order
+//   per cluster, at data_offset: mesh_node[node_count],
+//     float[3] x vertex_count, uint16_t[3] x triangle_count
+const int MESH_CLUSTER_TRIS = 1024;
+const uint64_t MESH_PAGE = 4096;
+
+struct mesh_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t cluster_count;
+	uint32_t top_node_count;
+	uint64_t triangle_count;
+	uint64_t vertex_count;
+	float lo[3], hi[3];
+	uint64_t clusters_offset;
+	uint64_t top_nodes_offset;
+	uint64_t file_size;
+};
+
+// interior nodes keep the left child right after them and the right child at
+// offset, leaves keep count items (clusters or triangles) starting at offset
+struct mesh_node {
+	float lo[3], hi[3];
+	uint32_t offset;
+	uint32_t count_axis;	// count << 2 | split axis
+	uint32_t count() const { return count_axis >> 2; }
+	int axis() const { return int(count_axis & 3); }
+};
+
+struct mesh_cluster {
+	float lo[3], hi[3];
+	uint64_t data_offset;
+	uint32_t node_count;
+	uint32_t vertex_count;
+	uint32_t triangle_count;
+	uint32_t pad;
+};
+
+inline mesh_node to_mesh_node(const flat_node& n) {
+	mesh_node m;
+	for (int a = 0; a < 3; a++) {
+		m.lo[a] = n.box.min()[a];
+		m.hi[a] = n.box.max()[a];
+	}
+	m.offset = uint32_t(n.offset);
+	m.count_axis = (uint32_t(n.count) << 2) | uint32_t(n.axis);
+	return m;
+}
+
+inline bool hit_mesh_box(const float lo[3], const float hi[3], const vec3& origin, const vec3& inv_dir, float tmin, float tmax) {
+	return aabb(vec3(lo[0], lo[1], lo[2]), vec3(hi[0], hi[1], hi[2])).hit(origin, inv_dir, tmin, tmax);
+}
+
+// Positions and triangles a mesh file is made from, read where they lie:
+// three floats every vertex_stride bytes and three 32-bit indices every
+// triangle_stride bytes, unaligned, so a loader can hand over arrays straight
+// out of a memory mapped file.
+struct mesh_source {
+	const char *positions;
+	size_t vertex_count, vertex_stride;
+	const char *indices;
+	size_t triangle_count, triangle_stride;
+	vec3 position(size_t i) const {
+		float v[3];
+		memcpy(v, positions + i * vertex_stride, sizeof(v));
+		return vec3(v[0], v[1], v[2]);
+	}
+	void corners(size_t i, uint32_t idx[3]) const { memcpy(idx, indices + i * triangle_stride, 3 * sizeof(uint32_t)); }
+};
+
+// True when the mesh file at path exists and isn't older than the source it
+// was made from (a missing source keeps whatever mesh file there is).
+bool mesh_file_current(const char *path, const char *source_path) {
+	struct stat src, mesh;
+	if (stat(path, &mesh) != 0)
+		return false;
+	return stat(source_path, &src) != 0 || src.st_mtime <= mesh.st_mtime;
+}
+
+// Writes the mesh as a mesh file. The triangle boxes and the clusters are
+// built in memory while converting, only rendering from the file is out of
+// core. Fails on indices past the last vertex.
+bool write_mesh_file(const char *path, const mesh_source& src) {
+	size_t tri_count = src.triangle_count;
+	if (tri_count == 0)
+		return false;
+	std::vector<aabb> boxes(tri_count);
+	std::vector<vec3> centroids(tri_count);
+	for (size_t i = 0; i < tri_count; i++) {
+		uint32_t idx[3];
+		src.corners(i, idx);
+		if (idx[0] >= src.vertex_count || idx[1] >= src.vertex_count || idx[2] >= src.vertex_count)
+			return false;
+		vec3 p[3];
+		for (int k = 0; k < 3; k++)
+			p[k] = src.position(idx[k]);
+		boxes[i] = aabb(vmin(vmin(p[0], p[1]), p[2]), vmax(vmax(p[0], p[1]), p[2]));
+		centroids[i] = (p[0] + p[1] + p[2]) / 3.0f;
+	}
+
+	// median splits along the widest centroid extent until clusters are small
+	std::vector<int> order(tri_count);
+	for (size_t i = 0; i < tri_count; i++)
+		order[i] = int(i);
+	std::vector<std::pair<int, int> > ranges, work(1, std::make_pair(0, int(tri_count)));
+	while (!work.empty()) {
+		std::pair<int, int> r = work.back();
+		work.pop_back();
+		if (r.second - r.first <= MESH_CLUSTER_TRIS) {
+			ranges.push_back(r);
+			continue;
+		}
+		vec3 cmin = centroids[order[r.first]], cmax = cmin;
+		for (int i = r.first; i < r.second; i++) {
+			cmin = vmin(cmin, centroids[order[i]]);
+			cmax = vmax(cmax, centroids[order[i]]);
+		}
+		vec3 extent = cmax - cmin;
+		int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+		int mid = (r.first + r.second) / 2;
+		std::nth_element(order.begin() + r.first, order.begin() + mid, order.begin() + r.second,
+			[&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+		work.push_back(std::make_pair(r.first, mid));
+		work.push_back(std::make_pair(mid, r.second));
+	}
+
+	// top-level bvh with the clusters as primitives, one cluster per leaf
+	std::vector<aabb> cluster_boxes(ranges.size());
+	std::vector<vec3> cluster_centroids(ranges.size());
+	for (size_t c = 0; c < ranges.size(); c++) {
+		aabb b = boxes[order[ranges[c].first]];
+		for (int i = ranges[c].first + 1; i < ranges[c].second; i++)
+			b = surrounding_box(b, boxes[order[i]]);
+		cluster_boxes[c] = b;
+		cluster_centroids[c] = 0.5f * (b.min() + b.max());
+	}
+	std::vector<int> cluster_order(ranges.size());
+	for (size_t c = 0; c < ranges.size(); c++)
+		cluster_order[c] = int(c);
+	std::vector<flat_node> top;
+	build_sah_node(top, cluster_order, cluster_boxes, cluster_centroids, 0, int(ranges.size()), 1);
+
+	mesh_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "RTMS", 4);
+	hdr.version = 1;
+	hdr.cluster_count = uint32_t(ranges.size());
+	hdr.top_node_count = uint32_t(top.size());
+	hdr.triangle_count = tri_count;
+	for (int a = 0; a < 3; a++) {
+		hdr.lo[a] = top[0].box.min()[a];
+		hdr.hi[a] = top[0].box.max()[a];
+	}
+	hdr.top_nodes_offset = sizeof(mesh_header);
+	hdr.clusters_offset = hdr.top_nodes_offset + top.size() * sizeof(mesh_node);
+	uint64_t data = (hdr.clusters_offset + ranges.size() * sizeof(mesh_cluster) + MESH_PAGE - 1) & ~(MESH_PAGE - 1);
+
+	FILE *fp = fopen(path, "wb");
+	if (!fp)
+		return false;
+	bool ok = fseek(fp, long(sizeof(mesh_header)), SEEK_SET) == 0;
+	for (size_t i = 0; i < top.size(); i++) {
+		mesh_node m = to_mesh_node(top[i]);
+		ok = ok && fwrite(&m, sizeof(m), 1, fp) == 1;
+	}
+
+	// each cluster: local bvh, then the vertices it uses, then 16-bit indices
+	std::vector<mesh_cluster> clusters(ranges.size());
+	std::vector<std::vector<char> > blobs(ranges.size());
+	std::vector<int> local(src.vertex_count, -1);
+	for (size_t c = 0; c < ranges.size(); c++) {
+		std::pair<int, int> r = ranges[cluster_order[c]];
+		int n = r.second - r.first;
+		std::vector<int> tri_order(order.begin() + r.first, order.begin() + r.second);
+		std::vector<flat_node> nodes;
+		build_sah_node(nodes, tri_order, boxes, centroids, 0, n);
+		std::vector<uint32_t> used;
+		std::vector<uint16_t> indices(3 * size_t(n));
+		for (int i = 0; i < n; i++) {
+			uint32_t idx[3];
+			src.corners(tri_order[i], idx);
+			for (int k = 0; k < 3; k++) {
+				uint32_t v = idx[k];
+				if (local[v] < 0) {
+					local[v] = int(used.size());
+					used.push_back(v);
+				}
+				indices[3 * i + k] = uint16_t(local[v]);
+			}
+		}
+		mesh_cluster& mc = clusters[c];
+		memset(&mc, 0, sizeof(mc));
+		for (int a = 0; a < 3; a++) {
+			mc.lo[a] = cluster_boxes[cluster_order[c]].min()[a];
+			mc.hi[a] = cluster_boxes[cluster_order[c]].max()[a];
+		}
+		mc.data_offset = data;
+		mc.node_count = uint32_t(nodes.size());
+		mc.vertex_count = uint32_t(used.size());
+		mc.triangle_count = uint32_t(n);
+		std::vector<char>& blob = blobs[c];
+		blob.resize(nodes.size() * sizeof(mesh_node) + used.size() * 3 * sizeof(float) + indices.size() * sizeof(uint16_t));
+		char *out = blob.data();
+		for (size_t i = 0; i < nodes.size(); i++, out += sizeof(mesh_node)) {
+			mesh_node m = to_mesh_node(nodes[i]);
+			memcpy(out, &m, sizeof(m));
+		}
+		for (size_t i = 0; i < used.size(); i++, out += 3 * sizeof(float)) {
+			memcpy(out, src.positions + used[i] * src.vertex_stride, 3 * sizeof(float));
+			local[used[i]] = -1;
+		}
+		memcpy(out, indices.data(), indices.size() * sizeof(uint16_t));
+		hdr.vertex_count += used.size();
+		data = (data + blob.size() + MESH_PAGE - 1) & ~(MESH_PAGE - 1);
+	}
+	hdr.file_size = data;
+	ok = ok && fwrite(clusters.data(), sizeof(mesh_cluster), clusters.size(), fp) == clusters.size();
+	std::vector<char> zeros(MESH_PAGE, 0);
+	uint64_t at = hdr.clusters_offset + clusters.size() * sizeof(mesh_cluster);
+	for (size_t c = 0; c < clusters.size() && ok; c++) {
+		ok = fwrite(zeros.data(), 1, size_t(clusters[c].data_offset - at), fp) == clusters[c].data_offset - at;
+		ok = ok && fwrite(blobs[c].data(), 1, blobs[c].size(), fp) == blobs[c].size();
+		at = clusters[c].data_offset + blobs[c].size();
+	}
+	ok = ok && fwrite(zeros.data(), 1, size_t(hdr.file_size - at), fp) == hdr.file_size - at;
+	ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	return fclose(fp) == 0 && ok;
+}
+
+// A mesh file traced in place through a read-only memory map. Nothing is
+// copied out of it; which clusters are resident is up to the OS, so meshes
+// larger than RAM still render, paging as rays move between clusters.
+class mapped_mesh : public hitable {
+public:
+	mapped_mesh(material_id m) : mat(m), base(nullptr), top(nullptr) {}
+	~mapped_mesh() { close(); }
+	bool open(const char *path);
+	void close();
+	bool is_open() const { return base != nullptr; }
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const;
+	virtual bool bounding_box(float t0, float t1, aabb& box) const {
+		box = aabb(vec3(header->lo[0], header->lo[1], header->lo[2]), vec3(header->hi[0], header->hi[1], header->hi[2]));
+		return true;
+	}
+	uint64_t triangle_count() const { return header->triangle_count; }
+	uint64_t mapped_bytes() const { return file.size(); }
+
+	material_id mat;
+
+private:
+	mapped_mesh(const mapped_mesh&) = delete;
+	mapped_mesh& operator=(const mapped_mesh&) = delete;
+	inline triangle fetch(const mesh_cluster& c, uint32_t tri) const {
+		const char *data = base + c.data_offset;
+		const float *v = (const float *)(data + c.node_count * sizeof(mesh_node));
+		const uint16_t *idx = (const uint16_t *)(v + 3 * size_t(c.vertex_count)) + 3 * size_t(tri);
+		const float *a = v + 3 * idx[0], *b = v + 3 * idx[1], *p = v + 3 * idx[2];
+		return triangle(vec3(a[0], a[1], a[2]), vec3(b[0], b[1], b[2]), vec3(p[0], p[1], p[2]), mat);
+	}
+	bool hit_cluster(uint32_t index, const ray& r, const vec3& inv_dir, float t_min, float t_max, hit_record& rec) const;
+
+	mapped_file file;
+	const char *base;
+	const mesh_header *header;
+	const mesh_node *top;
+	const mesh_cluster *clusters;
+};
+
+bool mapped_mesh::open(const char *path) {
+	close();
+	// rays jump between clusters, read-ahead would mostly fetch pages nobody uses
+	if (!file.open(path, true))
+		return false;
+	base = file.data();
+	uint64_t size = file.size();
+	header = (const mesh_header *)base;
+	if (size < sizeof(mesh_header) || memcmp(header->magic, "RTMS", 4) != 0 || header->version != 1
+		|| header->file_size != size || header->cluster_count == 0
+		|| header->clusters_offset + header->cluster_count * sizeof(mesh_cluster) > size
+		|| header->top_nodes_offset + header->top_node_count * sizeof(mesh_node) > size) {
+		std::cerr << path << " is not a mesh file this build can read" << std::endl;
+		close();
+		return false;
+	}
+	top = (const mesh_node *)(base + header->top_nodes_offset);
+	clusters = (const mesh_cluster *)(base + header->clusters_offset);
+	return true;
+}
+
+void mapped_mesh::close() {
+	file.close();
+	base = nullptr;
+	top = nullptr;
+}
+
+bool mapped_mesh::hit_cluster(uint32_t index, const ray& r, const vec3& inv_dir, float t_min, float t_max, hit_record& rec) const {
+	const mesh_cluster& c = clusters[index];
+	const mesh_node *nodes = (const mesh_node *)(base + c.data_offset);
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	bool hit_anything = false;
+	float closest_so_far = t_max;
+	while (sp > 0) {
+		const mesh_node& node = nodes[stack[--sp]];
+		if (!hit_mesh_box(node.lo, node.hi, r.origin(), inv_dir, t_min, closest_so_far))
+			continue;
+		if (node.count() > 0) {
+			for (uint32_t i = node.offset; i < node.offset + node.count(); i++) {
+				triangle tri = fetch(c, i);
+				if (tri.triangle::hit(r, t_min, closest_so_far, rec)) {
+					hit_anything = true;
+					closest_so_far = rec.t;
+					rec.obj = this;
+					rec.prim = index * MESH_CLUSTER_TRIS + i;
+				}
+			}
+		}
+		else {
+			int left = int(&node - nodes) + 1;
+			if (inv_dir[node.axis()] < 0) {
+				stack[sp++] = left;
+				stack[sp++] = int(node.offset);
+			}
+			else {
+				stack[sp++] = int(node.offset);
+				stack[sp++] = left;
+			}
+		}
+	}
+	return hit_anything;
+}
+
+bool mapped_mesh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	int stack[64];
+	int sp = 0;
+	stack[sp++] = 0;
+	bool hit_anything = false;
+	float closest_so_far = t_max;
+	vec3 inv_dir(1.0f / r.direction().x(), 1.0f / r.direction().y(), 1.0f / r.direction().z());
+	while (sp > 0) {
+		const mesh_node& node = top[stack[--sp]];
+		if (!hit_mesh_box(node.lo, node.hi, r.origin(), inv_dir, t_min, closest_so_far))
+			continue;
+		if (node.count() > 0) {
+			for (uint32_t i = node.offset; i < node.offset + node.count(); i++) {
+				if (hit_cluster(i, r, inv_dir, t_min, closest_so_far, rec)) {
+					hit_anything = true;
+					closest_so_far = rec.t;
+				}
+			}
+		}
+		else {
+			int left = int(&node - top) + 1;
+			if (inv_dir[node.axis()] < 0) {
+				stack[sp++] = left;
+				stack[sp++] = int(node.offset);
+			}
+			else {
+				stack[sp++] = int(node.offset);
+				stack[sp++] = left;
+			}
+		}
+	}
+	return hit_anything;
+}
+
+void mapped_mesh::surface_interaction(const ray& r, hit_record& rec) const {
+	triangle tri = fetch(clusters[rec.prim / MESH_CLUSTER_TRIS], rec.prim % MESH_CLUSTER_TRIS);
+	tri.triangle::surface_interaction(r, rec);
+}
+
+#endif // !MESHFILEH
@@ -2,41 +2,20 @@
 #define PERLINH
 
 #include "vec3.h"
+#include "simd.h"
 
 float get_rand();
 
-inline float perlin_interp(vec3 c[2][2][2], float u, float v, float w) {
-	float uu = u*u*(3 - 2 * u);
-	float vv = v*v*(3 - 2 * v);
-	float ww = w*w*(3 - 2 * w);
-	float accum = 0;
-	for (int i = 0; i < 2; i++)
-		for (int j = 0; j < 2; j++)
-			for (int k = 0; k < 2; k++) {
-				vec3 weight_v(u - i, v - j, w - k);
-				accum += (i*uu + (1 - i)*(1 - uu))*
-					(j*vv + (1 - j)*(1 - vv))*
-					(k*ww + (1 - k)*(1 - ww))*dot(c[i][j][k], weight_v);
-			}
-	return accum;
-}
+// the cube's eight corners go in the lanes of noise(), as many at a time as fit
+#if defined(SIMD_HAVE_4)
+const int PERLIN_WIDTH = 4;
+#else
+const int PERLIN_WIDTH = 1;
+#endif
 
 class perlin {
 public:
-	float noise(const vec3& p) const {
-		float u = p.x() - floor(p.x());
-		float v = p.y() - floor(p.y());
-		float w = p.z() - floor(p.z());
-		int i = floor(p.x());
-		int j = floor(p.y());
-		int k = floor(p.z());
-		vec3 c[2][2][2];
-		for (int di = 0; di < 2; di++)
-			for (int dj = 0; dj < 2; dj++)
-				for (int dk = 0; dk < 2; dk++)
-					c[di][dj][dk] = ranvec[perm_x[(i + di) & 255] ^ perm_y[(j + dj) & 255] ^ perm_z[(k + dk) & 255]];
-		return perlin_interp(c, u, v, w);
-	}
+	float noise(const vec3& p) const;
 
 	float turb(const vec3& p, int depth = 7) const {
 		float accum = 0;
@@ -54,8 +33,45 @@ public:
 	static int *perm_x;
 	static int *perm_y;
 	static int *perm_z;
+	static float *ranvec_soa;	// ranvec's x components, then y, then z
 };
 
+// Corner c of the cell is (c >> 2, (c >> 1) & 1, c & 1) from its low corner.
+// Each lane takes a corner's gradient, dots it with the offset to p and
+// weighs it by the smoothed distance along each axis; the lanes are added up
+// at the end. The hashes are made once per axis rather than once per corner.
+float perlin::noise(const vec3& p) const {
+	static const float corner_x[8] = { 0, 0, 0, 0, 1, 1, 1, 1 };
+	static const float corner_y[8] = { 0, 0, 1, 1, 0, 0, 1, 1 };
+	static const float corner_z[8] = { 0, 1, 0, 1, 0, 1, 0, 1 };
+	const int N = PERLIN_WIDTH;
+	float fx = floor(p.x()), fy = floor(p.y()), fz = floor(p.z());
+	float u = p.x() - fx, v = p.y() - fy, w = p.z() - fz;
+	int i = int(fx), j = int(fy), k = int(fz);
+	int x0 = perm_x[i & 255], x1 = perm_x[(i + 1) & 255];
+	int y0 = perm_y[j & 255], y1 = perm_y[(j + 1) & 255];
+	int z0 = perm_z[k & 255], z1 = perm_z[(k + 1) & 255];
+	int h[8] = { x0 ^ y0 ^ z0, x0 ^ y0 ^ z1, x0 ^ y1 ^ z0, x0 ^ y1 ^ z1, x1 ^ y0 ^ z0, x1 ^ y0 ^ z1, x1 ^ y1 ^ z0, x1 ^ y1 ^ z1 };
+	float uu = u*u*(3 - 2 * u);
+	float vv = v*v*(3 - 2 * v);
+	float ww = w*w*(3 - 2 * w);
+	floatx<N> accum(0.0f);
+	for (int c = 0; c < 8; c += N) {
+		floatx<N> cx = floatx<N>::load(corner_x + c), cy = floatx<N>::load(corner_y + c), cz = floatx<N>::load(corner_z + c);
+		floatx<N> d = floatx<N>::gather(ranvec_soa, h + c) * (u - cx) +
+			floatx<N>::gather(ranvec_soa + 256, h + c) * (v - cy) +
+			floatx<N>::gather(ranvec_soa + 512, h + c) * (w - cz);
+		// 1 - uu at x = 0, uu at x = 1
+		accum += ((1 - uu) + cx * (2 * uu - 1)) * ((1 - vv) + cy * (2 * vv - 1)) * ((1 - ww) + cz * (2 * ww - 1)) * d;
+	}
+	float lanes[N];
+	accum.store(lanes);
+	float sum = 0;
+	for (int l = 0; l < N; l++)
+		sum += lanes[l];
+	return sum;
+}
+
 static vec3* perlin_generate() {
 	vec3 *p = new vec3[256];
 	for (int i = 0; i < 256; ++i)
@@ -85,5 +101,17 @@ int *perlin::perm_x = perlin_generate_perm();
 int *perlin::perm_y = perlin_generate_perm();
 int *perlin::perm_z = perlin_generate_perm();
 
+static float *perlin_split(const vec3 *v) {
+	float *p = new float[3 * 256];
+	for (int i = 0; i < 256; i++) {
+		p[i] = v[i].x();
+		p[256 + i] = v[i].y();
+		p[512 + i] = v[i].z();
+	}
+	return p;
+}
+
+float *perlin::ranvec_soa = perlin_split(perlin::ranvec);
+
 #endif // !PERLINH
 
@@ -0,0 +1,534 @@
+#ifndef PLYFILEH
+#define PLYFILEH
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "mapped_file.h"
+#include "mesh_file.h"
+#include "threads.h"
+
+// PLY reader that works on a memory map of the file. Binary vertex and face
+// arrays laid out as plain floats and triangle index lists are handed to the
+// mesh builder in place, other layouts are converted once into positions and
+// indices. ASCII bodies are parsed by several threads, each taking a run of
+// whole lines.
+enum ply_type {
+	PLY_NONE,
+	PLY_INT8,
+	PLY_UINT8,
+	PLY_INT16,
+	PLY_UINT16,
+	PLY_INT32,
+	PLY_UINT32,
+	PLY_FLOAT32,
+	PLY_FLOAT64
+};
+
+inline int ply_type_size(ply_type t) {
+	static const int sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+	return sizes[t];
+}
+
+inline ply_type ply_type_from_name(const std::string& n) {
+	if (n == "char" || n == "int8")			return PLY_INT8;
+	if (n == "uchar" || n == "uint8")		return PLY_UINT8;
+	if (n == "short" || n == "int16")		return PLY_INT16;
+	if (n == "ushort" || n == "uint16")		return PLY_UINT16;
+	if (n == "int" || n == "int32")			return PLY_INT32;
+	if (n == "uint" || n == "uint32")		return PLY_UINT32;
+	if (n == "float" || n == "float32")		return PLY_FLOAT32;
+	if (n == "double" || n == "float64")	return PLY_FLOAT64;
+	return PLY_NONE;
+}
+
+// one binary value, byte swapped first for big endian files
+inline double ply_read_binary(ply_type t, const char *p, bool swap) {
+	unsigned char b[8];
+	int n = ply_type_size(t);
+	for (int i = 0; i < n; i++)
+		b[i] = (unsigned char)p[swap ? n - 1 - i : i];
+	switch (t) {
+	case PLY_INT8:		return double(int8_t(b[0]));
+	case PLY_UINT8:		return double(b[0]);
+	case PLY_INT16:		{ int16_t v; memcpy(&v, b, 2); return v; }
+	case PLY_UINT16:	{ uint16_t v; memcpy(&v, b, 2); return v; }
+	case PLY_INT32:		{ int32_t v; memcpy(&v, b, 4); return v; }
+	case PLY_UINT32:	{ uint32_t v; memcpy(&v, b, 4); return v; }
+	case PLY_FLOAT32:	{ float v; memcpy(&v, b, 4); return v; }
+	case PLY_FLOAT64:	{ double v; memcpy(&v, b, 8); return v; }
+	default:			return 0;
+	}
+}
+
+// Reads a decimal number at p, no further than end, and returns where it
+// stopped (p itself if there was none). Enough for coordinates and indices;
+// mantissa digits past the 19th only move the exponent.
+inline const char *ply_parse_number(const char *p, const char *end, double& value) {
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	const char *start = p;
+	bool negative = p < end && *p == '-';
+	p += p < end && (*p == '-' || *p == '+');
+	uint64_t mantissa = 0;
+	int exponent = 0, digits = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+		if (mantissa < 1000000000000000000ull)
+			mantissa = mantissa * 10 + uint64_t(*p - '0');
+		else
+			exponent++;
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+			if (mantissa < 1000000000000000000ull) {
+				mantissa = mantissa * 10 + uint64_t(*p - '0');
+				exponent--;
+			}
+		}
+	}
+	if (digits == 0)
+		return start;
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		bool negative_exponent = q < end && *q == '-';
+		q += q < end && (*q == '-' || *q == '+');
+		int e = 0;
+		if (q < end && *q >= '0' && *q <= '9') {
+			for (; q < end && *q >= '0' && *q <= '9'; q++)
+				e = e < 10000 ? e * 10 + (*q - '0') : e;
+			exponent += negative_exponent ? -e : e;
+			p = q;
+		}
+	}
+	double v = double(mantissa);
+	for (; exponent > 22; exponent -= 22)
+		v *= 1e22;
+	for (; exponent < -22; exponent += 22)
+		v /= 1e22;
+	v = exponent < 0 ? v / powers[-exponent] : v * powers[exponent];
+	value = negative ? -v : v;
+	return p;
+}
+
+struct ply_property {
+	std::string name;
+	ply_type type;
+	ply_type count_type;	// PLY_NONE unless this is a list
+};
+
+struct ply_element {
+	std::string name;
+	size_t count;
+	std::vector<ply_property> properties;
+	size_t row_size;		// bytes per binary row, 0 when rows hold lists
+	const char *data;		// first binary row, null for ascii
+	int find(const char *prop) const {
+		for (size_t i = 0; i < properties.size(); i++)
+			if (properties[i].name == prop)
+				return int(i);
+		return -1;
+	}
+};
+
+class ply_file {
+public:
+	enum ply_format { PLY_ASCII, PLY_BINARY_LE, PLY_BINARY_BE };
+
+	ply_file() : body(nullptr), in_place(false) {}
+	bool open(const char *path);
+	void close();
+	// The vertex positions and triangles, polygons fanned into triangles.
+	// Points into the map, or into positions and indices after a conversion;
+	// either way it's valid until the file is closed.
+	bool read_mesh(mesh_source& out);
+	uint64_t size() const { return file.size(); }
+	// whether read_mesh() could use the file's arrays without copying
+	bool read_in_place() const { return in_place; }
+
+	ply_format format;
+	std::vector<ply_element> elements;
+	std::vector<std::string> comments;
+	std::vector<float> positions;
+	std::vector<uint32_t> indices;
+
+private:
+	ply_file(const ply_file&) = delete;
+	ply_file& operator=(const ply_file&) = delete;
+	bool parse_header();
+	bool locate_binary();
+	const char *skip_row(const ply_element& e, const char *p) const;
+	bool read_binary(const ply_element& vertex, const ply_element& face, mesh_source& out);
+	bool read_ascii(mesh_source& out);
+
+	mapped_file file;
+	const char *body;
+	bool in_place;
+};
+
+bool ply_file::open(const char *path) {
+	close();
+	// loading reads the file front to back, let the OS read ahead
+	if (!file.open(path, false))
+		return false;
+	if (!parse_header() || (format != PLY_ASCII && !locate_binary())) {
+		std::cerr << path << " is not a PLY file this build can read" << std::endl;
+		close();
+		return false;
+	}
+	return true;
+}
+
+void ply_file::close() {
+	file.close();
+	body = nullptr;
+	in_place = false;
+	elements.clear();
+	comments.clear();
+	positions = std::vector<float>();
+	indices = std::vector<uint32_t>();
+}
+
+bool ply_file::parse_header() {
+	const char *p = file.data(), *end = p + file.size();
+	if (file.size() < 4 || memcmp(p, "ply", 3) != 0)
+		return false;
+	bool has_format = false;
+	while (p < end) {
+		const char *eol = (const char *)memchr(p, '\n', size_t(end - p));
+		if (!eol)
+			return false;
+		std::string line(p, eol);
+		p = eol + 1;
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		std::vector<std::string> words;
+		for (size_t i = 0; i < line.size();) {
+			size_t j = line.find_first_of(" \t", i);
+			j = j == std::string::npos ? line.size() : j;
+			if (j > i)
+				words.push_back(line.substr(i, j - i));
+			i = j + 1;
+		}
+		if (words.empty())
+			continue;
+		if (words[0] == "end_header") {
+			body = p;
+			return has_format;
+		}
+		if (words[0] == "comment" || words[0] == "obj_info") {
+			comments.push_back(line.size() > words[0].size() + 1 ? line.substr(words[0].size() + 1) : std::string());
+		}
+		else if (words[0] == "format" && words.size() >= 2) {
+			has_format = true;
+			if (words[1] == "ascii")
+				format = PLY_ASCII;
+			else if (words[1] == "binary_little_endian")
+				format = PLY_BINARY_LE;
+			else if (words[1] == "binary_big_endian")
+				format = PLY_BINARY_BE;
+			else
+				return false;
+		}
+		else if (words[0] == "element" && words.size() == 3) {
+			ply_element e;
+			e.name = words[1];
+			e.count = size_t(strtoull(words[2].c_str(), nullptr, 10));
+			e.row_size = 0;
+			e.data = nullptr;
+			elements.push_back(e);
+		}
+		else if (words[0] == "property" && !elements.empty()) {
+			ply_property prop;
+			if (words.size() == 5 && words[1] == "list") {
+				prop.count_type = ply_type_from_name(words[2]);
+				prop.type = ply_type_from_name(words[3]);
+				prop.name = words[4];
+				if (prop.count_type == PLY_NONE || prop.count_type == PLY_FLOAT32 || prop.count_type == PLY_FLOAT64)
+					return false;
+			}
+			else if (words.size() == 3) {
+				prop.count_type = PLY_NONE;
+				prop.type = ply_type_from_name(words[1]);
+				prop.name = words[2];
+			}
+			else {
+				return false;
+			}
+			if (prop.type == PLY_NONE)
+				return false;
+			elements.back().properties.push_back(prop);
+		}
+	}
+	return false;
+}
+
+const char *ply_file::skip_row(const ply_element& e, const char *p) const {
+	if (e.row_size)
+		return p + e.row_size;
+	for (size_t i = 0; i < e.properties.size(); i++) {
+		const ply_property& prop = e.properties[i];
+		if (prop.count_type == PLY_NONE) {
+			p += ply_type_size(prop.type);
+		}
+		else {
+			size_t n = size_t(ply_read_binary(prop.count_type, p, format == PLY_BINARY_BE));
+			p += ply_type_size(prop.count_type) + n * ply_type_size(prop.type);
+		}
+	}
+	return p;
+}
+
+// Finds where each element's rows start. Elements of fixed size rows are
+// stepped over whole, rows with lists have to be walked.
+bool ply_file::locate_binary() {
+	const char *p = body, *end = file.data() + file.size();
+	for (size_t i = 0; i < elements.size(); i++) {
+		ply_element& e = elements[i];
+		e.row_size = 0;
+		bool fixed = true;
+		for (size_t k = 0; k < e.properties.size(); k++) {
+			fixed = fixed && e.properties[k].count_type == PLY_NONE;
+			e.row_size += ply_type_size(e.properties[k].type);
+		}
+		e.row_size = fixed ? e.row_size : 0;
+		e.data = p;
+		if (fixed) {
+			if (size_t(end - p) / (e.row_size ? e.row_size : 1) < e.count)
+				return false;
+			p += e.count * e.row_size;
+			continue;
+		}
+		// only as far as needed, trailing elements after the faces aren't read
+		if (e.name == "face")
+			break;
+		for (size_t r = 0; r < e.count; r++) {
+			p = skip_row(e, p);
+			if (p > end)
+				return false;
+		}
+	}
+	return true;
+}
+
+bool ply_file::read_mesh(mesh_source& out) {
+	in_place = false;
+	if (!body)
+		return false;
+	if (format == PLY_ASCII)
+		return read_ascii(out);
+	const ply_element *vertex = nullptr, *face = nullptr;
+	for (size_t i = 0; i < elements.size(); i++) {
+		vertex = elements[i].name == "vertex" ? &elements[i] : vertex;
+		face = elements[i].name == "face" ? &elements[i] : face;
+	}
+	if (!vertex || !face || !face->data)
+		return false;
+	return read_binary(*vertex, *face, out);
+}
+
+bool ply_file::read_binary(const ply_element& vertex, const ply_element& face, mesh_source& out) {
+	const uint16_t one = 1;
+	bool swap = format == PLY_BINARY_BE;
+	bool native = !swap && *(const char *)&one == 1;
+	int px = vertex.find("x"), py = vertex.find("y"), pz = vertex.find("z");
+	int pi = face.find("vertex_indices");
+	pi = pi < 0 ? face.find("vertex_index") : pi;
+	if (px < 0 || py < 0 || pz < 0 || pi < 0 || !vertex.row_size || face.properties[pi].count_type == PLY_NONE)
+		return false;
+
+	// byte offsets of the coordinates in a vertex row
+	size_t offset[3] = { 0, 0, 0 }, at = 0;
+	for (int k = 0; k < int(vertex.properties.size()); k++) {
+		offset[0] = k == px ? at : offset[0];
+		offset[1] = k == py ? at : offset[1];
+		offset[2] = k == pz ? at : offset[2];
+		at += ply_type_size(vertex.properties[k].type);
+	}
+	out.vertex_count = vertex.count;
+	if (native && vertex.properties[px].type == PLY_FLOAT32 && vertex.properties[py].type == PLY_FLOAT32
+		&& vertex.properties[pz].type == PLY_FLOAT32 && offset[1] == offset[0] + 4 && offset[2] == offset[0] + 8) {
+		out.positions = vertex.data + offset[0];
+		out.vertex_stride = vertex.row_size;
+	}
+	else {
+		positions.resize(3 * vertex.count);
+		size_t threads = thread_count(vertex.count, 4096);
+		run_threads(threads, [&](size_t t) {
+			for (size_t v = vertex.count * t / threads; v < vertex.count * (t + 1) / threads; v++) {
+				const char *row = vertex.data + v * vertex.row_size;
+				positions[3 * v + 0] = float(ply_read_binary(vertex.properties[px].type, row + offset[0], swap));
+				positions[3 * v + 1] = float(ply_read_binary(vertex.properties[py].type, row + offset[1], swap));
+				positions[3 * v + 2] = float(ply_read_binary(vertex.properties[pz].type, row + offset[2], swap));
+			}
+		});
+		out.positions = (const char *)positions.data();
+		out.vertex_stride = 3 * sizeof(float);
+	}
+
+	// Faces are used in place when every one is a triangle of 32-bit indices
+	// and the index list is the face's only list, so rows are the same size.
+	const ply_property& list = face.properties[pi];
+	const char *end = file.data() + file.size();
+	size_t before = 0, after = 0;
+	bool uniform = native && (list.type == PLY_INT32 || list.type == PLY_UINT32);
+	for (int k = 0; k < int(face.properties.size()); k++) {
+		if (k == pi)
+			continue;
+		uniform = uniform && face.properties[k].count_type == PLY_NONE;
+		(k < pi ? before : after) += ply_type_size(face.properties[k].type);
+	}
+	size_t row = before + ply_type_size(list.count_type) + 3 * sizeof(uint32_t) + after;
+	uniform = uniform && size_t(end - face.data) / row >= face.count;
+	for (size_t f = 0; uniform && f < face.count; f++)
+		uniform = ply_read_binary(list.count_type, face.data + f * row + before, false) == 3;
+	if (uniform) {
+		out.indices = face.data + before + ply_type_size(list.count_type);
+		out.triangle_count = face.count;
+		out.triangle_stride = row;
+		in_place = out.positions != (const char *)positions.data();
+		return true;
+	}
+
+	// polygons or other index types, fan them into triangles one row at a time
+	indices.clear();
+	indices.reserve(3 * face.count);
+	const char *p = face.data;
+	for (size_t f = 0; f < face.count; f++) {
+		const char *q = p + before;
+		if (q + ply_type_size(list.count_type) > end)
+			return false;
+		size_t n = size_t(ply_read_binary(list.count_type, q, swap));
+		q += ply_type_size(list.count_type);
+		int size = ply_type_size(list.type);
+		if (q + n * size > end)
+			return false;
+		for (size_t k = 2; k < n; k++) {
+			indices.push_back(uint32_t(ply_read_binary(list.type, q, swap)));
+			indices.push_back(uint32_t(ply_read_binary(list.type, q + (k - 1) * size, swap)));
+			indices.push_back(uint32_t(ply_read_binary(list.type, q + k * size, swap)));
+		}
+		p = skip_row(face, p);
+	}
+	out.indices = (const char *)indices.data();
+	out.triangle_count = indices.size() / 3;
+	out.triangle_stride = 3 * sizeof(uint32_t);
+	return true;
+}
+
+// Each thread takes a run of whole lines. Line counts per run give every run
+// its first row number, and from that which element each line belongs to;
+// vertices land in place, triangles are gathered per run and joined in order.
+bool ply_file::read_ascii(mesh_source& out) {
+	const char *end = file.data() + file.size();
+	size_t bytes = size_t(end - body);
+	size_t threads = thread_count(bytes, 1 << 16);
+	std::vector<const char *> starts(threads + 1, end);
+	starts[0] = body;
+	for (size_t t = 1; t < threads; t++) {
+		const char *s = body + bytes * t / threads;
+		s = s > starts[t - 1] ? s : starts[t - 1];
+		const char *eol = (const char *)memchr(s, '\n', size_t(end - s));
+		starts[t] = eol ? eol + 1 : end;
+	}
+	std::vector<size_t> first_line(threads + 1, 0);
+	run_threads(threads, [&](size_t t) {
+		size_t n = 0;
+		for (const char *p = starts[t]; (p = (const char *)memchr(p, '\n', size_t(starts[t + 1] - p))) != nullptr; p++)
+			n++;
+		first_line[t + 1] = n;
+	});
+	for (size_t t = 0; t < threads; t++)
+		first_line[t + 1] += first_line[t];
+
+	// which element holds each row, and the columns the mesh needs
+	int vertex = -1, face = -1;
+	std::vector<size_t> element_line(elements.size() + 1, 0);
+	for (size_t i = 0; i < elements.size(); i++) {
+		element_line[i + 1] = element_line[i] + elements[i].count;
+		vertex = elements[i].name == "vertex" ? int(i) : vertex;
+		face = elements[i].name == "face" ? int(i) : face;
+	}
+	if (vertex < 0 || face < 0)
+		return false;
+	int column[3] = { elements[vertex].find("x"), elements[vertex].find("y"), elements[vertex].find("z") };
+	int pi = elements[face].find("vertex_indices");
+	pi = pi < 0 ? elements[face].find("vertex_index") : pi;
+	if (column[0] < 0 || column[1] < 0 || column[2] < 0 || pi < 0)
+		return false;
+	// the columns are only where the header says with no lists in front of them
+	for (int k = 0; k < int(elements[vertex].properties.size()); k++)
+		if (elements[vertex].properties[k].count_type != PLY_NONE)
+			return false;
+	for (int k = 0; k < pi; k++)
+		if (elements[face].properties[k].count_type != PLY_NONE)
+			return false;
+	// trailing whitespace may leave the last line without a newline
+	if (first_line[threads] + (end > body && end[-1] != '\n') < element_line[face + 1])
+		return false;
+
+	positions.resize(3 * elements[vertex].count);
+	std::vector<std::vector<uint32_t> > runs(threads);
+	std::vector<char> failed(threads, 0);
+	run_threads(threads, [&](size_t t) {
+		size_t line = first_line[t];
+		std::vector<uint32_t>& tris = runs[t];
+		double values[64];
+		for (const char *p = starts[t]; p < starts[t + 1] && line < element_line[face + 1]; line++) {
+			const char *eol = (const char *)memchr(p, '\n', size_t(end - p));
+			eol = eol ? eol : end;
+			bool is_vertex = line >= element_line[vertex] && line < element_line[vertex + 1];
+			bool is_face = line >= element_line[face];
+			int n = 0;
+			while ((is_vertex || is_face) && n < 64) {
+				while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+					p++;
+				if (p >= eol)
+					break;
+				const char *next = ply_parse_number(p, eol, values[n]);
+				if (next == p)
+					break;
+				n++;
+				p = next;
+			}
+			if (is_vertex) {
+				size_t v = line - element_line[vertex];
+				for (int k = 0; k < 3; k++)
+					positions[3 * v + k] = column[k] < n ? float(values[column[k]]) : 0.0f;
+			}
+			else if (is_face) {
+				int count = pi < n ? int(values[pi]) : 0;
+				if (count > n - pi - 1) {
+					failed[t] = 1;
+					count = 0;
+				}
+				for (int k = 2; k < count; k++) {
+					tris.push_back(uint32_t(values[pi + 1]));
+					tris.push_back(uint32_t(values[pi + k]));
+					tris.push_back(uint32_t(values[pi + k + 1]));
+				}
+			}
+			p = eol + 1;
+		}
+	});
+	size_t total = 0;
+	for (size_t t = 0; t < threads; t++) {
+		if (failed[t])
+			return false;
+		total += runs[t].size();
+	}
+	indices.resize(total);
+	for (size_t t = 0, at = 0; t < threads; at += runs[t].size(), t++)
+		memcpy(indices.data() + at, runs[t].data(), runs[t].size() * sizeof(uint32_t));
+	out.positions = (const char *)positions.data();
+	out.vertex_count = elements[vertex].count;
+	out.vertex_stride = 3 * sizeof(float);
+	out.indices = (const char *)indices.data();
+	out.triangle_count = total / 3;
+	out.triangle_stride = 3 * sizeof(uint32_t);
+	return true;
+}
+
+#endif // !PLYFILEH
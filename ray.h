@@ -6,15 +6,19 @@ class ray
 {
 public:
 	ray() {}
-	ray(const vec3& a, const vec3&b, float ti = 0.0) : A(a), B(b), _time(ti) {} // { A = a; B = b; _time = ti; }
+	ray(const vec3& a, const vec3&b, float ti = 0.0, float w = 0.0f, float s = 0.0f) : A(a), B(b), _time(ti), width(w), spread(s) {} // { A = a; B = b; _time = ti; }
 	vec3 origin() const			{ return A; }
 	vec3 direction() const		{ return B; }
 	float time() const { return _time; }
 	vec3 point_at_parameter(float t) const { return A + t*B; }
+	// world space width of the ray's cone at t, used to pick texture mip levels
+	float footprint(float t) const { return width + t*spread; }
 
 	vec3 A;
 	vec3 B;
 	float _time;
+	float width;	// cone width at the origin
+	float spread;	// and how much it grows per unit t
 };
 
 #endif
\ No newline at end of file
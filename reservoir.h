@@ -0,0 +1,161 @@
+#ifndef RESERVOIRH
+#define RESERVOIRH
+
+#include "light.h"
+#include "memory_stats.h"
+
+// Resampled direct lighting (RIS, as in ReSTIR). Many cheap light samples are
+// streamed through a reservoir that keeps one of them with probability in
+// proportion to target()/pdf, the light it would bring without the shadow
+// test, and only the one kept gets a shadow ray. Samples are compared in area
+// measure so a reservoir made at one point can be reused at another.
+
+// One light sample kept out of a stream. W is what its contribution gets
+// multiplied by in place of 1/pdf once finish() has been called.
+struct reservoir {
+	reservoir() : w_sum(0), M(0), p_hat(0), W(0) {}
+	// offers s with resampling weight w, p is its target() at the point
+	void update(const light_sample& s, float w, float p) {
+		w_sum += w;
+		M += 1;
+		if (w > 0.0f && get_rand() * w_sum < w) {
+			y = s;
+			p_hat = p;
+		}
+	}
+	void finish() { W = p_hat > 0.0f ? w_sum / (M * p_hat) : 0.0f; }
+
+	light_sample y;
+	float w_sum;
+	float M;		// candidates seen, including those behind merged reservoirs
+	float p_hat;	// target() of y where the reservoir was made
+	float W;
+};
+
+// Light y would bring to rec without the shadow test, per unit light area.
+inline vec3 unshadowed(const material_pool& mats, const ray& r_in, const hit_record& rec, const light_sample& y) {
+	vec3 wi = y.p - rec.p;
+	float dist2 = wi.squared_length();
+	if (dist2 <= 0.0f)
+		return vec3(0, 0, 0);
+	vec3 dir = wi / sqrt(dist2);
+	return mats.eval(rec.mat, r_in, rec, dir) * y.emitted * (fabs(dot(y.normal, dir)) / dist2);
+}
+
+inline float target(const material_pool& mats, const ray& r_in, const hit_record& rec, const light_sample& y) {
+	return luminance(unshadowed(mats, r_in, rec, y));
+}
+
+// Fills res with count candidates from the light list.
+void resample_lights(const material_pool& mats, const light_list& lights, const ray& r_in, const hit_record& rec, int count, reservoir& res) {
+	vec3 n = selection_normal(rec);
+	for (int k = 0; k < count; k++) {
+		// candidates are many and only one is kept, plain random numbers do
+		light_sample s;
+		float pick = get_rand();
+		if (!lights.sample(rec.p, n, mats, pick, random_sample2(), s)) {
+			res.M += 1;
+			continue;
+		}
+		float p = target(mats, r_in, rec, s);
+		// s.pdf is per solid angle, the target per area: the geometry term cancels
+		vec3 wi = s.p - rec.p;
+		float area_pdf = s.pdf * fabs(dot(s.normal, unit_vector(wi))) / wi.squared_length();
+		res.update(s, area_pdf > 0.0f ? p / area_pdf : 0.0f, p);
+	}
+	res.finish();
+}
+
+// Light reaching rec from the reservoir's sample, one shadow ray.
+vec3 shade_reservoir(const hitable *world, const material_pool& mats, const ray& r_in, const hit_record& rec, const reservoir& res) {
+	if (res.W <= 0.0f)
+		return vec3(0, 0, 0);
+	vec3 f = unshadowed(mats, r_in, rec, res.y);
+	if (f.x() <= 0.0f && f.y() <= 0.0f && f.z() <= 0.0f)
+		return vec3(0, 0, 0);
+	float through = visibility(world, rec.p, res.y.p, r_in.time());
+	if (through <= 0.0f)
+		return vec3(0, 0, 0);
+	return f * (res.W * through);
+}
+
+// The first hit of every pixel in one pass over the image with its
+// reservoir, so reservoirs can be shared between neighbouring pixels before
+// anything is shaded (spatial reuse). Neighbours are only used when their
+// surface looks like the pixel's own.
+class reservoir_buffer {
+public:
+	struct pixel {
+		ray r;
+		hit_record rec;
+		bool hit;
+		reservoir res;
+	};
+	reservoir_buffer() : nx(0), ny(0) {}
+	void resize(int width, int height) {
+		nx = width;
+		ny = height;
+		pixels.resize(size_t(nx) * ny);
+		reused.resize(size_t(nx) * ny);
+	}
+	pixel& at(int i, int j) { return pixels[size_t(j) * nx + i]; }
+	// after reuse(), the reservoir to shade pixel (i, j) with
+	const reservoir& result(int i, int j) const { return reused[size_t(j) * nx + i]; }
+	// merges each pixel's reservoir with up to count neighbours within radius pixels
+	void reuse(const material_pool& mats, int count, float radius);
+
+private:
+	bool similar(const pixel& a, const pixel& b) const {
+		return b.hit && dot(a.rec.normal, b.rec.normal) > 0.9f && fabs(a.rec.t - b.rec.t) < 0.1f * a.rec.t;
+	}
+	int nx, ny;
+	tracked_vector<pixel, MEM_FRAMEBUFFER> pixels;
+	tracked_vector<reservoir, MEM_FRAMEBUFFER> reused;
+};
+
+void reservoir_buffer::reuse(const material_pool& mats, int count, float radius) {
+	const int MAX_REUSE = 8;
+	count = count < MAX_REUSE ? count : MAX_REUSE;
+	for (int j = 0; j < ny; j++) {
+		for (int i = 0; i < nx; i++) {
+			const pixel& p = pixels[size_t(j) * nx + i];
+			reservoir& out = reused[size_t(j) * nx + i];
+			out = p.res;
+			if (!p.hit || p.res.M <= 0.0f)
+				continue;
+			// neighbours that made a reservoir on a similar surface, whatever it holds
+			const pixel *from[MAX_REUSE + 1] = { &p };
+			int used = 1;
+			for (int k = 0; k < count; k++) {
+				int qi = i + int((2 * get_rand() - 1) * radius);
+				int qj = j + int((2 * get_rand() - 1) * radius);
+				if (qi < 0 || qi >= nx || qj < 0 || qj >= ny || (qi == i && qj == j))
+					continue;
+				const pixel& q = pixels[size_t(qj) * nx + qi];
+				if (similar(p, q) && q.res.M > 0.0f)
+					from[used++] = &q;
+			}
+			// each sample is weighed by how likely its own reservoir was to
+			// produce it against all of them (balance heuristic); a plain 1/M
+			// lets a neighbour's unlikely pick of a light close to here blow up
+			reservoir merged;
+			float total = 0.0f;
+			for (int k = 0; k < used; k++) {
+				const reservoir& r = from[k]->res;
+				total += r.M;
+				if (r.W <= 0.0f)
+					continue;
+				float sum = 0.0f;
+				for (int l = 0; l < used; l++)
+					sum += from[l]->res.M * (l == k ? r.p_hat : target(mats, from[l]->r, from[l]->rec, r.y));
+				float p_hat = k == 0 ? r.p_hat : target(mats, p.r, p.rec, r.y);
+				merged.update(r.y, sum > 0.0f ? r.M * r.p_hat / sum * p_hat * r.W : 0.0f, p_hat);
+			}
+			merged.M = total;
+			merged.W = merged.p_hat > 0.0f ? merged.w_sum / merged.p_hat : 0.0f;
+			out = merged;
+		}
+	}
+}
+
+#endif // !RESERVOIRH
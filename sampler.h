@@ -0,0 +1,132 @@
+#ifndef SAMPLERH
+#define SAMPLERH
+
+#include <stdint.h>
+#include "sampling.h"
+
+float get_rand();
+
+// Where the numbers behind a pixel's samples come from.
+enum sampler_type {
+	SAMPLER_RANDOM,	// independent get_rand() calls, white noise
+	SAMPLER_SOBOL	// Owen-scrambled Sobol points
+};
+
+inline uint32_t hash_u32(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+	return hash_u32(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// Owen scrambling works on digits from the most significant down, flipping
+// each depending on the seed and the digits before it. On bit-reversed values
+// that is a hash whose carries only run upwards: Burley's "Practical
+// Hash-based Owen Scrambling", with Vegdahl's better-mixing constants. Values
+// are kept bit-reversed between steps to save reversing them back and forth.
+inline uint32_t owen_permute_reversed(uint32_t x, uint32_t seed) {
+	x ^= x * 0x3d20adeau;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56u;
+	x ^= x * 0x53a22864u;
+	return x;
+}
+
+// The first two Sobol dimensions form a (0,2)-sequence: any aligned run of a
+// power of two points fills the unit square's elementary boxes once each.
+// The first is the bit-reversed index, the second comes from the Pascal
+// matrix over GF(2). sobol_1_reversed() takes and gives bit-reversed values,
+// a byte of the index at a time.
+struct sobol_1_tables {
+	sobol_1_tables() {
+		uint32_t v[32];
+		v[0] = 0x80000000u;
+		for (int k = 1; k < 32; k++)
+			v[k] = v[k - 1] ^ (v[k - 1] >> 1);
+		for (int m = 0; m < 4; m++)
+			for (int b = 0; b < 256; b++) {
+				uint32_t x = 0;
+				for (int j = 0; j < 8; j++)
+					if (b & (1 << j))
+						x ^= reverse_bits(v[31 - (8 * m + j)]);
+				t[m][b] = x;
+			}
+	}
+	uint32_t t[4][256];
+};
+
+inline uint32_t sobol_1_reversed(uint32_t r) {
+	static const sobol_1_tables tables;
+	return tables.t[0][r & 255] ^ tables.t[1][(r >> 8) & 255] ^ tables.t[2][(r >> 16) & 255] ^ tables.t[3][r >> 24];
+}
+
+// to [0,1), keeping the 24 bits a float can hold so it never rounds up to 1
+inline float bits_to_float(uint32_t x) { return float(x >> 8) * (1.0f / 16777216.0f); }
+
+// Hands out the numbers for one camera sample at a time: start() picks the
+// pixel and the sample's index there, then every get_1d() / get_2d() takes
+// the next dimension. Callers ask in the same order for every sample (pixel
+// jitter, lens, time, then per bounce), so each dimension keeps to one use.
+// Each 2D request is its own Owen-scrambled 2D Sobol pattern, shuffled by a
+// scrambled sample index, with seeds from the pixel and the dimension
+// (Burley's padding), so dimensions and neighbouring pixels don't correlate.
+// Sample counts that are powers of two get the most out of it.
+class sampler {
+public:
+	sampler(sampler_type t = SAMPLER_SOBOL, uint32_t base_seed = 0) : type(t), base(base_seed), seed(0), index(0), dimension(0) {}
+	void start(int x, int y, int sample_index) {
+		seed = hash_combine(hash_combine(base, uint32_t(x)), uint32_t(y));
+		index = reverse_bits(uint32_t(sample_index));
+		dimension = 0;
+	}
+	float get_1d() {
+		if (type == SAMPLER_RANDOM)
+			return get_rand();
+		uint32_t s = hash_combine(seed, dimension++);
+		// sobol_0 of the shuffled index is the index itself, bit-reversed
+		uint32_t i = owen_permute_reversed(index, s);
+		return bits_to_float(reverse_bits(owen_permute_reversed(reverse_bits(i), hash_u32(s))));
+	}
+	sample2 get_2d() {
+		if (type == SAMPLER_RANDOM)
+			return random_sample2();
+		uint32_t s = hash_combine(seed, dimension++);
+		uint32_t i = owen_permute_reversed(index, s);
+		uint32_t sx = hash_u32(s), sy = hash_u32(sx);
+		uint32_t x = owen_permute_reversed(reverse_bits(i), sx);
+		uint32_t y = owen_permute_reversed(sobol_1_reversed(i), sy);
+		return sample2(bits_to_float(reverse_bits(x)), bits_to_float(reverse_bits(y)));
+	}
+	scatter_sample get_scatter() {
+		scatter_sample s;
+		s.dir = get_2d();
+		s.pick = get_1d();
+		return s;
+	}
+
+	sampler_type type;
+
+private:
+	uint32_t base;
+	uint32_t seed;
+	uint32_t index;		// bit-reversed
+	uint32_t dimension;
+};
+
+#endif // !SAMPLERH
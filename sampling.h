@@ -0,0 +1,132 @@
+#ifndef SAMPLINGH
+#define SAMPLINGH
+
+#include "vec3.h"
+#include "simd.h"
+
+const extern float _pi;
+float get_rand();
+
+// Mappings from points in the unit square onto the shapes rays and lights are
+// drawn from. None of them reject points, so every sample is used, a
+// stratified or low-discrepancy set of points stays well spread after
+// mapping, and a batch maps lane by lane without branches. Shapes around a
+// direction come out in local coordinates around z, see from_local().
+
+// a point in [0,1)^2
+struct sample2 {
+	sample2() {}
+	sample2(float a, float b) : x(a), y(b) {}
+	float x, y;
+};
+
+inline sample2 random_sample2() {
+	float a = get_rand();
+	return sample2(a, get_rand());
+}
+
+// The numbers one scatter() may use: dir for the direction and pick for a
+// choice (reflect or refract) or a third dimension (a radius).
+struct scatter_sample {
+	sample2 dir;
+	float pick;
+};
+
+inline scatter_sample random_scatter_sample() {
+	scatter_sample s;
+	s.dir = random_sample2();
+	s.pick = get_rand();
+	return s;
+}
+
+// any two unit vectors perpendicular to w and each other
+inline void make_basis(const vec3& w, vec3& u, vec3& v) {
+	vec3 a = fabs(w.x()) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	v = unit_vector(cross(w, a));
+	u = cross(w, v);
+}
+
+// l turned so its z axis lies along the unit vector w
+inline vec3 from_local(const vec3& l, const vec3& w) {
+	vec3 u, v;
+	make_basis(w, u, v);
+	return l.x() * u + l.y() * v + l.z() * w;
+}
+
+// sin and cos of x in [-pi/4, pi/4]; the Taylor series is good to float
+// precision there and, unlike sin() and cos(), works on floatx lanes too
+template <class F>
+inline void sincos_quarter(F x, F& s, F& c) {
+	F x2 = x * x;
+	s = x * (1.0f + x2 * (-1.0f / 6 + x2 * (1.0f / 120 + x2 * (-1.0f / 5040 + x2 * (1.0f / 362880)))));
+	c = 1.0f + x2 * (-0.5f + x2 * (1.0f / 24 + x2 * (-1.0f / 720 + x2 * (1.0f / 40320))));
+}
+
+// Concentric map (Shirley and Chiu): squares around the centre go to circles,
+// so areas and neighbourhoods are kept. z is 0.
+inline vec3 sample_disk(const sample2& u) {
+	float a = 2 * u.x - 1, b = 2 * u.y - 1;
+	bool wide = fabs(a) > fabs(b);
+	float r = wide ? a : b;
+	float ratio = r != 0.0f ? (wide ? b : a) / r : 0.0f;
+	float s, c;
+	sincos_quarter(0.25f * _pi * ratio, s, c);
+	return wide ? vec3(r * c, r * s, 0) : vec3(r * s, r * c, 0);
+}
+
+template <int N>
+inline vec3x<N> sample_disk(floatx<N> ux, floatx<N> uy) {
+	floatx<N> a = 2.0f * ux - 1.0f, b = 2.0f * uy - 1.0f;
+	maskx<N> wide = max(a, -a) > max(b, -b);
+	floatx<N> r = select(wide, a, b);
+	// r is only 0 at the centre, where the other coordinate is too
+	floatx<N> ratio = select(wide, b, a) / select(max(r, -r) > 0.0f, r, floatx<N>(1.0f));
+	floatx<N> s, c;
+	sincos_quarter(0.25f * _pi * ratio, s, c);
+	return vec3x<N>(r * select(wide, c, s), r * select(wide, s, c), floatx<N>(0.0f));
+}
+
+// uniform over the unit sphere's surface
+inline vec3 sample_sphere(const sample2& u) {
+	float z = 1 - 2 * u.x;
+	float r = sqrt(fmaxf(0.0f, 1 - z * z));
+	float phi = 2 * _pi * u.y;
+	return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// uniform inside the unit ball, t picks the radius
+inline vec3 sample_ball(const sample2& u, float t) {
+	return cbrt(t) * sample_sphere(u);
+}
+
+// uniform over the directions within acos(cos_max) of z
+inline vec3 sample_cone(const sample2& u, float cos_max) {
+	float z = 1 - u.x * (1 - cos_max);
+	float r = sqrt(fmaxf(0.0f, 1 - z * z));
+	float phi = 2 * _pi * u.y;
+	return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// uniform over the half of the unit sphere with z >= 0
+inline vec3 sample_hemisphere(const sample2& u) {
+	return sample_cone(u, 0.0f);
+}
+
+// Density cos(theta) / pi over z >= 0: a point on the unit disk lifted onto
+// the hemisphere above it (Malley's method). Points on the rim (u.x or u.y
+// exactly 0) would give z = 0, a ray along the surface that finds the plane
+// it left at t = 0/0, so z is kept just above that.
+const float MIN_COSINE = 1e-4f;
+
+inline vec3 sample_cosine_hemisphere(const sample2& u) {
+	vec3 d = sample_disk(u);
+	return vec3(d.x(), d.y(), fmaxf(MIN_COSINE, sqrt(fmaxf(0.0f, 1 - d.x() * d.x() - d.y() * d.y()))));
+}
+
+template <int N>
+inline vec3x<N> sample_cosine_hemisphere(floatx<N> ux, floatx<N> uy) {
+	vec3x<N> d = sample_disk<N>(ux, uy);
+	return vec3x<N>(d.x, d.y, max(floatx<N>(MIN_COSINE), sqrt(max(floatx<N>(0.0f), 1.0f - d.x * d.x - d.y * d.y))));
+}
+
+#endif // !SAMPLINGH
@@ -0,0 +1,46 @@
+#ifndef SCENEH
+#define SCENEH
+
+#include "hitable.h"
+#include "arena.h"
+#include "material.h"
+#include "compiled_scene.h"
+#include "texture_cache.h"
+#include "light.h"
+
+// Owns everything one render needs. Geometry and acceleration data come out
+// of the arena; materials and textures live in the pool, and image texels are
+// streamed in through the texture cache, which holds at most texture_budget.
+// The emissive primitives are gathered into lights when the scene is
+// compiled. Destroying the scene frees all of it. clear() does the same but keeps the
+// arena blocks and pool arrays so the next scene built into it reuses them.
+class scene {
+public:
+	scene(size_t block = 1 << 20, bool huge = true, size_t texture_budget = size_t(256) << 20) : mem(block, huge), tiles(texture_budget), world(nullptr) {
+		mats.textures.cache = &tiles;
+	}
+	// swaps the authored tree for the compiled one, both stay in the arena
+	void compile() {
+		world = compile_scene(world, &mem);
+		lights.build(*static_cast<compiled_scene *>(world), mats);
+	}
+	void clear() {
+		world = nullptr;
+		lights.clear();
+		mem.reset();
+		mats.clear();
+		tiles.clear();
+	}
+
+	arena mem;
+	material_pool mats;
+	texture_cache tiles;
+	hitable *world;
+	light_list lights;
+
+private:
+	scene(const scene&) = delete;
+	scene& operator=(const scene&) = delete;
+};
+
+#endif // !SCENEH
@@ -0,0 +1,305 @@
+#ifndef SIMDH
+#define SIMDH
+
+#include "ray.h"
+#if defined(__AVX__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+float get_rand();
+
+// N-wide floats, masks and vec3s in structure-of-arrays form for kernels that
+// work on several rays at once. A kernel is written once as a template over N
+// and instantiated for whatever widths the build has: 1 (plain floats),
+// 4 (SSE/NEON), 8 (AVX) and 16 (AVX-512). simd_traits<N> is the only part
+// that knows about intrinsics.
+template <int N> struct simd_traits;
+
+template <> struct simd_traits<1> {
+	typedef float type;
+	typedef bool mask;
+	static type set1(float f) { return f; }
+	static type load(const float *p) { return *p; }
+	static void store(float *p, type a) { *p = a; }
+	static type gather(const float *p, const int *i) { return p[i[0]]; }
+	static type add(type a, type b) { return a + b; }
+	static type sub(type a, type b) { return a - b; }
+	static type mul(type a, type b) { return a * b; }
+	static type div(type a, type b) { return a / b; }
+	static type min(type a, type b) { return a < b ? a : b; }
+	static type max(type a, type b) { return a > b ? a : b; }
+	static type sqrt(type a) { return ::sqrtf(a); }
+	static mask lt(type a, type b) { return a < b; }
+	static mask le(type a, type b) { return a <= b; }
+	static mask gt(type a, type b) { return a > b; }
+	static mask ge(type a, type b) { return a >= b; }
+	static mask mask_set1(bool b) { return b; }
+	static mask mask_and(mask a, mask b) { return a && b; }
+	static mask mask_or(mask a, mask b) { return a || b; }
+	static mask mask_not(mask a) { return !a; }
+	static bool any(mask a) { return a; }
+	static bool all(mask a) { return a; }
+	static type select(mask m, type a, type b) { return m ? a : b; }
+};
+
+#if defined(VEC3_SSE)
+#define SIMD_HAVE_4
+template <> struct simd_traits<4> {
+	typedef __m128 type;
+	typedef __m128 mask;
+	static type set1(float f) { return _mm_set1_ps(f); }
+	static type load(const float *p) { return _mm_loadu_ps(p); }
+	static void store(float *p, type a) { _mm_storeu_ps(p, a); }
+	static type gather(const float *p, const int *i) { return _mm_set_ps(p[i[3]], p[i[2]], p[i[1]], p[i[0]]); }
+	static type add(type a, type b) { return _mm_add_ps(a, b); }
+	static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+	static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+	static type div(type a, type b) { return _mm_div_ps(a, b); }
+	static type min(type a, type b) { return _mm_min_ps(a, b); }
+	static type max(type a, type b) { return _mm_max_ps(a, b); }
+	static type sqrt(type a) { return _mm_sqrt_ps(a); }
+	static mask lt(type a, type b) { return _mm_cmplt_ps(a, b); }
+	static mask le(type a, type b) { return _mm_cmple_ps(a, b); }
+	static mask gt(type a, type b) { return _mm_cmpgt_ps(a, b); }
+	static mask ge(type a, type b) { return _mm_cmpge_ps(a, b); }
+	static mask mask_set1(bool b) { return _mm_castsi128_ps(_mm_set1_epi32(b ? -1 : 0)); }
+	static mask mask_and(mask a, mask b) { return _mm_and_ps(a, b); }
+	static mask mask_or(mask a, mask b) { return _mm_or_ps(a, b); }
+	static mask mask_not(mask a) { return _mm_xor_ps(a, mask_set1(true)); }
+	static bool any(mask a) { return _mm_movemask_ps(a) != 0; }
+	static bool all(mask a) { return _mm_movemask_ps(a) == 0xf; }
+	// no blendv before SSE4.1
+	static type select(mask m, type a, type b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+};
+#elif defined(VEC3_NEON)
+#define SIMD_HAVE_4
+template <> struct simd_traits<4> {
+	typedef float32x4_t type;
+	typedef uint32x4_t mask;
+	static type set1(float f) { return vdupq_n_f32(f); }
+	static type load(const float *p) { return vld1q_f32(p); }
+	static void store(float *p, type a) { vst1q_f32(p, a); }
+	static type gather(const float *p, const int *i) {
+		type r = vdupq_n_f32(p[i[0]]);
+		r = vsetq_lane_f32(p[i[1]], r, 1);
+		r = vsetq_lane_f32(p[i[2]], r, 2);
+		return vsetq_lane_f32(p[i[3]], r, 3);
+	}
+	static type add(type a, type b) { return vaddq_f32(a, b); }
+	static type sub(type a, type b) { return vsubq_f32(a, b); }
+	static type mul(type a, type b) { return vmulq_f32(a, b); }
+	static type div(type a, type b) { return vdivq_f32(a, b); }
+	static type min(type a, type b) { return vbslq_f32(vcltq_f32(a, b), a, b); }
+	static type max(type a, type b) { return vbslq_f32(vcgtq_f32(a, b), a, b); }
+	static type sqrt(type a) { return vsqrtq_f32(a); }
+	static mask lt(type a, type b) { return vcltq_f32(a, b); }
+	static mask le(type a, type b) { return vcleq_f32(a, b); }
+	static mask gt(type a, type b) { return vcgtq_f32(a, b); }
+	static mask ge(type a, type b) { return vcgeq_f32(a, b); }
+	static mask mask_set1(bool b) { return vdupq_n_u32(b ? 0xffffffffu : 0u); }
+	static mask mask_and(mask a, mask b) { return vandq_u32(a, b); }
+	static mask mask_or(mask a, mask b) { return vorrq_u32(a, b); }
+	static mask mask_not(mask a) { return vmvnq_u32(a); }
+	static bool any(mask a) { return vmaxvq_u32(a) != 0; }
+	static bool all(mask a) { return vminvq_u32(a) != 0; }
+	static type select(mask m, type a, type b) { return vbslq_f32(m, a, b); }
+};
+#endif
+
+#if defined(__AVX__)
+#define SIMD_HAVE_8
+template <> struct simd_traits<8> {
+	typedef __m256 type;
+	typedef __m256 mask;
+	static type set1(float f) { return _mm256_set1_ps(f); }
+	static type load(const float *p) { return _mm256_loadu_ps(p); }
+	static void store(float *p, type a) { _mm256_storeu_ps(p, a); }
+	static type gather(const float *p, const int *i) { return _mm256_set_ps(p[i[7]], p[i[6]], p[i[5]], p[i[4]], p[i[3]], p[i[2]], p[i[1]], p[i[0]]); }
+	static type add(type a, type b) { return _mm256_add_ps(a, b); }
+	static type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+	static type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+	static type div(type a, type b) { return _mm256_div_ps(a, b); }
+	static type min(type a, type b) { return _mm256_min_ps(a, b); }
+	static type max(type a, type b) { return _mm256_max_ps(a, b); }
+	static type sqrt(type a) { return _mm256_sqrt_ps(a); }
+	static mask lt(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static mask le(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static mask gt(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	static mask ge(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	static mask mask_set1(bool b) { return _mm256_castsi256_ps(_mm256_set1_epi32(b ? -1 : 0)); }
+	static mask mask_and(mask a, mask b) { return _mm256_and_ps(a, b); }
+	static mask mask_or(mask a, mask b) { return _mm256_or_ps(a, b); }
+	static mask mask_not(mask a) { return _mm256_xor_ps(a, mask_set1(true)); }
+	static bool any(mask a) { return _mm256_movemask_ps(a) != 0; }
+	static bool all(mask a) { return _mm256_movemask_ps(a) == 0xff; }
+	static type select(mask m, type a, type b) { return _mm256_blendv_ps(b, a, m); }
+};
+#endif
+
+#if defined(__AVX512F__)
+#define SIMD_HAVE_16
+template <> struct simd_traits<16> {
+	typedef __m512 type;
+	typedef __mmask16 mask;
+	static type set1(float f) { return _mm512_set1_ps(f); }
+	static type load(const float *p) { return _mm512_loadu_ps(p); }
+	static void store(float *p, type a) { _mm512_storeu_ps(p, a); }
+	static type gather(const float *p, const int *i) { return _mm512_i32gather_ps(_mm512_loadu_si512(i), p, 4); }
+	static type add(type a, type b) { return _mm512_add_ps(a, b); }
+	static type sub(type a, type b) { return _mm512_sub_ps(a, b); }
+	static type mul(type a, type b) { return _mm512_mul_ps(a, b); }
+	static type div(type a, type b) { return _mm512_div_ps(a, b); }
+	static type min(type a, type b) { return _mm512_min_ps(a, b); }
+	static type max(type a, type b) { return _mm512_max_ps(a, b); }
+	static type sqrt(type a) { return _mm512_sqrt_ps(a); }
+	static mask lt(type a, type b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+	static mask le(type a, type b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+	static mask gt(type a, type b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+	static mask ge(type a, type b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+	static mask mask_set1(bool b) { return b ? 0xffff : 0; }
+	static mask mask_and(mask a, mask b) { return a & b; }
+	static mask mask_or(mask a, mask b) { return a | b; }
+	static mask mask_not(mask a) { return mask(~a); }
+	static bool any(mask a) { return a != 0; }
+	static bool all(mask a) { return a == 0xffff; }
+	static type select(mask m, type a, type b) { return _mm512_mask_blend_ps(m, b, a); }
+};
+#endif
+
+// widest width the build supports
+#if defined(SIMD_HAVE_16)
+const int SIMD_WIDTH = 16;
+#elif defined(SIMD_HAVE_8)
+const int SIMD_WIDTH = 8;
+#elif defined(SIMD_HAVE_4)
+const int SIMD_WIDTH = 4;
+#else
+const int SIMD_WIDTH = 1;
+#endif
+
+template <int N>
+struct maskx {
+	typedef typename simd_traits<N>::mask native;
+	maskx() {}
+	maskx(bool b) : m(simd_traits<N>::mask_set1(b)) {}
+	static maskx make(native n) { maskx r; r.m = n; return r; }
+	native m;
+};
+
+template <int N>
+struct floatx {
+	typedef typename simd_traits<N>::type native;
+	floatx() {}
+	floatx(float f) : v(simd_traits<N>::set1(f)) {}
+	static floatx make(native n) { floatx r; r.v = n; return r; }
+	static floatx load(const float *p) { return make(simd_traits<N>::load(p)); }
+	// p[i[0]], p[i[1]], ... in the lanes
+	static floatx gather(const float *p, const int *i) { return make(simd_traits<N>::gather(p, i)); }
+	void store(float *p) const { simd_traits<N>::store(p, v); }
+	float operator[](int i) const {
+		float f[N];
+		store(f);
+		return f[i];
+	}
+	void set(int i, float x) {
+		float f[N];
+		store(f);
+		f[i] = x;
+		v = simd_traits<N>::load(f);
+	}
+	native v;
+};
+
+// keeps an argument out of template deduction so plain floats convert
+template <class T> struct simd_nodeduce { typedef T type; };
+
+#define SIMD_FLOAT_OP(op, fn) \
+	template <int N> inline floatx<N> operator op(floatx<N> a, floatx<N> b) { return floatx<N>::make(simd_traits<N>::fn(a.v, b.v)); } \
+	template <int N> inline floatx<N> operator op(floatx<N> a, float b) { return a op floatx<N>(b); } \
+	template <int N> inline floatx<N> operator op(float a, floatx<N> b) { return floatx<N>(a) op b; }
+SIMD_FLOAT_OP(+, add)
+SIMD_FLOAT_OP(-, sub)
+SIMD_FLOAT_OP(*, mul)
+SIMD_FLOAT_OP(/, div)
+#undef SIMD_FLOAT_OP
+
+#define SIMD_COMPARE_OP(op, fn) \
+	template <int N> inline maskx<N> operator op(floatx<N> a, floatx<N> b) { return maskx<N>::make(simd_traits<N>::fn(a.v, b.v)); } \
+	template <int N> inline maskx<N> operator op(floatx<N> a, float b) { return a op floatx<N>(b); } \
+	template <int N> inline maskx<N> operator op(float a, floatx<N> b) { return floatx<N>(a) op b; }
+SIMD_COMPARE_OP(<, lt)
+SIMD_COMPARE_OP(<=, le)
+SIMD_COMPARE_OP(>, gt)
+SIMD_COMPARE_OP(>=, ge)
+#undef SIMD_COMPARE_OP
+
+template <int N> inline floatx<N> operator-(floatx<N> a) { return floatx<N>(0.0f) - a; }
+template <int N> inline floatx<N>& operator+=(floatx<N>& a, floatx<N> b) { return a = a + b; }
+template <int N> inline floatx<N>& operator*=(floatx<N>& a, floatx<N> b) { return a = a * b; }
+template <int N> inline floatx<N> sqrt(floatx<N> a) { return floatx<N>::make(simd_traits<N>::sqrt(a.v)); }
+template <int N> inline floatx<N> min(floatx<N> a, floatx<N> b) { return floatx<N>::make(simd_traits<N>::min(a.v, b.v)); }
+template <int N> inline floatx<N> max(floatx<N> a, floatx<N> b) { return floatx<N>::make(simd_traits<N>::max(a.v, b.v)); }
+
+template <int N> inline maskx<N> operator&(maskx<N> a, maskx<N> b) { return maskx<N>::make(simd_traits<N>::mask_and(a.m, b.m)); }
+template <int N> inline maskx<N> operator|(maskx<N> a, maskx<N> b) { return maskx<N>::make(simd_traits<N>::mask_or(a.m, b.m)); }
+template <int N> inline maskx<N> operator~(maskx<N> a) { return maskx<N>::make(simd_traits<N>::mask_not(a.m)); }
+template <int N> inline bool any(maskx<N> a) { return simd_traits<N>::any(a.m); }
+template <int N> inline bool all(maskx<N> a) { return simd_traits<N>::all(a.m); }
+
+// a where m is set, b elsewhere
+template <int N> inline floatx<N> select(maskx<N> m, floatx<N> a, floatx<N> b) { return floatx<N>::make(simd_traits<N>::select(m.m, a.v, b.v)); }
+
+template <int N>
+inline floatx<N> random_floatx() {
+	float f[N];
+	for (int i = 0; i < N; i++)
+		f[i] = get_rand();
+	return floatx<N>::load(f);
+}
+
+template <int N>
+struct vec3x {
+	vec3x() {}
+	vec3x(floatx<N> x_, floatx<N> y_, floatx<N> z_) : x(x_), y(y_), z(z_) {}
+	vec3x(const vec3& v) : x(v.x()), y(v.y()), z(v.z()) {}
+	vec3 get(int i) const { return vec3(x[i], y[i], z[i]); }
+	void set(int i, const vec3& v) {
+		x.set(i, v.x());
+		y.set(i, v.y());
+		z.set(i, v.z());
+	}
+	floatx<N> x, y, z;
+};
+
+template <int N> inline vec3x<N> operator+(const vec3x<N>& a, const vec3x<N>& b) { return vec3x<N>(a.x + b.x, a.y + b.y, a.z + b.z); }
+template <int N> inline vec3x<N> operator-(const vec3x<N>& a, const vec3x<N>& b) { return vec3x<N>(a.x - b.x, a.y - b.y, a.z - b.z); }
+template <int N> inline vec3x<N> operator*(const vec3x<N>& a, const vec3x<N>& b) { return vec3x<N>(a.x * b.x, a.y * b.y, a.z * b.z); }
+template <int N> inline vec3x<N> operator-(const vec3x<N>& a) { return vec3x<N>(-a.x, -a.y, -a.z); }
+template <int N> inline vec3x<N> operator*(const vec3x<N>& a, typename simd_nodeduce<floatx<N> >::type t) { return vec3x<N>(a.x * t, a.y * t, a.z * t); }
+template <int N> inline vec3x<N> operator*(typename simd_nodeduce<floatx<N> >::type t, const vec3x<N>& a) { return vec3x<N>(a.x * t, a.y * t, a.z * t); }
+template <int N> inline vec3x<N> operator/(const vec3x<N>& a, typename simd_nodeduce<floatx<N> >::type t) { return a * (floatx<N>(1.0f) / t); }
+template <int N> inline vec3x<N>& operator+=(vec3x<N>& a, const vec3x<N>& b) { return a = a + b; }
+
+template <int N> inline floatx<N> dot(const vec3x<N>& a, const vec3x<N>& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+template <int N> inline vec3x<N> cross(const vec3x<N>& a, const vec3x<N>& b) {
+	return vec3x<N>(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+template <int N> inline floatx<N> length(const vec3x<N>& a) { return sqrt(dot(a, a)); }
+template <int N> inline vec3x<N> unit_vector(const vec3x<N>& a) { return a / length(a); }
+template <int N> inline vec3x<N> select(maskx<N> m, const vec3x<N>& a, const vec3x<N>& b) {
+	return vec3x<N>(select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z));
+}
+
+// N rays, one per lane
+template <int N>
+struct rayx {
+	rayx() {}
+	rayx(const vec3x<N>& a, const vec3x<N>& b, floatx<N> ti = 0.0f) : A(a), B(b), time(ti) {}
+	ray get(int i) const { return ray(A.get(i), B.get(i), time[i]); }
+	vec3x<N> point_at_parameter(floatx<N> t) const { return A + t * B; }
+	vec3x<N> A;
+	vec3x<N> B;
+	floatx<N> time;
+};
+
+#endif // !SIMDH
\ No newline at end of file
@@ -2,52 +2,96 @@
 #define SPHEREH
 
 #include "hitable.h"
+#include "simd.h"
 //#include "texture.h"
 
-class material;
 const extern float _pi;
 
 class sphere : public hitable {
 public:
 	sphere() {}
-	sphere(vec3 cen, float r, material *t) : center(cen), radius(r), mat(t) {};
+	sphere(vec3 cen, float r, material_id m) : center(cen), radius(r), mat(m) {};
 	virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+	// N rays at once: lanes that hit inside (t_min, t_max) come back set in the
+	// mask with t_max pulled in to the hit
+	template <int N>
+	maskx<N> hit(const rayx<N>& r, floatx<N> t_min, floatx<N>& t_max) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const;
 	bool bounding_box(float t0, float t1, aabb& box) const;
+	virtual bool interval(const ray& r, float& t_in, float& t_out) const;
 	vec3 center;
 	float radius;
-	material *mat;
+	material_id mat;
 };
 
 bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-	// rec.mat_ptr = mat; //update hit record material pointer to the proper material this sphere was given when it was created
 	vec3 oc = r.origin() - center;
 	float a = dot(r.direction(), r.direction());
 	float b = dot(oc, r.direction());
 	float c = dot(oc, oc) - radius*radius;
 	float discriminant = b*b - a*c;
 	if (discriminant > 0) {
-		float temp = (-b - sqrt(b*b - a*c)) / a;
+		float root = sqrt(discriminant);
+		float temp = (-b - root) / a;
+		if (!(temp < t_max && temp > t_min))
+			temp = (-b + root) / a;
 		if (temp < t_max && temp > t_min) {
-			rec.t = temp;
-			rec.p = r.point_at_parameter(rec.t);
-			get_sphere_uv((rec.p - center)/radius, rec.u, rec.v);
-			rec.normal = (rec.p - center) / radius;
-			rec.mat_ptr = mat;
-			return true;
-		}
-		temp = (-b + sqrt(b*b - a*c)) / a;
-		if (temp < t_max && temp > t_min) {
-			rec.t = temp;
-			rec.p = r.point_at_parameter(rec.t);
-			get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
-			rec.normal = (rec.p - center) / radius;
-			rec.mat_ptr = mat;
+			rec.set_hit(temp, this);
+			COUNT_HIT(sphere_candidates);
 			return true;
 		}
 	}
 	return false;
 }
 
+// both roots of the same quadratic
+inline bool sphere_interval(const ray& r, const vec3& center, float radius, float& t_in, float& t_out) {
+	vec3 oc = r.origin() - center;
+	float a = dot(r.direction(), r.direction());
+	float b = dot(oc, r.direction());
+	float c = dot(oc, oc) - radius*radius;
+	float discriminant = b*b - a*c;
+	if (discriminant <= 0)
+		return false;
+	float root = sqrt(discriminant);
+	t_in = (-b - root) / a;
+	t_out = (-b + root) / a;
+	return true;
+}
+
+bool sphere::interval(const ray& r, float& t_in, float& t_out) const {
+	return sphere_interval(r, center, radius, t_in, t_out);
+}
+
+template <int N>
+maskx<N> sphere::hit(const rayx<N>& r, floatx<N> t_min, floatx<N>& t_max) const {
+	vec3x<N> oc = r.A - vec3x<N>(center);
+	floatx<N> a = dot(r.B, r.B);
+	floatx<N> b = dot(oc, r.B);
+	floatx<N> c = dot(oc, oc) - radius*radius;
+	floatx<N> discriminant = b*b - a*c;
+	maskx<N> hit = discriminant > 0.0f;
+	if (!any(hit))
+		return hit;
+	floatx<N> root = sqrt(max(discriminant, floatx<N>(0.0f)));
+	floatx<N> temp = (-b - root) / a;
+	maskx<N> near_ok = (temp < t_max) & (temp > t_min);
+	temp = select(near_ok, temp, (-b + root) / a);
+	hit = hit & (temp < t_max) & (temp > t_min);
+	t_max = select(hit, temp, t_max);
+	return hit;
+}
+
+void sphere::surface_interaction(const ray& r, hit_record& rec) const {
+	COUNT_HIT(sphere_surfaces);
+	rec.p = r.point_at_parameter(rec.t);
+	rec.normal = (rec.p - center) / radius;
+	get_sphere_uv(rec.normal, rec.u, rec.v);
+	// v runs over half a great circle, u over a whole one
+	rec.uv_density = 1.0f / (_pi * fabs(radius));
+	rec.mat = mat;
+}
+
 bool sphere::bounding_box(float t0, float t1, aabb& box) const {
 	box = aabb(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
 	return true;
@@ -56,15 +100,19 @@ bool sphere::bounding_box(float t0, float t1, aabb& box) const {
 class moving_sphere : public hitable {
 public:
 	moving_sphere() {}
-	moving_sphere(vec3 cen0, vec3 cen1, float t0, float t1, float r, material *m) :
-		center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m) {};
+	moving_sphere(vec3 cen0, vec3 cen1, float t0, float t1, float r, material_id m) :
+		center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat(m) {};
 	virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const;
 	bool bounding_box(float t0, float t1, aabb & box) const;
+	virtual bool interval(const ray& r, float& t_in, float& t_out) const {
+		return sphere_interval(r, center(r.time()), radius, t_in, t_out);
+	}
 	vec3 center(float time) const;
 	vec3 center0, center1;
 	float time0, time1;
 	float radius;
-	material *mat_ptr;
+	material_id mat;
 };
 
 vec3 moving_sphere::center(float time) const {
@@ -78,26 +126,25 @@ bool moving_sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec)
 	float c = dot(oc, oc) - radius*radius;
 	float discriminant = b*b - a*c;
 	if (discriminant > 0) {
-		float temp = (-b - sqrt(b*b - a*c)) / a;
+		float root = sqrt(discriminant);
+		float temp = (-b - root) / a;
+		if (!(temp < t_max && temp > t_min))
+			temp = (-b + root) / a;
 		if (temp < t_max && temp > t_min) {
-			rec.t = temp;
-			rec.p = r.point_at_parameter(rec.t);
-			rec.normal = (rec.p - center(r.time())) / radius;
-			rec.mat_ptr = mat_ptr;
-			return true;
-		}
-		temp = (-b + sqrt(b*b - a*c)) / a;
-		if (temp < t_max && temp > t_min) {
-			rec.t = temp;
-			rec.p = r.point_at_parameter(rec.t);
-			rec.normal = (rec.p - center(r.time())) / radius;
-			rec.mat_ptr = mat_ptr;
+			rec.set_hit(temp, this);
 			return true;
 		}
 	}
 	return false;
 }
 
+void moving_sphere::surface_interaction(const ray& r, hit_record& rec) const {
+	rec.p = r.point_at_parameter(rec.t);
+	rec.normal = (rec.p - center(r.time())) / radius;
+	rec.u = rec.v = 0;
+	rec.mat = mat;
+}
+
 bool moving_sphere::bounding_box(float t0, float t1, aabb& box) const {
 	aabb box0(center(t0) - vec3(radius, radius, radius), center(t0) + vec3(radius, radius, radius));
 	aabb box1(center(t1) - vec3(radius, radius, radius), center(t1) + vec3(radius, radius, radius));
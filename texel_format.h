@@ -0,0 +1,248 @@
+#ifndef TEXELFORMATH
+#define TEXELFORMATH
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "vec3.h"
+
+// How image textures store their texels. Regions of texels are encoded into
+// 32-bit words, w x h texels at a time, with w and h multiples of 4:
+//   TEXEL_RGBA8  one word per texel, 8 bits per channel, 4 bytes/texel
+//   TEXEL_HALF   two words per texel, 16-bit floats for HDR, 8 bytes/texel
+//   TEXEL_BC1    4x4 blocks of two 565 endpoints and 2-bit indices, two words
+//                per block, 0.5 bytes/texel, LDR only
+// Texels (and BC1 blocks) are row-major within the region.
+enum texel_format {
+	TEXEL_RGBA8,
+	TEXEL_HALF,
+	TEXEL_BC1
+};
+
+inline const char *texel_format_name(texel_format f) {
+	switch (f) {
+	case TEXEL_HALF:	return "half";
+	case TEXEL_BC1:		return "bc1";
+	default:			return "rgba8";
+	}
+}
+
+inline size_t texel_words(texel_format f, int w, int h) {
+	switch (f) {
+	case TEXEL_HALF:	return size_t(w) * h * 2;
+	case TEXEL_BC1:		return size_t(w / 4) * (h / 4) * 2;
+	default:			return size_t(w) * h;
+	}
+}
+
+inline uint32_t pack_rgba(int r, int g, int b) { return uint32_t(r) | (uint32_t(g) << 8) | (uint32_t(b) << 16); }
+inline int texel_channel(uint32_t t, int c) { return int((t >> (8 * c)) & 0xff); }
+
+inline int quantize(float c, int levels) {
+	int q = int(c * levels + 0.5f);
+	return q < 0 ? 0 : (q > levels ? levels : q);
+}
+
+// Round to nearest even, overflow goes to infinity.
+inline uint16_t float_to_half(float f) {
+	uint32_t x;
+	memcpy(&x, &f, 4);
+	uint32_t sign = (x >> 16) & 0x8000;
+	x &= 0x7fffffff;
+	if (x >= 0x7f800000)
+		return uint16_t(sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0));
+	if (x >= 0x477ff000)
+		return uint16_t(sign | 0x7c00);
+	if (x < 0x38800000) {
+		// denormal, the scaled value is the mantissa
+		float a;
+		memcpy(&a, &x, 4);
+		return uint16_t(sign | uint32_t(nearbyintf(a * 16777216.0f)));
+	}
+	x += 0xc8000fff + ((x >> 13) & 1);
+	return uint16_t(sign | (x >> 13));
+}
+
+// The decoders return the texel as a vec3 register with the padding lane 0.
+#if defined(VEC3_SSE)
+inline simd4f unpack_rgba8(uint32_t t) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i i = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(t)), zero), zero);
+	return _mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(1.0f / 255.0f));
+}
+// no F16C in plain SSE2: the shifted bits times 2^112 rebias normals and
+// denormals alike, infinities and nans get their exponent forced to all ones
+inline simd4f unpack_half4(const uint32_t *p) {
+	__m128i h = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)p), _mm_setzero_si128());
+	__m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
+	__m128i em = _mm_and_si128(h, _mm_set1_epi32(0x7fff));
+	__m128 f = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(em, 13)), _mm_castsi128_ps(_mm_set1_epi32(0x77800000)));
+	__m128i special = _mm_cmpgt_epi32(em, _mm_set1_epi32(0x7bff));
+	__m128i bits = _mm_or_si128(_mm_castps_si128(f), _mm_and_si128(special, _mm_set1_epi32(0x7f800000)));
+	return _mm_castsi128_ps(_mm_or_si128(bits, sign));
+}
+// fields masked in place, the scale takes out both the shift and the range
+inline simd4f unpack_565(uint32_t c) {
+	__m128i i = _mm_and_si128(_mm_set1_epi32(int(c)), _mm_set_epi32(0, 0x001f, 0x07e0, 0xf800));
+	return _mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set_ps(0.0f, 1.0f / 31.0f, 1.0f / (63.0f * 32.0f), 1.0f / (31.0f * 2048.0f)));
+}
+#elif defined(VEC3_NEON)
+inline simd4f unpack_rgba8(uint32_t t) {
+	uint32x4_t i = vmovl_u16(vget_low_u16(vmovl_u8(vcreate_u8(uint64_t(t)))));
+	return vmulq_n_f32(vcvtq_f32_u32(i), 1.0f / 255.0f);
+}
+inline simd4f unpack_half4(const uint32_t *p) {
+	return vcvt_f32_f16(vreinterpret_f16_u32(vld1_u32(p)));
+}
+inline simd4f unpack_565(uint32_t c) {
+	const uint32_t masks[4] = { 0xf800, 0x07e0, 0x001f, 0 };
+	const float scale[4] = { 1.0f / (31.0f * 2048.0f), 1.0f / (63.0f * 32.0f), 1.0f / 31.0f, 0.0f };
+	return vmulq_f32(vcvtq_f32_u32(vandq_u32(vdupq_n_u32(c), vld1q_u32(masks))), vld1q_f32(scale));
+}
+#else
+inline simd4f unpack_rgba8(uint32_t t) {
+	return simd4_set(texel_channel(t, 0) / 255.0f, texel_channel(t, 1) / 255.0f, texel_channel(t, 2) / 255.0f);
+}
+inline float half_to_float(uint32_t h) {
+	uint32_t em = h & 0x7fff;
+	uint32_t bits = em << 13;
+	float f;
+	memcpy(&f, &bits, 4);
+	f *= 5.192296858534828e+33f; // 2^112
+	memcpy(&bits, &f, 4);
+	if (em > 0x7bff)
+		bits |= 0x7f800000;
+	bits |= (h & 0x8000) << 16;
+	memcpy(&f, &bits, 4);
+	return f;
+}
+inline simd4f unpack_half4(const uint32_t *p) {
+	return simd4_set(half_to_float(p[0] & 0xffff), half_to_float(p[0] >> 16), half_to_float(p[1] & 0xffff));
+}
+inline simd4f unpack_565(uint32_t c) {
+	return simd4_set(((c >> 11) & 31) / 31.0f, ((c >> 5) & 63) / 63.0f, (c & 31) / 31.0f);
+}
+#endif
+
+inline uint32_t pack_565(const vec3& c) {
+	return uint32_t(quantize(c[0], 31) << 11) | uint32_t(quantize(c[1], 63) << 5) | uint32_t(quantize(c[2], 31));
+}
+
+// Picks endpoints along the principal axis of the block's colours and gives
+// every texel the nearest of the four palette entries. Always four colour
+// mode (c0 > c1) unless the block is flat.
+inline void encode_bc1_block(const vec3 *texels, uint32_t out[2]) {
+	vec3 c[16];
+	vec3 mean(0, 0, 0), lo(1, 1, 1), hi(0, 0, 0);
+	for (int i = 0; i < 16; i++) {
+		c[i] = vmin(vmax(texels[i], vec3(0, 0, 0)), vec3(1, 1, 1));
+		mean += c[i];
+		lo = vmin(lo, c[i]);
+		hi = vmax(hi, c[i]);
+	}
+	mean /= 16.0f;
+	float cov[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int i = 0; i < 16; i++) {
+		vec3 d = c[i] - mean;
+		cov[0] += d[0] * d[0]; cov[1] += d[0] * d[1]; cov[2] += d[0] * d[2];
+		cov[3] += d[1] * d[1]; cov[4] += d[1] * d[2]; cov[5] += d[2] * d[2];
+	}
+	vec3 axis = hi - lo;
+	for (int k = 0; k < 4; k++) {
+		axis = vec3(cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+			cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+			cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]);
+		float len = axis.length();
+		if (len < 1e-12f)
+			break;
+		axis /= len;
+	}
+	float tmin = 0, tmax = 0;
+	if (axis.squared_length() > 0.5f) {
+		for (int i = 0; i < 16; i++) {
+			float t = dot(c[i] - mean, axis);
+			tmin = t < tmin ? t : tmin;
+			tmax = t > tmax ? t : tmax;
+		}
+	}
+	uint32_t c0 = pack_565(mean + tmax * axis);
+	uint32_t c1 = pack_565(mean + tmin * axis);
+	if (c0 < c1) {
+		uint32_t t = c0;
+		c0 = c1;
+		c1 = t;
+	}
+	uint32_t indices = 0;
+	if (c0 != c1) {
+		vec3 e0(unpack_565(c0)), e1(unpack_565(c1));
+		vec3 palette[4] = { e0, e1, e0 + (e1 - e0) / 3.0f, e0 + 2.0f * (e1 - e0) / 3.0f };
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			float best_d = (c[i] - palette[0]).squared_length();
+			for (int k = 1; k < 4; k++) {
+				float d = (c[i] - palette[k]).squared_length();
+				if (d < best_d) {
+					best_d = d;
+					best = k;
+				}
+			}
+			indices |= uint32_t(best) << (2 * i);
+		}
+	}
+	out[0] = c0 | (c1 << 16);
+	out[1] = indices;
+}
+
+// Encodes a w x h region of linear colours, rows pitch texels apart.
+inline void encode_texels(texel_format f, const vec3 *src, int pitch, int w, int h, uint32_t *dst) {
+	if (f == TEXEL_BC1) {
+		vec3 block[16];
+		for (int by = 0; by < h; by += 4) {
+			for (int bx = 0; bx < w; bx += 4) {
+				for (int i = 0; i < 16; i++)
+					block[i] = src[size_t(by + i / 4) * pitch + bx + i % 4];
+				encode_bc1_block(block, dst);
+				dst += 2;
+			}
+		}
+		return;
+	}
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			const vec3& c = src[size_t(y) * pitch + x];
+			if (f == TEXEL_HALF) {
+				*dst++ = uint32_t(float_to_half(c[0])) | (uint32_t(float_to_half(c[1])) << 16);
+				*dst++ = uint32_t(float_to_half(c[2]));
+			}
+			else {
+				*dst++ = pack_rgba(quantize(c[0], 255), quantize(c[1], 255), quantize(c[2], 255));
+			}
+		}
+	}
+}
+
+// Texel (x, y) of a region w texels wide that encode_texels() wrote.
+inline vec3 decode_texel(texel_format f, const uint32_t *region, int w, int x, int y) {
+	switch (f) {
+	case TEXEL_HALF:
+		return vec3(unpack_half4(region + 2 * (size_t(y) * w + x)));
+	case TEXEL_BC1: {
+		const uint32_t *block = region + 2 * (size_t(y >> 2) * (w >> 2) + (x >> 2));
+		uint32_t c0 = block[0] & 0xffff, c1 = block[0] >> 16;
+		uint32_t index = (block[1] >> (2 * (((y & 3) << 2) | (x & 3)))) & 3;
+		if (index == 0)
+			return vec3(unpack_565(c0));
+		if (index == 1)
+			return vec3(unpack_565(c1));
+		vec3 e0(unpack_565(c0)), e1(unpack_565(c1));
+		if (c0 > c1)
+			return e0 + (index == 2 ? 1.0f / 3.0f : 2.0f / 3.0f) * (e1 - e0);
+		// three colour mode, index 3 is black
+		return index == 2 ? 0.5f * (e0 + e1) : vec3(0, 0, 0);
+	}
+	default:
+		return vec3(unpack_rgba8(region[size_t(y) * w + x]));
+	}
+}
+
+#endif // !TEXELFORMATH
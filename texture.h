@@ -1,44 +1,80 @@
 #ifndef TEXTUREH
 #define TEXTUREH
 
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
 #include "vec3.h"
+#include "aabb.h"
 #include "perlin.h"
+#include "threads.h"
+#include "stb_image.h"
+#include "texture_cache.h"
 
-class texture {
+// Textures and materials live in typed pools and are referred to by 32-bit
+// ids: the type in the top 8 bits and the index into that type's array below.
+typedef uint32_t texture_id;
+
+const int POOL_INDEX_BITS = 24;
+const uint32_t POOL_INDEX_MASK = (1u << POOL_INDEX_BITS) - 1;
+
+inline uint32_t make_pool_id(int type, size_t index) { return (uint32_t(type) << POOL_INDEX_BITS) | uint32_t(index); }
+inline int pool_type(uint32_t id) { return int(id >> POOL_INDEX_BITS); }
+inline uint32_t pool_index(uint32_t id) { return id & POOL_INDEX_MASK; }
+
+// Pools hand back the existing id when something with the same parameters has
+// been added before. The key is the type followed by the raw parameter bytes.
+class pool_dedup {
 public:
-	virtual vec3 value(float u, float v, const vec3& p) const = 0;
+	template <class T>
+	std::string key(int type, const T& params) const {
+		std::string k(1 + sizeof(T), '\0');
+		k[0] = char(type);
+		memcpy(&k[1], &params, sizeof(T));
+		return k;
+	}
+	bool find(const std::string& k, uint32_t& id) const {
+		auto it = ids.find(k);
+		if (it == ids.end())
+			return false;
+		id = it->second;
+		return true;
+	}
+	void insert(const std::string& k, uint32_t id) { ids[k] = id; }
+	void clear() { ids.clear(); }
+	std::unordered_map<std::string, uint32_t> ids;
 };
 
-class constant_texture : public texture {
+template <class T> using texture_vector = tracked_vector<T, MEM_TEXTURES>;
+
+class texture_pool;
+
+class constant_texture {
 public:
 	constant_texture() {}
 	constant_texture(vec3 c) : color(c) {}
-	virtual vec3 value(float u, float v, const vec3& p) const {
+	vec3 value(float u, float v, const vec3& p) const {
 		return color;
 	}
 	vec3 color;
 };
 
-class checker_texture : public texture {
+class checker_texture {
 public:
 	checker_texture() {}
-	checker_texture(texture *t0, texture *t1) : even(t0), odd(t1) {}
-	virtual vec3 value(float u, float v, const vec3& p) const {
-		float sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
-		if (sines < 0)
-			return odd->value(u, v, p);
-		else
-			return even->value(u, v, p);
-	}
-	texture *odd;
-	texture *even;
+	checker_texture(texture_id t0, texture_id t1) : odd(t1), even(t0) {}
+	inline vec3 value(const texture_pool& pool, float u, float v, const vec3& p, float width) const;
+	texture_id odd;
+	texture_id even;
 };
 
-class noise_texture : public texture {
+class noise_texture {
 public:
 	noise_texture() {}
 	noise_texture(float sc) : scale(sc) {}
-	virtual vec3 value(float u, float v, const vec3& p) const {
+	vec3 value(float u, float v, const vec3& p) const {
 		//return vec3(1, 1, 1) *0.5* noise.turb(p * scale);
 		//return vec3(1, 1, 1)*noise.turb(scale*p);
 		return vec3(1, 1, 1) * 0.5 * (1 + sin(scale*p.z() + 10 * noise.turb(p)));
@@ -47,26 +83,539 @@ public:
 	float scale = 1.0f;
 };
 
-class image_texture : public texture {
+// The pixels are copied into a mip pyramid when the texture is made. Every
+// level is stored as 8x8 tiles in the texture's texel_format, so a bilinear
+// lookup touches one or two tiles (256 bytes of rgba8, 32 of bc1) instead of
+// rows nx texels apart. Lookups are trilinear, with the level picked from the
+// ray footprint width in uv units.
+// Textures made from a texture_cache file keep no texels of their own and
+// fetch them from the cache's tiles instead.
+class image_texture {
 public:
 	image_texture() {}
-	image_texture(unsigned char *pixels, int A, int B) : data(pixels), nx(A), ny(B) {}
-	virtual vec3 value(float u, float v, const vec3&p) const;
-	unsigned char *data;
+	image_texture(const rgb_image& rgb, int A, int B, texel_format f = TEXEL_RGBA8);
+	image_texture(texture_cache *c, int f, texel_format fmt);
+	vec3 value(float u, float v, const vec3& p, float width = 0.0f) const;
+	int levels() const { return int(mips.size()); }
+	size_t bytes() const { return texels.size() * sizeof(uint32_t); }
 	int nx, ny;
+	texel_format format;
+	texture_cache *cache;
+	int file;
+
+private:
+	struct mip_level {
+		size_t offset;
+		int w, h;
+		int tiles_x;
+	};
+	void add_level(const rgb_image& rgb, int w, int h);
+	inline vec3 texel(const mip_level& l, int x, int y) const {
+		size_t tile = size_t((y >> 3) * l.tiles_x + (x >> 3));
+		return decode_texel(format, &texels[l.offset + tile * tile_words], 8, x & 7, y & 7);
+	}
+	vec3 bilinear(int level, float u, float v) const;
+
+	size_t tile_words;
+	texture_vector<uint32_t> texels;
+	std::vector<mip_level> mips;
+};
+
+image_texture::image_texture(const rgb_image& rgb, int A, int B, texel_format f)
+	: nx(A), ny(B), format(f), cache(nullptr), file(-1), tile_words(texel_words(f, 8, 8)) {
+	build_mip_chain(rgb, nx, ny, [this](const rgb_image& level, int w, int h) { add_level(level, w, h); });
+}
+
+image_texture::image_texture(texture_cache *c, int f, texel_format fmt)
+	: nx(c->width(f)), ny(c->height(f)), format(fmt), cache(c), file(f), tile_words(0) {
+	// only the level sizes are kept here, the texels stay with the cache
+	const std::vector<texture_cache::level>& cached = c->levels(f);
+	for (size_t i = 0; i < cached.size(); i++) {
+		mip_level l;
+		l.offset = 0;
+		l.w = cached[i].w;
+		l.h = cached[i].h;
+		l.tiles_x = cached[i].tiles_x;
+		mips.push_back(l);
+	}
+}
+
+void image_texture::add_level(const rgb_image& rgb, int w, int h) {
+	mip_level l;
+	l.offset = texels.size();
+	l.w = w;
+	l.h = h;
+	l.tiles_x = (w + 7) / 8;
+	int tiles_y = (h + 7) / 8;
+	texels.resize(l.offset + size_t(l.tiles_x) * tiles_y * tile_words);
+	mips.push_back(l);
+	rgb_image scratch;
+	for (int ty = 0; ty < tiles_y; ty++)
+		for (int tx = 0; tx < l.tiles_x; tx++)
+			encode_tile(format, rgb, w, h, 8 * tx, 8 * ty, 8, scratch, &texels[l.offset + size_t(ty * l.tiles_x + tx) * tile_words]);
+}
+
+vec3 image_texture::bilinear(int level, float u, float v) const {
+	const mip_level& l = mips[level];
+	// v = 1 is the top row, same orientation as the raw stbi image
+	float x = u * l.w - 0.5f;
+	float y = (1 - v) * l.h - 0.5f;
+	int x0 = int(floor(x));
+	int y0 = int(floor(y));
+	float fx = x - x0;
+	float fy = y - y0;
+	int x1 = x0 + 1, y1 = y0 + 1;
+	x0 = x0 < 0 ? 0 : (x0 > l.w - 1 ? l.w - 1 : x0);
+	x1 = x1 < 0 ? 0 : (x1 > l.w - 1 ? l.w - 1 : x1);
+	y0 = y0 < 0 ? 0 : (y0 > l.h - 1 ? l.h - 1 : y0);
+	y1 = y1 < 0 ? 0 : (y1 > l.h - 1 ? l.h - 1 : y1);
+	vec3 q[4];
+	if (cache) {
+		cache->quad(file, level, x0, y0, x1, y1, q);
+	}
+	else {
+		q[0] = texel(l, x0, y0);
+		q[1] = texel(l, x1, y0);
+		q[2] = texel(l, x0, y1);
+		q[3] = texel(l, x1, y1);
+	}
+	float w00 = (1 - fx) * (1 - fy), w10 = fx * (1 - fy), w01 = (1 - fx) * fy, w11 = fx * fy;
+	return w00 * q[0] + w10 * q[1] + w01 * q[2] + w11 * q[3];
+}
+
+vec3 image_texture::value(float u, float v, const vec3& p, float width) const {
+	// footprint in texels along the longer side
+	float texels_across = width * (nx > ny ? nx : ny);
+	if (texels_across <= 1.0f)
+		return bilinear(0, u, v);
+	float lod = log2f(texels_across);
+	int last = levels() - 1;
+	if (lod >= last)
+		return bilinear(last, u, v);
+	int level = int(lod);
+	float f = lod - level;
+	return (1 - f) * bilinear(level, u, v) + f * bilinear(level + 1, u, v);
+}
+
+// How texture_pool::bake() samples: grids start at min_res cells along the
+// longest side and double, up to max_res, until the RMS difference from the
+// texture at probe points is at most tolerance.
+struct bake_options {
+	int min_res = 32;
+	int max_res = 128;
+	float tolerance = 0.03f;
+};
+
+// A texture sampled at the corners of a grid of cells over a box and looked up
+// trilinearly, for procedural textures too slow to work out at every hit.
+// Points outside the box take the value at the nearest point of it.
+class baked_texture {
+public:
+	baked_texture() : nx(0), ny(0), nz(0) {}
+	// cells along the longest side, the others get as many as keeps cells cubic
+	void resize(const aabb& box, int cells);
+	vec3 position(int i, int j, int k) const { return origin + vec3(i * step.x(), j * step.y(), k * step.z()); }
+	vec3& at(int i, int j, int k) { return rgb[(size_t(k) * ny + j) * nx + i]; }
+	vec3 value(const vec3& p) const;
+	vec3 origin, step, inv_step;
+	int nx, ny, nz;		// grid points, one more than cells
+	texture_vector<vec3> rgb;
+};
+
+void baked_texture::resize(const aabb& box, int cells) {
+	vec3 e = box.max() - box.min();
+	float longest = fmaxf(e.x(), fmaxf(e.y(), e.z()));
+	int n[3];
+	float s[3], inv[3];
+	for (int a = 0; a < 3; a++) {
+		n[a] = longest > 0.0f ? int(ceilf(cells * e[a] / longest)) : 1;
+		n[a] = n[a] > 1 ? n[a] : 1;
+		s[a] = e[a] / n[a];
+		// a flat box has one layer of cells, all lookups land at its start
+		inv[a] = s[a] > 0.0f ? 1.0f / s[a] : 0.0f;
+	}
+	origin = box.min();
+	step = vec3(s[0], s[1], s[2]);
+	inv_step = vec3(inv[0], inv[1], inv[2]);
+	nx = n[0] + 1;
+	ny = n[1] + 1;
+	nz = n[2] + 1;
+	rgb.resize(size_t(nx) * ny * nz);
+}
+
+// index of the cell x (in cells from the origin) is in, clamped to the n points, and x's fraction past it
+inline int baked_cell(float x, int n, float& f) {
+	x = x > 0.0f ? (x < float(n - 1) ? x : float(n - 1)) : 0.0f;
+	int i = int(x);
+	i = i < n - 2 ? i : n - 2;
+	f = x - i;
+	return i;
+}
+
+vec3 baked_texture::value(const vec3& p) const {
+	vec3 g = (p - origin) * inv_step;
+	float u, v, w;
+	int i = baked_cell(g.x(), nx, u), j = baked_cell(g.y(), ny, v), k = baked_cell(g.z(), nz, w);
+	const vec3 *c = &rgb[(size_t(k) * ny + j) * nx + i];
+	size_t dy = nx, dz = size_t(nx) * ny;
+	vec3 c00 = c[0] + u * (c[1] - c[0]);
+	vec3 c10 = c[dy] + u * (c[dy + 1] - c[dy]);
+	vec3 c01 = c[dz] + u * (c[dz + 1] - c[dz]);
+	vec3 c11 = c[dz + dy] + u * (c[dz + dy + 1] - c[dz + dy]);
+	vec3 c0 = c00 + v * (c10 - c00);
+	vec3 c1 = c01 + v * (c11 - c01);
+	return c0 + w * (c1 - c0);
+}
+
+// Baked grid file ("<bake_dir>/<hash of the key>.baked"):
+//   char magic[4] = "RTBK", uint32 version, key length, the key bytes
+//   uint32 nx, ny, nz, floats origin[3], step[3]
+//   then rgb floats for every grid point, x fastest
+bool write_baked_grid(const char *path, const std::string& key, const baked_texture& b) {
+	FILE *fp = fopen(path, "wb");
+	if (!fp)
+		return false;
+	uint32_t hdr[3] = { 0, 1, uint32_t(key.size()) };
+	memcpy(hdr, "RTBK", 4);
+	uint32_t n[3] = { uint32_t(b.nx), uint32_t(b.ny), uint32_t(b.nz) };
+	float place[6] = { b.origin.x(), b.origin.y(), b.origin.z(), b.step.x(), b.step.y(), b.step.z() };
+	bool ok = fwrite(hdr, sizeof(hdr), 1, fp) == 1 && fwrite(key.data(), key.size(), 1, fp) == 1
+		&& fwrite(n, sizeof(n), 1, fp) == 1 && fwrite(place, sizeof(place), 1, fp) == 1;
+	for (size_t i = 0; ok && i < b.rgb.size(); i++) {
+		float c[3] = { b.rgb[i].x(), b.rgb[i].y(), b.rgb[i].z() };
+		ok = fwrite(c, sizeof(c), 1, fp) == 1;
+	}
+	return fclose(fp) == 0 && ok;
+}
+
+// false when there is no file for the key, or it was baked from something else
+bool read_baked_grid(const char *path, const std::string& key, baked_texture& b) {
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+	uint32_t hdr[3], n[3];
+	float place[6];
+	std::string k;
+	bool ok = fread(hdr, sizeof(hdr), 1, fp) == 1 && memcmp(hdr, "RTBK", 4) == 0 && hdr[1] == 1 && hdr[2] == key.size();
+	if (ok) {
+		k.resize(key.size());
+		ok = fread(&k[0], k.size(), 1, fp) == 1 && k == key && fread(n, sizeof(n), 1, fp) == 1 && fread(place, sizeof(place), 1, fp) == 1
+			&& n[0] >= 2 && n[1] >= 2 && n[2] >= 2 && n[0] <= 65536 && n[1] <= 65536 && n[2] <= 65536;
+	}
+	if (ok) {
+		b.origin = vec3(place[0], place[1], place[2]);
+		b.step = vec3(place[3], place[4], place[5]);
+		b.inv_step = vec3(place[3] > 0.0f ? 1.0f / place[3] : 0.0f, place[4] > 0.0f ? 1.0f / place[4] : 0.0f, place[5] > 0.0f ? 1.0f / place[5] : 0.0f);
+		b.nx = int(n[0]);
+		b.ny = int(n[1]);
+		b.nz = int(n[2]);
+		b.rgb.resize(size_t(b.nx) * b.ny * b.nz);
+		std::vector<float> row(size_t(b.nx) * 3);
+		for (size_t r = 0; ok && r < size_t(b.ny) * b.nz; r++) {
+			ok = fread(row.data(), sizeof(float), row.size(), fp) == row.size();
+			for (int i = 0; ok && i < b.nx; i++)
+				b.rgb[r * b.nx + i] = vec3(row[3 * i], row[3 * i + 1], row[3 * i + 2]);
+		}
+	}
+	fclose(fp);
+	return ok;
+}
+
+// The k-th of a low-discrepancy sequence of points in [0,1)^3 (Roberts' R3),
+// where bakes are compared against what they were baked from.
+inline vec3 bake_probe(int k) {
+	double x = 0.5 + k * 0.8191725133961645, y = 0.5 + k * 0.6710436067037893, z = 0.5 + k * 0.5497004779019703;
+	return vec3(float(x - floor(x)), float(y - floor(y)), float(z - floor(z)));
+}
+
+enum texture_type {
+	TEX_CONSTANT,
+	TEX_CHECKER,
+	TEX_NOISE,
+	TEX_IMAGE,
+	TEX_BAKED
+};
+
+class texture_pool {
+public:
+	texture_pool() : cache(nullptr) {}
+	texture_id add(const constant_texture& t) {
+		float key[3] = { t.color.x(), t.color.y(), t.color.z() };
+		return insert(TEX_CONSTANT, constants, t, key);
+	}
+	texture_id add(const checker_texture& t) {
+		texture_id key[2] = { t.odd, t.even };
+		return insert(TEX_CHECKER, checkers, t, key);
+	}
+	// the perlin tables are shared, so the scale is all that tells two apart
+	texture_id add(const noise_texture& t) { return insert(TEX_NOISE, noises, t, t.scale); }
+	// images are only shared by file name, see load_image()
+	texture_id add(const image_texture& t) {
+		images.push_back(t);
+		return make_pool_id(TEX_IMAGE, images.size() - 1);
+	}
+	// format picks how the texels are stored, see texel_format.h
+	texture_id load_image(const char *file, texel_format format = TEXEL_RGBA8);
+	// Samples t over box (the bounds of what it is put on) into a baked
+	// texture and returns that, or t itself when max_res can't get within the
+	// tolerance. A grid only knows p, so textures that read u and v (images,
+	// and checkers of them) are returned unbaked too.
+	// With the cache's bake_dir set, the grid is kept there and later runs
+	// that bake the same texture over the same box read it back.
+	texture_id bake(texture_id t, const aabb& box, const bake_options& o = bake_options());
+	// The same over the uv square of a surface, where point(u, v) is the
+	// point on it at (u, v); the result is an image texture of res by res
+	// texels. surface names it for the cache, nullptr keeps the bake in memory.
+	template <class F>
+	texture_id bake_uv(texture_id t, const char *surface, F point, const bake_options& o = bake_options());
+
+	// width is the ray footprint in uv units, only image textures use it
+	inline vec3 value(texture_id id, float u, float v, const vec3& p, float width = 0.0f) const {
+		uint32_t i = pool_index(id);
+		switch (pool_type(id)) {
+		case TEX_CONSTANT:	return constants[i].color;
+		case TEX_CHECKER:	return checkers[i].value(*this, u, v, p, width);
+		case TEX_NOISE:		return noises[i].value(u, v, p);
+		case TEX_BAKED:		return baked[i].value(p);
+		default:			return images[i].value(u, v, p, width);
+		}
+	}
+	size_t size() const { return constants.size() + checkers.size() + noises.size() + images.size() + baked.size(); }
+	// empties the pool but keeps the arrays' capacity for the next scene
+	void clear();
+
+	texture_vector<constant_texture> constants;
+	texture_vector<checker_texture> checkers;
+	texture_vector<noise_texture> noises;
+	texture_vector<image_texture> images;
+	texture_vector<baked_texture> baked;
+	// when set, load_image() streams images through it instead of loading them whole
+	texture_cache *cache;
+
+private:
+	texture_pool(const texture_pool&) = delete;
+	texture_pool& operator=(const texture_pool&) = delete;
+	template <class T, class K>
+	texture_id insert(texture_type type, texture_vector<T>& list, const T& t, const K& params) {
+		std::string k = dedup.key(type, params);
+		texture_id id;
+		if (dedup.find(k, id))
+			return id;
+		id = make_pool_id(type, list.size());
+		list.push_back(t);
+		dedup.insert(k, id);
+		return id;
+	}
+	// appends t's type and parameters to key, false if they don't pin down what it looks like
+	bool describe(texture_id t, std::string& key) const;
+	bool uses_uv(texture_id t) const;
+	// where the bake of key is kept, empty when it isn't
+	std::string bake_path(const std::string& key) const;
+	pool_dedup dedup;
+	std::unordered_map<std::string, texture_id> image_files;
 };
 
-vec3 image_texture::value(float u, float v, const vec3& p) const {
-	int i = (u)*nx;
-	int j = (1 - v)*ny - 0.001;
-	if (i < 0) i = 0;
-	if (j < 0) j = 0;
-	if (i > nx - 1) i = nx - 1;
-	if (j > ny - 1) j = ny - 1;
-	float r = int(data[3 * i + 3 * nx*j]) / 255.0;
-	float g = int(data[3 * i + 3 * nx*j + 1]) / 255.0;
-	float b = int(data[3 * i + 3 * nx*j + 2]) / 255.0;
-	return vec3(r, g, b);
+texture_id texture_pool::load_image(const char *file, texel_format format) {
+	std::string name = std::string(file) + "." + texel_format_name(format);
+	auto it = image_files.find(name);
+	if (it != image_files.end())
+		return it->second;
+	texture_id id;
+	int f = cache ? cache->open(file, format) : -1;
+	rgb_image rgb;
+	int nx, ny;
+	if (f >= 0) {
+		images.push_back(image_texture(cache, f, format));
+		id = make_pool_id(TEX_IMAGE, images.size() - 1);
+	}
+	else if (load_image_rgb(file, rgb, nx, ny)) {
+		images.push_back(image_texture(rgb, nx, ny, format));
+		id = make_pool_id(TEX_IMAGE, images.size() - 1);
+	}
+	else {
+		std::cerr << "couldn't load " << file << "\n";
+		id = add(constant_texture(vec3(1, 0, 1)));
+	}
+	image_files[name] = id;
+	return id;
+}
+
+void texture_pool::clear() {
+	image_files.clear();
+	constants.clear();
+	checkers.clear();
+	noises.clear();
+	images.clear();
+	baked.clear();
+	dedup.clear();
+}
+
+bool texture_pool::describe(texture_id t, std::string& key) const {
+	uint32_t i = pool_index(t);
+	key += char(pool_type(t));
+	switch (pool_type(t)) {
+	case TEX_CONSTANT: {
+		float c[3] = { constants[i].color.x(), constants[i].color.y(), constants[i].color.z() };
+		key.append((const char *)c, sizeof(c));
+		return true;
+	}
+	case TEX_CHECKER:
+		return describe(checkers[i].odd, key) && describe(checkers[i].even, key);
+	case TEX_NOISE:
+		// the perlin tables come from the random numbers at start up
+		key.append((const char *)&noises[i].scale, sizeof(float));
+		key.append((const char *)perlin::perm_x, 256 * sizeof(int));
+		key.append((const char *)perlin::perm_y, 256 * sizeof(int));
+		key.append((const char *)perlin::perm_z, 256 * sizeof(int));
+		key.append((const char *)perlin::ranvec_soa, 3 * 256 * sizeof(float));
+		return true;
+	default:
+		// images can change under the same name
+		return false;
+	}
+}
+
+bool texture_pool::uses_uv(texture_id t) const {
+	switch (pool_type(t)) {
+	case TEX_CHECKER:	return uses_uv(checkers[pool_index(t)].odd) || uses_uv(checkers[pool_index(t)].even);
+	case TEX_IMAGE:		return true;
+	default:			return false;
+	}
+}
+
+std::string texture_pool::bake_path(const std::string& key) const {
+	if (!cache || cache->bake_dir.empty())
+		return std::string();
+	// FNV-1a
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < key.size(); i++)
+		h = (h ^ uint8_t(key[i])) * 1099511628211ull;
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)h);
+	return cache->bake_dir + "/" + name;
+}
+
+texture_id texture_pool::bake(texture_id t, const aabb& box, const bake_options& o) {
+	if (uses_uv(t)) {
+		std::cerr << "texture left unbaked, it depends on uv" << std::endl;
+		return t;
+	}
+	std::string key, path;
+	if (describe(t, key)) {
+		float corners[6] = { box.min().x(), box.min().y(), box.min().z(), box.max().x(), box.max().y(), box.max().z() };
+		key.append((const char *)corners, sizeof(corners));
+		key.append((const char *)&o, sizeof(o));
+		path = bake_path(key);
+	}
+	baked_texture b;
+	if (!path.empty() && read_baked_grid((path + ".baked").c_str(), key, b)) {
+		baked.push_back(b);
+		return make_pool_id(TEX_BAKED, baked.size() - 1);
+	}
+	const int PROBES = 4096;
+	vec3 e = box.max() - box.min();
+	float error = 0.0f;
+	for (int res = o.min_res;; res *= 2) {
+		b.resize(box, res);
+		size_t threads = thread_count(size_t(b.nz), 4);
+		run_threads(threads, [&](size_t thread) {
+			for (int k = int(b.nz * thread / threads); k < int(b.nz * (thread + 1) / threads); k++)
+				for (int j = 0; j < b.ny; j++)
+					for (int i = 0; i < b.nx; i++)
+						b.at(i, j, k) = value(t, 0, 0, b.position(i, j, k));
+		});
+		// trilinear is furthest off between grid points, which the probes mostly are
+		float sum = 0.0f;
+		for (int k = 0; k < PROBES; k++) {
+			vec3 p = box.min() + bake_probe(k) * e;
+			vec3 d = b.value(p) - value(t, 0, 0, p);
+			float m = fmaxf(fabs(d.x()), fmaxf(fabs(d.y()), fabs(d.z())));
+			sum += m * m;
+		}
+		error = sqrt(sum / PROBES);
+		if (error <= o.tolerance)
+			break;
+		if (res * 2 > o.max_res) {
+			std::cerr << "texture left unbaked, " << res << " cells across are " << error << " off" << std::endl;
+			return t;
+		}
+	}
+	if (!path.empty())
+		write_baked_grid((path + ".baked").c_str(), key, b);
+	baked.push_back(b);
+	return make_pool_id(TEX_BAKED, baked.size() - 1);
+}
+
+template <class F>
+texture_id texture_pool::bake_uv(texture_id t, const char *surface, F point, const bake_options& o) {
+	const texel_format format = TEXEL_HALF;
+	std::string key, path;
+	if (surface && describe(t, key)) {
+		key += surface;
+		key.append((const char *)&o, sizeof(o));
+		path = bake_path(key);
+	}
+	// the tiled copy stands in for an image that was never written
+	int f = path.empty() ? -1 : cache->open(path.c_str(), format);
+	if (f >= 0) {
+		images.push_back(image_texture(cache, f, format));
+		return make_pool_id(TEX_IMAGE, images.size() - 1);
+	}
+	const int PROBES = 4096;
+	rgb_image rgb;
+	int res = o.min_res;
+	for (;; res *= 2) {
+		rgb.resize(size_t(res) * res);
+		size_t threads = thread_count(size_t(res), 16);
+		run_threads(threads, [&](size_t thread) {
+			for (int y = int(res * thread / threads); y < int(res * (thread + 1) / threads); y++)
+				for (int x = 0; x < res; x++) {
+					// v = 1 is the top row, as image_texture reads it
+					float u = (x + 0.5f) / res, v = 1 - (y + 0.5f) / res;
+					rgb[size_t(y) * res + x] = value(t, u, v, point(u, v));
+				}
+		});
+		float sum = 0.0f;
+		for (int k = 0; k < PROBES; k++) {
+			vec3 q = bake_probe(k);
+			// bilinear between texel centres, clamped at the edges as image_texture is
+			float x = q.x() * res - 0.5f, y = (1 - q.y()) * res - 0.5f;
+			x = x > 0.0f ? (x < res - 1.0f ? x : res - 1.0f) : 0.0f;
+			y = y > 0.0f ? (y < res - 1.0f ? y : res - 1.0f) : 0.0f;
+			int x0 = int(x), y0 = int(y);
+			int x1 = x0 + 1 < res ? x0 + 1 : x0, y1 = y0 + 1 < res ? y0 + 1 : y0;
+			float fx = x - x0, fy = y - y0;
+			vec3 c = (1 - fy) * ((1 - fx) * rgb[size_t(y0) * res + x0] + fx * rgb[size_t(y0) * res + x1])
+				+ fy * ((1 - fx) * rgb[size_t(y1) * res + x0] + fx * rgb[size_t(y1) * res + x1]);
+			vec3 d = c - value(t, q.x(), q.y(), point(q.x(), q.y()));
+			float m = fmaxf(fabs(d.x()), fmaxf(fabs(d.y()), fabs(d.z())));
+			sum += m * m;
+		}
+		float error = sqrt(sum / PROBES);
+		if (error <= o.tolerance)
+			break;
+		if (res * 2 > o.max_res) {
+			std::cerr << "texture left unbaked, " << res << " texels across are " << error << " off" << std::endl;
+			return t;
+		}
+	}
+	if (!path.empty() && write_tiled_image((path + "." + texel_format_name(format) + ".tiles").c_str(), rgb, res, res, format)) {
+		f = cache->open(path.c_str(), format);
+		if (f >= 0) {
+			images.push_back(image_texture(cache, f, format));
+			return make_pool_id(TEX_IMAGE, images.size() - 1);
+		}
+	}
+	images.push_back(image_texture(rgb, res, res, format));
+	return make_pool_id(TEX_IMAGE, images.size() - 1);
+}
+
+inline vec3 checker_texture::value(const texture_pool& pool, float u, float v, const vec3& p, float width) const {
+	float sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+	if (sines < 0)
+		return pool.value(odd, u, v, p, width);
+	else
+		return pool.value(even, u, v, p, width);
 }
 
 #endif
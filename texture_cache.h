@@ -0,0 +1,406 @@
+#ifndef TEXTURECACHEH
+#define TEXTURECACHEH
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "stb_image.h"
+#include "vec3.h"
+#include "texel_format.h"
+#include "memory_stats.h"
+
+// Decoded images and the mip levels built from them only live while a texture
+// is being made, they are booked as image io.
+typedef tracked_vector<vec3, MEM_IMAGE_IO> rgb_image;
+
+// Loads an image as linear rgb. HDR files keep their float values, 8-bit ones
+// are scaled to [0,1].
+bool load_image_rgb(const char *file, rgb_image& rgb, int& nx, int& ny) {
+	int nn;
+	if (stbi_is_hdr(file)) {
+		float *data = stbi_loadf(file, &nx, &ny, &nn, 3);
+		if (!data)
+			return false;
+		rgb.resize(size_t(nx) * ny);
+		for (size_t i = 0; i < rgb.size(); i++)
+			rgb[i] = vec3(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+		stbi_image_free(data);
+		return true;
+	}
+	unsigned char *data = stbi_load(file, &nx, &ny, &nn, 3);
+	if (!data)
+		return false;
+	rgb.resize(size_t(nx) * ny);
+	for (size_t i = 0; i < rgb.size(); i++)
+		rgb[i] = vec3(data[3 * i], data[3 * i + 1], data[3 * i + 2]) * (1.0f / 255.0f);
+	stbi_image_free(data);
+	return true;
+}
+
+// Calls add_level(rgb, w, h) for every level of the mip chain of an image,
+// finest first. Each level is a 2x2 box filter of the one before, the last
+// row/column is repeated on odd sizes.
+template <class F>
+void build_mip_chain(const rgb_image& base, int nx, int ny, F add_level) {
+	rgb_image level(base);
+	int w = nx, h = ny;
+	for (;;) {
+		add_level(level, w, h);
+		if (w == 1 && h == 1)
+			break;
+		int nw = w > 1 ? w / 2 : 1;
+		int nh = h > 1 ? h / 2 : 1;
+		rgb_image next(size_t(nw) * nh);
+		for (int y = 0; y < nh; y++) {
+			int y0 = 2 * y < h ? 2 * y : h - 1;
+			int y1 = 2 * y + 1 < h ? 2 * y + 1 : h - 1;
+			for (int x = 0; x < nw; x++) {
+				int x0 = 2 * x < w ? 2 * x : w - 1;
+				int x1 = 2 * x + 1 < w ? 2 * x + 1 : w - 1;
+				next[y * nw + x] = 0.25f * (level[y0 * w + x0] + level[y0 * w + x1] + level[y1 * w + x0] + level[y1 * w + x1]);
+			}
+		}
+		level.swap(next);
+		w = nw;
+		h = nh;
+	}
+}
+
+// Encodes the size x size tile at (tx, ty) of a w x h level. Texels past the
+// edge repeat the last row/column, lookups clamp before reaching them but BC1
+// blocks straddling the edge fit their endpoints to them.
+inline void encode_tile(texel_format f, const rgb_image& rgb, int w, int h, int tx, int ty, int size, rgb_image& scratch, uint32_t *dst) {
+	scratch.resize(size_t(size) * size);
+	for (int y = 0; y < size; y++) {
+		int sy = ty + y < h ? ty + y : h - 1;
+		for (int x = 0; x < size; x++) {
+			int sx = tx + x < w ? tx + x : w - 1;
+			scratch[y * size + x] = rgb[size_t(sy) * w + sx];
+		}
+	}
+	encode_texels(f, scratch.data(), size, size, size, dst);
+}
+
+// Side of a cache tile in texels. An rgba8 tile is 16KB, bc1 2KB, half 32KB.
+const int CACHE_TILE = 64;
+
+// Tiled copy of an image next to it on disk ("<image>.<format>.tiles"):
+//   char magic[4] = "RTTX", uint32 version, tile size, level count, format
+//   uint32 w, h for every level
+//   the tiles of level 0 row by row, then level 1, ... down to 1x1, each one
+//   encoded as a CACHE_TILE square region of the format
+struct tiled_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t tile_size;
+	uint32_t levels;
+	uint32_t format;
+};
+
+// Writes the mip chain of an image in the tiled layout, returns false if the
+// file can't be written.
+bool write_tiled_image(const char *path, const rgb_image& rgb, int nx, int ny, texel_format format) {
+	FILE *fp = fopen(path, "wb");
+	if (!fp)
+		return false;
+	std::vector<uint32_t> sizes;
+	for (int w = nx, h = ny;; w = w > 1 ? w / 2 : 1, h = h > 1 ? h / 2 : 1) {
+		sizes.push_back(uint32_t(w));
+		sizes.push_back(uint32_t(h));
+		if (w == 1 && h == 1)
+			break;
+	}
+	tiled_header hdr = { { 'R', 'T', 'T', 'X' }, 2, CACHE_TILE, uint32_t(sizes.size() / 2), uint32_t(format) };
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && fwrite(sizes.data(), sizeof(uint32_t), sizes.size(), fp) == sizes.size();
+	std::vector<uint32_t> tile(texel_words(format, CACHE_TILE, CACHE_TILE));
+	rgb_image scratch;
+	build_mip_chain(rgb, nx, ny, [&](const rgb_image& level, int w, int h) {
+		for (int ty = 0; ty < h; ty += CACHE_TILE) {
+			for (int tx = 0; tx < w; tx += CACHE_TILE) {
+				encode_tile(format, level, w, h, tx, ty, CACHE_TILE, scratch, tile.data());
+				ok = ok && fwrite(tile.data(), tile.size() * sizeof(uint32_t), 1, fp) == 1;
+			}
+		}
+	});
+	return fclose(fp) == 0 && ok;
+}
+
+// Keeps the tiles of opened images that lookups have touched in memory, up to
+// a budget, and drops the least recently used ones past it. Only the tiled
+// copy is read at render time, so an image never has to be resident as a
+// whole. Tiles are spread over shards by key, each with its own lock, budget
+// share and LRU list, so many threads can look up at once; misses read the
+// tile with the shard unlocked. Only as many shards are used as the budget
+// has room for a tile of the largest format in each, so small budgets hold
+// too; below one tile, the tile a lookup needs is still kept.
+// open() and set_budget() are not thread safe and are meant for scene
+// building, lookups are.
+class texture_cache {
+public:
+	struct level {
+		int w, h;
+		int tiles_x;
+		uint64_t first_tile;
+	};
+	struct stats {
+		uint64_t lookups, hits, misses, evictions, bytes_read;
+		size_t resident;
+	};
+
+	texture_cache(size_t budget = size_t(256) << 20) : budget_bytes(budget), shard_count(shards_for(budget)) {}
+	~texture_cache() { clear(); }
+
+	int open(const char *image_path, texel_format format = TEXEL_RGBA8);
+	int width(int file) const { return files[file]->levels[0].w; }
+	int height(int file) const { return files[file]->levels[0].h; }
+	const std::vector<level>& levels(int file) const { return files[file]->levels; }
+
+	// decodes the texels at (x0,y0) (x1,y0) (x0,y1) (x1,y1), in that order
+	void quad(int file, int lvl, int x0, int y0, int x1, int y1, vec3 out[4]);
+
+	// evicts what no longer fits
+	void set_budget(size_t bytes);
+	size_t budget() const { return budget_bytes; }
+	// drops every tile and closes every file, ids from open() go stale
+	void clear();
+	stats get_stats();
+	void reset_stats();
+	void print_stats(std::ostream& out);
+
+	// where texture_pool::bake() keeps what it bakes for later runs, empty to
+	// keep bakes in memory only
+	std::string bake_dir;
+
+private:
+	static const int SHARDS = 16;
+	struct tile {
+		uint64_t key;
+		tracked_vector<uint32_t, MEM_TEXTURES> texels;
+	};
+	struct shard {
+		std::mutex lock;
+		// most recently used at the front
+		std::list<tile> lru;
+		std::unordered_map<uint64_t, std::list<tile>::iterator> tiles;
+		size_t bytes = 0;
+		uint64_t lookups = 0, hits = 0, misses = 0, evictions = 0, bytes_read = 0;
+	};
+	struct tiled_file {
+		FILE *fp;
+		// one reader at a time per file, seek + read isn't atomic
+		std::mutex lock;
+		long long data_start;
+		texel_format format;
+		size_t tile_bytes;
+		std::vector<level> levels;
+	};
+	texture_cache(const texture_cache&) = delete;
+	texture_cache& operator=(const texture_cache&) = delete;
+
+	static uint64_t tile_key(int file, uint64_t index) { return (uint64_t(file) << 40) | index; }
+	shard& shard_for(uint64_t key) { return shards[((key * 0x9E3779B97F4A7C15ull) >> 32) % shard_count]; }
+	static int shards_for(size_t budget) {
+		size_t n = budget / (texel_words(TEXEL_HALF, CACHE_TILE, CACHE_TILE) * sizeof(uint32_t));
+		return n < 1 ? 1 : (n > SHARDS ? SHARDS : int(n));
+	}
+	// drops least recently used tiles until at most bytes are left
+	void evict(shard& s, size_t bytes);
+	const uint32_t *find(shard& s, uint64_t key, std::unique_lock<std::mutex>& guard);
+	bool read_tile(uint64_t key, tracked_vector<uint32_t, MEM_TEXTURES>& texels);
+
+	size_t budget_bytes;
+	int shard_count;
+	shard shards[SHARDS];
+	std::vector<std::unique_ptr<tiled_file>> files;
+};
+
+int texture_cache::open(const char *image_path, texel_format format) {
+	std::string path = std::string(image_path) + "." + texel_format_name(format) + ".tiles";
+	// (re)write the tiled copy when it is missing or older than the image
+	struct stat img, tiled;
+	bool have_image = stat(image_path, &img) == 0;
+	bool have_tiled = stat(path.c_str(), &tiled) == 0;
+	if (!have_tiled || (have_image && img.st_mtime > tiled.st_mtime)) {
+		rgb_image rgb;
+		int nx, ny;
+		if (!load_image_rgb(image_path, rgb, nx, ny))
+			return -1;
+		if (!write_tiled_image(path.c_str(), rgb, nx, ny, format)) {
+			remove(path.c_str());
+			return -1;
+		}
+	}
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp)
+		return -1;
+	tiled_header hdr;
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, "RTTX", 4) != 0 || hdr.version != 2
+		|| hdr.tile_size != CACHE_TILE || hdr.format != uint32_t(format) || hdr.levels == 0 || hdr.levels > 32) {
+		fclose(fp);
+		return -1;
+	}
+	std::vector<uint32_t> sizes(hdr.levels * 2);
+	if (fread(sizes.data(), sizeof(uint32_t), sizes.size(), fp) != sizes.size()) {
+		fclose(fp);
+		return -1;
+	}
+	std::unique_ptr<tiled_file> f(new tiled_file);
+	f->fp = fp;
+	f->data_start = (long long)(sizeof(hdr) + sizes.size() * sizeof(uint32_t));
+	f->format = format;
+	f->tile_bytes = texel_words(format, CACHE_TILE, CACHE_TILE) * sizeof(uint32_t);
+	uint64_t first = 0;
+	for (uint32_t i = 0; i < hdr.levels; i++) {
+		level l;
+		l.w = int(sizes[2 * i]);
+		l.h = int(sizes[2 * i + 1]);
+		l.tiles_x = (l.w + CACHE_TILE - 1) / CACHE_TILE;
+		l.first_tile = first;
+		first += uint64_t(l.tiles_x) * ((l.h + CACHE_TILE - 1) / CACHE_TILE);
+		f->levels.push_back(l);
+	}
+	files.push_back(std::move(f));
+	return int(files.size() - 1);
+}
+
+bool texture_cache::read_tile(uint64_t key, tracked_vector<uint32_t, MEM_TEXTURES>& texels) {
+	tiled_file& f = *files[size_t(key >> 40)];
+	long long offset = f.data_start + (long long)(key & ((1ull << 40) - 1)) * (long long)f.tile_bytes;
+	texels.resize(f.tile_bytes / sizeof(uint32_t));
+	std::lock_guard<std::mutex> guard(f.lock);
+#ifdef _WIN32
+	if (_fseeki64(f.fp, offset, SEEK_SET) != 0)
+#else
+	if (fseeko(f.fp, off_t(offset), SEEK_SET) != 0)
+#endif
+		return false;
+	return fread(texels.data(), f.tile_bytes, 1, f.fp) == 1;
+}
+
+const uint32_t *texture_cache::find(shard& s, uint64_t key, std::unique_lock<std::mutex>& guard) {
+	s.lookups++;
+	auto it = s.tiles.find(key);
+	if (it != s.tiles.end()) {
+		s.hits++;
+		s.lru.splice(s.lru.begin(), s.lru, it->second);
+		return it->second->texels.data();
+	}
+	s.misses++;
+	guard.unlock();
+	tile t;
+	t.key = key;
+	if (!read_tile(key, t.texels))
+		std::fill(t.texels.begin(), t.texels.end(), 0u);
+	size_t bytes = t.texels.size() * sizeof(uint32_t);
+	guard.lock();
+	s.bytes_read += bytes;
+	// another thread may have brought it in while we were reading
+	it = s.tiles.find(key);
+	if (it != s.tiles.end()) {
+		s.lru.splice(s.lru.begin(), s.lru, it->second);
+		return it->second->texels.data();
+	}
+	size_t share = budget_bytes / shard_count;
+	evict(s, share > bytes ? share - bytes : 0);
+	s.lru.push_front(std::move(t));
+	s.tiles[key] = s.lru.begin();
+	s.bytes += bytes;
+	return s.lru.front().texels.data();
+}
+
+void texture_cache::evict(shard& s, size_t bytes) {
+	while (!s.lru.empty() && s.bytes > bytes) {
+		s.tiles.erase(s.lru.back().key);
+		s.bytes -= s.lru.back().texels.size() * sizeof(uint32_t);
+		s.lru.pop_back();
+		s.evictions++;
+	}
+}
+
+void texture_cache::set_budget(size_t bytes) {
+	budget_bytes = bytes;
+	shard_count = shards_for(bytes);
+	// tiles in shards no longer used would never be looked up again
+	for (int i = 0; i < SHARDS; i++) {
+		std::lock_guard<std::mutex> guard(shards[i].lock);
+		evict(shards[i], i < shard_count ? budget_bytes / shard_count : 0);
+	}
+}
+
+void texture_cache::quad(int file, int lvl, int x0, int y0, int x1, int y1, vec3 out[4]) {
+	texel_format format = files[file]->format;
+	const level& l = files[file]->levels[lvl];
+	// the four taps nearly always share a tile, which then costs one lock
+	std::unique_lock<std::mutex> guard;
+	uint64_t held = ~0ull;
+	const uint32_t *texels = nullptr;
+	for (int k = 0; k < 4; k++) {
+		int x = k & 1 ? x1 : x0;
+		int y = k & 2 ? y1 : y0;
+		uint64_t key = tile_key(file, l.first_tile + uint64_t(y / CACHE_TILE) * l.tiles_x + x / CACHE_TILE);
+		if (key != held) {
+			if (guard.owns_lock())
+				guard.unlock();
+			shard& s = shard_for(key);
+			guard = std::unique_lock<std::mutex>(s.lock);
+			texels = find(s, key, guard);
+			held = key;
+		}
+		out[k] = decode_texel(format, texels, CACHE_TILE, x % CACHE_TILE, y % CACHE_TILE);
+	}
+}
+
+void texture_cache::clear() {
+	for (int i = 0; i < SHARDS; i++) {
+		std::lock_guard<std::mutex> guard(shards[i].lock);
+		shards[i].lru.clear();
+		shards[i].tiles.clear();
+		shards[i].bytes = 0;
+	}
+	for (size_t i = 0; i < files.size(); i++)
+		fclose(files[i]->fp);
+	files.clear();
+}
+
+texture_cache::stats texture_cache::get_stats() {
+	stats st = {};
+	for (int i = 0; i < SHARDS; i++) {
+		std::lock_guard<std::mutex> guard(shards[i].lock);
+		st.lookups += shards[i].lookups;
+		st.hits += shards[i].hits;
+		st.misses += shards[i].misses;
+		st.evictions += shards[i].evictions;
+		st.bytes_read += shards[i].bytes_read;
+		st.resident += shards[i].bytes;
+	}
+	return st;
+}
+
+void texture_cache::reset_stats() {
+	for (int i = 0; i < SHARDS; i++) {
+		std::lock_guard<std::mutex> guard(shards[i].lock);
+		shards[i].lookups = shards[i].hits = shards[i].misses = shards[i].evictions = shards[i].bytes_read = 0;
+	}
+}
+
+void texture_cache::print_stats(std::ostream& out) {
+	if (files.empty())
+		return;
+	stats st = get_stats();
+	out << "Texture cache: " << st.lookups << " tile lookups, "
+		<< (st.lookups ? 100.0 * st.hits / st.lookups : 0.0) << "% hits, "
+		<< st.misses << " tiles read (" << st.bytes_read / (1024.0 * 1024.0) << " MB), "
+		<< st.evictions << " evicted, "
+		<< st.resident / (1024.0 * 1024.0) << " of " << budget_bytes / (1024.0 * 1024.0) << " MB resident" << std::endl;
+}
+
+#endif // !TEXTURECACHEH
@@ -0,0 +1,28 @@
+#ifndef THREADSH
+#define THREADSH
+
+#include <vector>
+#include <thread>
+
+// How many threads to split work of n items between, one for small jobs.
+inline size_t thread_count(size_t n, size_t min_per_thread) {
+	size_t threads = std::thread::hardware_concurrency();
+	threads = threads ? threads : 1;
+	return n < threads * min_per_thread ? 1 : threads;
+}
+
+// Runs fn(t) for t in [0, threads), each on its own thread.
+template <class F>
+void run_threads(size_t threads, F fn) {
+	if (threads == 1) {
+		fn(size_t(0));
+		return;
+	}
+	std::vector<std::thread> pool;
+	for (size_t t = 0; t < threads; t++)
+		pool.emplace_back(fn, t);
+	for (size_t t = 0; t < threads; t++)
+		pool[t].join();
+}
+
+#endif // !THREADSH
@@ -0,0 +1,154 @@
+#ifndef TRANSFORMH
+#define TRANSFORMH
+
+#include "hitable.h"
+#include "bvh.h"
+#include "arena.h"
+#include "matrix.h"
+
+// General affine instance. Holds the object-to-world matrix along with its
+// inverse and normal matrix so a hit only costs one matrix-vector product
+// per ray component instead of a chain of translate/rotate_y wrappers.
+class transform final : public hitable {
+public:
+	transform(hitable *p, const mat34& object_to_world);
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+	virtual bool bounding_box(float t0, float t1, aabb& box) const {
+		box = bbox;
+		return hasbox;
+	}
+	virtual bool interval(const ray& r, float& t_in, float& t_out) const {
+		return ptr->interval(to_local(r), t_in, t_out);
+	}
+	virtual float transmittance(const ray& r, float t_min, float t_max) const {
+		return ptr->transmittance(to_local(r), t_min, t_max);
+	}
+	inline ray to_local(const ray& r) const {
+		// direction is not renormalised, so t is the same in both spaces
+		return ray(inv_xf.transform_point(r.origin()), inv_xf.transform_vector(r.direction()), r.time());
+	}
+	inline void to_world(hit_record& rec) const {
+		rec.p = xf.transform_point(rec.p);
+		rec.normal = unit_vector(normal_xf.transform_vector(rec.normal));
+	}
+	hitable *ptr;
+	mat34 xf;		// object to world
+	mat34 inv_xf;	// world to object
+	mat34 normal_xf;
+	bool hasbox;
+	aabb bbox;
+};
+
+// grows box by the 8 transformed corners of b
+void expand_transformed_box(const aabb& b, const mat34& m, vec3& min, vec3& max) {
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 2; j++) {
+			for (int k = 0; k < 2; k++) {
+				vec3 corner(i ? b.max().x() : b.min().x(),
+					j ? b.max().y() : b.min().y(),
+					k ? b.max().z() : b.min().z());
+				vec3 tester = m.transform_point(corner);
+				for (int c = 0; c < 3; c++) {
+					if (tester[c] > max[c])
+						max[c] = tester[c];
+					if (tester[c] < min[c])
+						min[c] = tester[c];
+				}
+			}
+		}
+	}
+}
+
+// Transforming the corners of a single box blows it up under rotation, so for
+// bvh children we walk a few levels down and union the transformed child boxes.
+bool transformed_bounds(const hitable *p, const mat34& m, int depth, vec3& min, vec3& max) {
+	const bvh_node *node = dynamic_cast<const bvh_node *>(p);
+	if (node && depth > 0) {
+		bool ok = transformed_bounds(node->left, m, depth - 1, min, max);
+		if (node->right != node->left)
+			ok = transformed_bounds(node->right, m, depth - 1, min, max) && ok;
+		return ok;
+	}
+	aabb b;
+	if (!p->bounding_box(0.0f, 1.0f, b))
+		return false;
+	expand_transformed_box(b, m, min, max);
+	return true;
+}
+
+transform::transform(hitable *p, const mat34& object_to_world) : ptr(p), xf(object_to_world) {
+	// stacking a transform on a transform just composes the matrices
+	if (transform *child = dynamic_cast<transform *>(p)) {
+		ptr = child->ptr;
+		xf = object_to_world * child->xf;
+	}
+	inv_xf = xf.inverse();
+	normal_xf = xf.normal_matrix();
+	vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+	vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	hasbox = transformed_bounds(ptr, xf, 4, min, max);
+	bbox = aabb(min, max);
+}
+
+bool transform::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	ray local_r = to_local(r);
+	if (ptr->hit(local_r, t_min, t_max, rec)) {
+		if (rec.resolved || rec.inst_count == MAX_INSTANCE_DEPTH) {
+			// nested too deep (or below an old-style wrapper), so evaluate now
+			::surface_interaction(local_r, rec);
+			to_world(rec);
+		}
+		else
+			rec.inst[rec.inst_count++] = this;
+		return true;
+	}
+	else
+		return false;
+}
+
+void surface_interaction(const ray& r, hit_record& rec) {
+	if (rec.resolved)
+		return;
+	COUNT_HIT(surfaces);
+	ray local_r = r;
+	for (int i = rec.inst_count - 1; i >= 0; i--)
+		local_r = rec.inst[i]->to_local(local_r);
+	rec.uv_density = 0.0f;
+	rec.obj->surface_interaction(local_r, rec);
+	for (int i = 0; i < rec.inst_count; i++)
+		rec.inst[i]->to_world(rec);
+	if (rec.flip)
+		rec.normal = -rec.normal;
+	rec.inst_count = 0;
+	rec.flip = false;
+	rec.resolved = true;
+}
+
+// Collapses translate/rotate_y/transform chains into a single transform node.
+// Anything else is returned untouched.
+hitable *collapse_transforms(hitable *p, arena *mem = nullptr) {
+	mat34 m = mat34::identity();
+	bool wrapped = false;
+	for (;;) {
+		if (translate *t = dynamic_cast<translate *>(p)) {
+			m = m * mat34::translation(t->offset);
+			p = t->ptr;
+		}
+		else if (rotate_y *ry = dynamic_cast<rotate_y *>(p)) {
+			m = m * mat34::rotation_y(ry->sin_theta, ry->cos_theta);
+			p = ry->ptr;
+		}
+		else if (transform *tr = dynamic_cast<transform *>(p)) {
+			m = m * tr->xf;
+			p = tr->ptr;
+		}
+		else
+			break;
+		wrapped = true;
+	}
+	if (!wrapped)
+		return p;
+	return arena_new<transform>(mem, p, m);
+}
+
+#endif // !TRANSFORMH
@@ -12,20 +12,20 @@ public:
 	//a---------b
 	//
 	triangle() {}
-	triangle(vec3 _a, vec3 _b, vec3 _c, material *t) : a(_a), b(_b), c(_c), mat(t) {}
+	triangle(vec3 _a, vec3 _b, vec3 _c, material_id m) : a(_a), b(_b), c(_c), mat(m) {}
 	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const;
 	virtual bool bounding_box(float t0, float t1, aabb& box) const;
 	
 	// Vertices
 	vec3 a, b, c;
-	material *mat;
+	material_id mat;
 };
 
 bool triangle::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
 	//extract edge vectors from vertices of triangle
 	vec3 v0 = b - a;
 	vec3 v1 = c - a;
-	vec3 normal = cross(v0, v1);
 	//vec3 q = cross(r.direction(), v1);
 	//float a_2 = dot(v0, q);
 	//float eps = 0.00001;
@@ -38,8 +38,6 @@ bool triangle::hit(const ray& r, float t_min, float t_max, hit_record& rec) cons
 	//vec3 r = cross(s, v0);
 	//float t, u, v = 0;
 
-	float d = dot(normal, a);
-
 	// this tells us how steep of an angle our ray is approaching the front of the triangle
 	//float denom = dot(normal, r.direction());
 	// reject rays that wont hit triangle
@@ -54,12 +52,11 @@ bool triangle::hit(const ray& r, float t_min, float t_max, hit_record& rec) cons
 	vec3 tvec = r.origin() - a;
 	vec3 qvec = cross(tvec, v0);
 	float t_2 = dot(v1, qvec) * invDet;
-	if (t_2 < 0) return false;
+	if (!(t_2 >= t_min && t_2 <= t_max)) return false;	// NaN too, for rays in the triangle's plane
 	float u_2 = dot(tvec, pvec) *invDet;
 	if (u_2 < 0 || u_2 > 1) return false;
 	float v_2 = dot(r.direction(), qvec) * invDet;
 	if (v_2 < 0 || u_2 + v_2 > 1) return false;
-	vec3 phit_2 = r.point_at_parameter(t_2);
 	
 
 	//float d = dot(normal, a); // Ax + By + Cz = d
@@ -93,13 +90,22 @@ bool triangle::hit(const ray& r, float t_min, float t_max, hit_record& rec) cons
 	*/
 	rec.u = u_2;
 	rec.v = v_2;
-	rec.t = t_2;
-	rec.p = phit_2;
-	rec.mat_ptr = mat;
-	rec.normal = normal;
+	rec.set_hit(t_2, this);
 	return true;
 }
 
+void triangle::surface_interaction(const ray& r, hit_record& rec) const {
+	// u, v are already the barycentrics from hit()
+	rec.p = r.point_at_parameter(rec.t);
+	rec.mat = mat;
+	vec3 n = cross(b - a, c - a);
+	float doubled_area = n.length();
+	// unit length like every other normal, scatter() builds directions from it
+	rec.normal = n / doubled_area;
+	// the barycentrics span roughly the square root of the (doubled) area
+	rec.uv_density = 1.0f / sqrt(doubled_area);
+}
+
 bool triangle::bounding_box(float t0, float t1, aabb& box) const {
 	/*
 	x0 y1			x1 y1
@@ -5,14 +5,70 @@
 #include <stdlib.h>
 #include <iostream>
 
-class vec3 {
+// vec3 is a padded float4 kept in one SSE/NEON register. Define VEC3_SCALAR to
+// build the plain C++ version instead.
+#if !defined(VEC3_SCALAR) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define VEC3_SSE
+#include <emmintrin.h>
+#elif !defined(VEC3_SCALAR) && (defined(__ARM_NEON) || defined(_M_ARM64))
+#define VEC3_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(VEC3_SSE)
+typedef __m128 simd4f;
+inline simd4f simd4_set(float x, float y, float z) { return _mm_set_ps(0.0f, z, y, x); }
+inline simd4f simd4_set1(float s) { return _mm_set1_ps(s); }
+inline simd4f simd4_add(simd4f a, simd4f b) { return _mm_add_ps(a, b); }
+inline simd4f simd4_sub(simd4f a, simd4f b) { return _mm_sub_ps(a, b); }
+inline simd4f simd4_mul(simd4f a, simd4f b) { return _mm_mul_ps(a, b); }
+// the padding lane would come out as 0/0, so it gets masked back to zero
+inline simd4f simd4_div(simd4f a, simd4f b) { return _mm_and_ps(_mm_div_ps(a, b), _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1))); }
+// a lane where a is nan takes b
+inline simd4f simd4_min(simd4f a, simd4f b) { return _mm_min_ps(a, b); }
+inline simd4f simd4_max(simd4f a, simd4f b) { return _mm_max_ps(a, b); }
+inline simd4f simd4_yzx(simd4f a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+inline simd4f simd4_zxy(simd4f a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2)); }
+inline float simd4_x(simd4f a) { return _mm_cvtss_f32(a); }
+inline float simd4_y(simd4f a) { return _mm_cvtss_f32(_mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1))); }
+inline float simd4_z(simd4f a) { return _mm_cvtss_f32(_mm_movehl_ps(a, a)); }
+#elif defined(VEC3_NEON)
+typedef float32x4_t simd4f;
+inline simd4f simd4_set(float x, float y, float z) { float f[4] = { x, y, z, 0.0f }; return vld1q_f32(f); }
+inline simd4f simd4_set1(float s) { return vdupq_n_f32(s); }
+inline simd4f simd4_add(simd4f a, simd4f b) { return vaddq_f32(a, b); }
+inline simd4f simd4_sub(simd4f a, simd4f b) { return vsubq_f32(a, b); }
+inline simd4f simd4_mul(simd4f a, simd4f b) { return vmulq_f32(a, b); }
+inline simd4f simd4_div(simd4f a, simd4f b) { return vsetq_lane_f32(0.0f, vdivq_f32(a, b), 3); }
+inline simd4f simd4_min(simd4f a, simd4f b) { return vbslq_f32(vcltq_f32(a, b), a, b); }
+inline simd4f simd4_max(simd4f a, simd4f b) { return vbslq_f32(vcgtq_f32(a, b), a, b); }
+inline simd4f simd4_yzx(simd4f a) { return vsetq_lane_f32(0.0f, vsetq_lane_f32(vgetq_lane_f32(a, 0), vextq_f32(a, a, 1), 2), 3); }
+inline simd4f simd4_zxy(simd4f a) { return vsetq_lane_f32(0.0f, vsetq_lane_f32(vgetq_lane_f32(a, 2), vextq_f32(a, a, 3), 0), 3); }
+inline float simd4_x(simd4f a) { return vgetq_lane_f32(a, 0); }
+inline float simd4_y(simd4f a) { return vgetq_lane_f32(a, 1); }
+inline float simd4_z(simd4f a) { return vgetq_lane_f32(a, 2); }
+#else
+struct simd4f { float f[4]; };
+inline simd4f simd4_set(float x, float y, float z) { simd4f r = { { x, y, z, 0.0f } }; return r; }
+inline simd4f simd4_set1(float s) { simd4f r = { { s, s, s, s } }; return r; }
+inline simd4f simd4_add(simd4f a, simd4f b) { return simd4_set(a.f[0] + b.f[0], a.f[1] + b.f[1], a.f[2] + b.f[2]); }
+inline simd4f simd4_sub(simd4f a, simd4f b) { return simd4_set(a.f[0] - b.f[0], a.f[1] - b.f[1], a.f[2] - b.f[2]); }
+inline simd4f simd4_mul(simd4f a, simd4f b) { return simd4_set(a.f[0] * b.f[0], a.f[1] * b.f[1], a.f[2] * b.f[2]); }
+inline simd4f simd4_div(simd4f a, simd4f b) { return simd4_set(a.f[0] / b.f[0], a.f[1] / b.f[1], a.f[2] / b.f[2]); }
+inline simd4f simd4_min(simd4f a, simd4f b) { return simd4_set(a.f[0] < b.f[0] ? a.f[0] : b.f[0], a.f[1] < b.f[1] ? a.f[1] : b.f[1], a.f[2] < b.f[2] ? a.f[2] : b.f[2]); }
+inline simd4f simd4_max(simd4f a, simd4f b) { return simd4_set(a.f[0] > b.f[0] ? a.f[0] : b.f[0], a.f[1] > b.f[1] ? a.f[1] : b.f[1], a.f[2] > b.f[2] ? a.f[2] : b.f[2]); }
+inline simd4f simd4_yzx(simd4f a) { return simd4_set(a.f[1], a.f[2], a.f[0]); }
+inline simd4f simd4_zxy(simd4f a) { return simd4_set(a.f[2], a.f[0], a.f[1]); }
+inline float simd4_x(simd4f a) { return a.f[0]; }
+inline float simd4_y(simd4f a) { return a.f[1]; }
+inline float simd4_z(simd4f a) { return a.f[2]; }
+#endif
+
+class alignas(16) vec3 {
 public:
 	vec3() {}
-	vec3(float e0, float e1, float e2) {
-		e[0] = e0;
-		e[1] = e1;
-		e[2] = e2;
-	}
+	vec3(float e0, float e1, float e2) : v(simd4_set(e0, e1, e2)) {}
+	explicit vec3(simd4f r) : v(r) {}
 	inline float x() const { return e[0]; }
 	inline float y() const { return e[1]; }
 	inline float z() const { return e[2]; }
@@ -21,7 +77,7 @@ public:
 	inline float b() const { return e[2]; }
 
 	inline const vec3& operator+() const { return *this; }
-	inline vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+	inline vec3 operator-() const { return vec3(simd4_sub(simd4_set1(0.0f), v)); }
 	inline float operator[](int i) const { return e[i]; }
 	inline float& operator[](int i) { return e[i]; }
 
@@ -32,15 +88,14 @@ public:
 	inline vec3& operator*=(const float t);
 	inline vec3& operator/=(const float t);
 
-	inline float length() const {
-		return sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
-	}
-	inline float squared_length() const {
-		return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
-	}
+	inline float length() const;
+	inline float squared_length() const;
 	inline void make_unit_vector();
 
-	float e[3];
+	union {
+		simd4f v;
+		float e[4];	// e[3] is padding, undefined after vec3() and never read
+	};
 };
 
 inline std::istream& operator>>(std::istream &is, vec3 &t) {
@@ -53,92 +108,105 @@ inline std::ostream& operator<<(std::ostream &os, const vec3 &t) {
 	return os;
 }
 
-inline void vec3::make_unit_vector() {
-	float k = 1.0f / sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
-	e[0] *= k;
-	e[1] *= k;
-	e[2] *= k;
-}
-
 inline vec3 operator+(const vec3 &v1, const vec3 &v2) {
-	return vec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]);
+	return vec3(simd4_add(v1.v, v2.v));
 }
 
 inline vec3 operator-(const vec3 &v1, const vec3 &v2) {
-	return vec3(v1.e[0] - v2.e[0], v1.e[1] - v2.e[1], v1.e[2] - v2.e[2]);
+	return vec3(simd4_sub(v1.v, v2.v));
 }
 
 inline vec3 operator*(const vec3 &v1, const vec3 &v2) {
-	return vec3(v1.e[0] * v2.e[0], v1.e[1] * v2.e[1], v1.e[2] * v2.e[2]);
+	return vec3(simd4_mul(v1.v, v2.v));
 }
 
 inline vec3 operator/(const vec3 &v1, const vec3 &v2) {
-	return vec3(v1.e[0] / v2.e[0], v1.e[1] / v2.e[1], v1.e[2] / v2.e[2]);
+	return vec3(simd4_div(v1.v, v2.v));
 }
 
 inline vec3 operator*(float t, const vec3 &v) {
-	return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+	return vec3(simd4_mul(simd4_set1(t), v.v));
 }
 
+// one divide and a multiply instead of three divides
 inline vec3 operator/(vec3 v, float t) {
-	return vec3(v.e[0] / t, v.e[1] / t, v.e[2] / t);
+	return vec3(simd4_mul(v.v, simd4_set1(1.0f / t)));
 }
 
 inline vec3 operator*(const vec3 &v, float t) {
-	return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+	return vec3(simd4_mul(v.v, simd4_set1(t)));
 }
 
 inline float dot(const vec3 &v1, const vec3 &v2) {
-	return v1.e[0] * v2.e[0] + v1.e[1] * v2.e[1] + v1.e[2] * v2.e[2];
+	simd4f m = simd4_mul(v1.v, v2.v);
+	return simd4_x(m) + simd4_y(m) + simd4_z(m);
 }
 
 inline vec3 cross(const vec3 &v1, const vec3 & v2) {
-	return vec3((v1.e[1] * v2.e[2] - v1.e[2] * v2.e[1]),
-		(-(v1.e[0] * v2.e[2] - v1.e[2] * v2.e[0])),
-		(v1.e[0] * v2.e[1] - v1.e[1] * v2.e[0]));
+	return vec3(simd4_sub(simd4_mul(simd4_yzx(v1.v), simd4_zxy(v2.v)),
+		simd4_mul(simd4_zxy(v1.v), simd4_yzx(v2.v))));
+}
+
+// per component min/max, a nan in v1 gives the component from v2
+inline vec3 vmin(const vec3 &v1, const vec3 &v2) {
+	return vec3(simd4_min(v1.v, v2.v));
 }
 
-inline vec3& vec3::operator+=(const vec3 &v) {
-	e[0] += v.e[0];
-	e[1] += v.e[1];
-	e[2] += v.e[2];
+inline vec3 vmax(const vec3 &v1, const vec3 &v2) {
+	return vec3(simd4_max(v1.v, v2.v));
+}
+
+inline float min_component(const vec3 &v) {
+	float a = simd4_x(v.v), b = simd4_y(v.v), c = simd4_z(v.v);
+	float m = a < b ? a : b;
+	return m < c ? m : c;
+}
+
+inline float max_component(const vec3 &v) {
+	float a = simd4_x(v.v), b = simd4_y(v.v), c = simd4_z(v.v);
+	float m = a > b ? a : b;
+	return m > c ? m : c;
+}
+
+inline float vec3::length() const {
+	return sqrt(dot(*this, *this));
+}
+
+inline float vec3::squared_length() const {
+	return dot(*this, *this);
+}
+
+inline void vec3::make_unit_vector() {
+	v = simd4_mul(v, simd4_set1(1.0f / length()));
+}
+
+inline vec3& vec3::operator+=(const vec3 &v2) {
+	v = simd4_add(v, v2.v);
 	return *this;
 }
 
-inline vec3& vec3::operator*=(const vec3 &v) {
-	e[0] *= v.e[0];
-	e[1] *= v.e[1];
-	e[2] *= v.e[2];
+inline vec3& vec3::operator*=(const vec3 &v2) {
+	v = simd4_mul(v, v2.v);
 	return *this;
 }
 
-inline vec3& vec3::operator/=(const vec3 &v) {
-	e[0] /= v.e[0];
-	e[1] /= v.e[1];
-	e[2] /= v.e[2];
+inline vec3& vec3::operator/=(const vec3 &v2) {
+	v = simd4_div(v, v2.v);
 	return *this;
 }
 
-inline vec3& vec3::operator-=(const vec3 &v) {
-	e[0] -= v.e[0];
-	e[1] -= v.e[1];
-	e[2] -= v.e[2];
+inline vec3& vec3::operator-=(const vec3 &v2) {
+	v = simd4_sub(v, v2.v);
 	return *this;
 }
 
 inline vec3& vec3::operator*=(const float t) {
-	e[0] *= t;
-	e[1] *= t;
-	e[2] *= t;
+	v = simd4_mul(v, simd4_set1(t));
 	return *this;
 }
 
 inline vec3& vec3::operator/=(const float t) {
-	float k = 1.0f / t;
-
-	e[0] *= k;
-	e[1] *= k;
-	e[2] *= k;
+	v = simd4_mul(v, simd4_set1(1.0f / t));
 	return *this;
 }
 
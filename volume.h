@@ -0,0 +1,246 @@
+#ifndef VOLUMEH
+#define VOLUMEH
+
+#include "hitable.h"
+#include "material.h"
+#include "memory_stats.h"
+
+float get_rand();
+
+const uint32_t EMPTY_BRICK = ~0u;
+
+// Density sampled on a voxel grid over the unit cube, stored sparsely: the
+// grid is cut into bricks of BRICK^3 voxels and bricks that are all zero are
+// not stored. Each brick also keeps its majorant, the largest density a
+// lookup anywhere inside it can return, for grid_medium to track against.
+class density_grid {
+public:
+	static const int BRICK = 8;
+	density_grid() : nx(0), ny(0), nz(0), bx(0), by(0), bz(0) {}
+	// f(p) for p at every voxel centre of an x by y by z grid
+	template <class F>
+	void build(int x, int y, int z, F f);
+	// trilinear between voxel centres, p in [0,1]^3
+	float density(const vec3& p) const;
+	float majorant(int i, int j, int k) const { return majorants[(size_t(k) * by + j) * bx + i]; }
+	size_t brick_count() const { return voxels.size() / (BRICK * BRICK * BRICK); }
+
+	int nx, ny, nz;		// voxels
+	int bx, by, bz;		// bricks
+
+private:
+	float voxel(int i, int j, int k) const {
+		uint32_t b = bricks[(size_t(k / BRICK) * by + j / BRICK) * bx + i / BRICK];
+		if (b == EMPTY_BRICK)
+			return 0.0f;
+		return voxels[b + ((k % BRICK) * BRICK + j % BRICK) * BRICK + i % BRICK];
+	}
+	tracked_vector<uint32_t, MEM_VOLUMES> bricks;	// where each brick's voxels start, or EMPTY_BRICK
+	tracked_vector<float, MEM_VOLUMES> voxels;
+	tracked_vector<float, MEM_VOLUMES> majorants;
+};
+
+template <class F>
+void density_grid::build(int x, int y, int z, F f) {
+	nx = x;
+	ny = y;
+	nz = z;
+	bx = (nx + BRICK - 1) / BRICK;
+	by = (ny + BRICK - 1) / BRICK;
+	bz = (nz + BRICK - 1) / BRICK;
+	bricks.assign(size_t(bx) * by * bz, EMPTY_BRICK);
+	voxels.clear();
+	float brick[BRICK * BRICK * BRICK];
+	for (int k = 0; k < bz; k++) {
+		for (int j = 0; j < by; j++) {
+			for (int i = 0; i < bx; i++) {
+				bool any = false;
+				for (int vk = 0; vk < BRICK; vk++) {
+					for (int vj = 0; vj < BRICK; vj++) {
+						for (int vi = 0; vi < BRICK; vi++) {
+							int gi = i * BRICK + vi, gj = j * BRICK + vj, gk = k * BRICK + vk;
+							float d = 0.0f;
+							if (gi < nx && gj < ny && gk < nz)
+								d = fmaxf(0.0f, f(vec3((gi + 0.5f) / nx, (gj + 0.5f) / ny, (gk + 0.5f) / nz)));
+							brick[(vk * BRICK + vj) * BRICK + vi] = d;
+							any = any || d > 0.0f;
+						}
+					}
+				}
+				if (!any)
+					continue;
+				bricks[(size_t(k) * by + j) * bx + i] = uint32_t(voxels.size());
+				voxels.insert(voxels.end(), brick, brick + BRICK * BRICK * BRICK);
+			}
+		}
+	}
+	// a lookup inside a brick blends voxels up to one past its edges
+	majorants.assign(bricks.size(), 0.0f);
+	for (int k = 0; k < bz; k++) {
+		for (int j = 0; j < by; j++) {
+			for (int i = 0; i < bx; i++) {
+				float m = 0.0f;
+				for (int gk = k * BRICK - 1; gk <= (k + 1) * BRICK; gk++)
+					for (int gj = j * BRICK - 1; gj <= (j + 1) * BRICK; gj++)
+						for (int gi = i * BRICK - 1; gi <= (i + 1) * BRICK; gi++)
+							if (gi >= 0 && gi < nx && gj >= 0 && gj < ny && gk >= 0 && gk < nz)
+								m = fmaxf(m, voxel(gi, gj, gk));
+				majorants[(size_t(k) * by + j) * bx + i] = m;
+			}
+		}
+	}
+}
+
+float density_grid::density(const vec3& p) const {
+	float x = p.x() * nx - 0.5f, y = p.y() * ny - 0.5f, z = p.z() * nz - 0.5f;
+	int i = int(floor(x)), j = int(floor(y)), k = int(floor(z));
+	float u = x - i, v = y - j, w = z - k;
+	// clamped to the edge voxels, as the majorants were
+	int i0 = i < 0 ? 0 : (i < nx ? i : nx - 1), i1 = i + 1 < 0 ? 0 : (i + 1 < nx ? i + 1 : nx - 1);
+	int j0 = j < 0 ? 0 : (j < ny ? j : ny - 1), j1 = j + 1 < 0 ? 0 : (j + 1 < ny ? j + 1 : ny - 1);
+	int k0 = k < 0 ? 0 : (k < nz ? k : nz - 1), k1 = k + 1 < 0 ? 0 : (k + 1 < nz ? k + 1 : nz - 1);
+	float c00 = voxel(i0, j0, k0) * (1 - u) + voxel(i1, j0, k0) * u;
+	float c10 = voxel(i0, j1, k0) * (1 - u) + voxel(i1, j1, k0) * u;
+	float c01 = voxel(i0, j0, k1) * (1 - u) + voxel(i1, j0, k1) * u;
+	float c11 = voxel(i0, j1, k1) * (1 - u) + voxel(i1, j1, k1) * u;
+	return (c00 * (1 - v) + c10 * v) * (1 - w) + (c01 * (1 - v) + c11 * v) * w;
+}
+
+// A medium whose density is a density_grid stretched over the box from pmin
+// to pmax, times scale, scattering like constant_medium through an isotropic
+// material. Rays walk the bricks they cross (Amanatides and Woo) and skip
+// empty ones; inside the others they take exponential steps against the
+// brick's majorant. Free flights come from delta tracking, which keeps a
+// tentative collision with probability density / majorant, and
+// transmittance from ratio tracking, which multiplies 1 - density / majorant
+// over all of them (Novak et al., "Monte Carlo methods for volumetric light
+// transport simulation"). Either way the steps taken follow the optical
+// depth crossed, not the number of voxels.
+class grid_medium : public hitable {
+public:
+	grid_medium(const density_grid *g, const vec3& p0, const vec3& p1, float s, texture_id a, material_pool& mats) :
+		grid(g), pmin(p0), pmax(p1), scale(s) {
+		phase_function = mats.add(isotropic(a));
+	}
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+	virtual float transmittance(const ray& r, float t_min, float t_max) const;
+	virtual void surface_interaction(const ray& r, hit_record& rec) const {
+		rec.p = r.point_at_parameter(rec.t);
+		rec.normal = vec3(1, 0, 0); //arbitrary
+		rec.mat = phase_function;
+	}
+	virtual bool bounding_box(float t0, float t1, aabb& box) const {
+		box = aabb(pmin, pmax);
+		return true;
+	}
+	const density_grid *grid;
+	vec3 pmin, pmax;
+	float scale;
+	material_id phase_function;
+
+private:
+	float density(const vec3& p) const {
+		vec3 e = pmax - pmin;
+		return grid->density(vec3((p.x() - pmin.x()) / e.x(), (p.y() - pmin.y()) / e.y(), (p.z() - pmin.z()) / e.z()));
+	}
+	// calls visit(t0, t1, majorant) for the stretch of r in (t_min, t_max)
+	// through each brick that isn't empty, in order, until it returns true
+	template <class F>
+	bool walk(const ray& r, float t_min, float t_max, F visit) const;
+};
+
+template <class F>
+bool grid_medium::walk(const ray& r, float t_min, float t_max, F visit) const {
+	// the slab test, as box::interval
+	float t0 = t_min, t1 = t_max;
+	for (int a = 0; a < 3; a++) {
+		float invD = 1.0f / r.direction()[a];
+		float ta = (pmin[a] - r.origin()[a]) * invD;
+		float tb = (pmax[a] - r.origin()[a]) * invD;
+		if (invD < 0.0f)
+			std::swap(ta, tb);
+		t0 = ta > t0 ? ta : t0;
+		t1 = tb < t1 ? tb : t1;
+		if (t1 <= t0)
+			return false;
+	}
+	int n[3] = { grid->bx, grid->by, grid->bz };
+	int voxels[3] = { grid->nx, grid->ny, grid->nz };
+	vec3 p = r.point_at_parameter(t0);
+	int cell[3], step[3];
+	float t_next[3], t_delta[3];
+	for (int a = 0; a < 3; a++) {
+		float size = (pmax[a] - pmin[a]) * density_grid::BRICK / voxels[a];
+		int c = int((p[a] - pmin[a]) / size);
+		cell[a] = c < 0 ? 0 : (c < n[a] ? c : n[a] - 1);
+		float d = r.direction()[a];
+		step[a] = d < 0.0f ? -1 : 1;
+		if (d == 0.0f) {
+			t_next[a] = FLT_MAX;
+			t_delta[a] = FLT_MAX;
+			continue;
+		}
+		float edge = pmin[a] + (cell[a] + (d > 0.0f ? 1 : 0)) * size;
+		t_next[a] = t0 + (edge - p[a]) / d;
+		t_delta[a] = size / fabs(d);
+	}
+	float t = t0;
+	for (;;) {
+		int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+		float t_exit = t_next[a] < t1 ? t_next[a] : t1;
+		float m = grid->majorant(cell[0], cell[1], cell[2]) * scale;
+		if (m > 0.0f && t_exit > t && visit(t, t_exit, m))
+			return true;
+		if (t_exit >= t1)
+			return false;
+		cell[a] += step[a];
+		if (cell[a] < 0 || cell[a] >= n[a])
+			return false;
+		t = t_exit;
+		t_next[a] += t_delta[a];
+	}
+}
+
+bool grid_medium::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	float length = r.direction().length();
+	float t_hit = 0.0f;
+	bool found = walk(r, t_min, t_max, [&](float t0, float t1, float m) {
+		// steps are memoryless, so each brick starts afresh from where the ray enters it
+		for (float t = t0;;) {
+			t -= log(1.0f - get_rand()) / (m * length);
+			if (t >= t1)
+				return false;
+			if (get_rand() * m < scale * density(r.point_at_parameter(t))) {
+				t_hit = t;
+				return true;
+			}
+		}
+	});
+	if (found)
+		rec.set_hit(t_hit, this);
+	return found;
+}
+
+float grid_medium::transmittance(const ray& r, float t_min, float t_max) const {
+	float length = r.direction().length();
+	float through = 1.0f;
+	walk(r, t_min, t_max, [&](float t0, float t1, float m) {
+		for (float t = t0;;) {
+			t -= log(1.0f - get_rand()) / (m * length);
+			if (t >= t1)
+				return false;
+			through *= 1.0f - scale * density(r.point_at_parameter(t)) / m;
+			// once little is left, stop half the time and double it otherwise
+			if (through < 0.1f) {
+				if (get_rand() < 0.5f) {
+					through = 0.0f;
+					return true;
+				}
+				through *= 2.0f;
+			}
+		}
+	});
+	return through;
+}
+
+#endif // !VOLUMEH